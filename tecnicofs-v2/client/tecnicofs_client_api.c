@@ -0,0 +1,404 @@
+#include "tecnicofs_client_api.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* State of the mount of the process (there is at most one) */
+static bool mounted;
+static char client_path[TFS_PATH_MAX];
+static char request_path[TFS_PATH_MAX + sizeof(TFS_REQUEST_PIPE_SUFFIX)];
+static int reply_fd = -1;
+static int request_fd = -1;
+static tfs_shm_t *shm; /* NULL if requests go through the pipes */
+static unsigned mount_count;
+
+/* Serializes the requests that go through the pipes */
+static pthread_mutex_t lock_pipes = PTHREAD_MUTEX_INITIALIZER;
+
+/* Threads waiting for a free slot sleep on slot_freed, and are woken by
+ * whoever frees one while slot_waiters says there are any */
+static pthread_mutex_t lock_slots = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_freed = PTHREAD_COND_INITIALIZER;
+static _Atomic size_t slot_waiters;
+
+/* Slot the calling thread used last, tried first */
+static _Thread_local size_t slot_hint;
+
+static void slot_wake_waiters() {
+    if (atomic_load(&slot_waiters) > 0) {
+        pthread_mutex_lock(&lock_slots);
+        pthread_cond_broadcast(&slot_freed);
+        pthread_mutex_unlock(&lock_slots);
+    }
+}
+
+/*
+ * Claims a free slot, if there is one
+ * Returns the slot, or NULL if there is none (with closed set if the
+ * server ended the session)
+ */
+static tfs_slot_t *slot_try_claim(bool *closed) {
+    for (size_t i = 0; i < TFS_SHM_SLOTS; i++) {
+        size_t index = (slot_hint + i) % TFS_SHM_SLOTS;
+        tfs_slot_t *slot = &shm->shm_slots[index];
+        uint32_t expected = TFS_SLOT_FREE;
+        if (atomic_compare_exchange_strong(&slot->s_state, &expected,
+                                           TFS_SLOT_CLAIMED)) {
+            slot_hint = index;
+            return slot;
+        }
+        if (expected == TFS_SLOT_CLOSED) {
+            *closed = true;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Claims a free slot, waiting for one if they are all in use
+ * Returns the slot, or NULL if the server ended the session
+ */
+static tfs_slot_t *slot_claim() {
+    bool closed = false;
+    tfs_slot_t *slot = slot_try_claim(&closed);
+    if (slot != NULL || closed) {
+        return slot;
+    }
+
+    pthread_mutex_lock(&lock_slots);
+    atomic_fetch_add(&slot_waiters, 1);
+    while ((slot = slot_try_claim(&closed)) == NULL && !closed) {
+        pthread_cond_wait(&slot_freed, &lock_slots);
+    }
+    atomic_fetch_sub(&slot_waiters, 1);
+    pthread_mutex_unlock(&lock_slots);
+    return slot;
+}
+
+/*
+ * Carries out a request through a slot (see request_send())
+ */
+static ssize_t request_send_shm(tfs_request_t const *request,
+                                void const *payload, void *out) {
+    tfs_slot_t *slot = slot_claim();
+    if (slot == NULL) {
+        return -1;
+    }
+
+    slot->s_request = *request;
+    if (payload != NULL) {
+        memcpy(slot->s_data, payload, (size_t)request->r_len);
+    }
+    atomic_store_explicit(&slot->s_state, TFS_SLOT_REQUEST,
+                          memory_order_release);
+    futex_wake(&slot->s_state);
+
+    uint32_t state = TFS_SLOT_REQUEST;
+    while (state == TFS_SLOT_REQUEST) {
+        state = futex_wait_change(&slot->s_state, state);
+    }
+    if (state != TFS_SLOT_RESPONSE) {
+        /* The slot stays closed, and so will the others */
+        slot_wake_waiters();
+        return -1;
+    }
+
+    ssize_t result = (ssize_t)slot->s_response.r_result;
+    if (out != NULL && result > 0) {
+        if ((uint64_t)result > request->r_len) {
+            result = -1;
+        } else {
+            memcpy(out, slot->s_data, (size_t)result);
+        }
+    }
+    atomic_store(&slot->s_state, TFS_SLOT_FREE);
+    slot_wake_waiters();
+    return result;
+}
+
+/*
+ * Carries out a request through the pipes (see request_send())
+ */
+static ssize_t request_send_pipe(tfs_request_t const *request,
+                                 void const *payload, void *out) {
+    tfs_response_t response;
+    ssize_t result = -1;
+
+    pthread_mutex_lock(&lock_pipes);
+    if (pipe_write_all(request_fd, request, sizeof(*request)) == 0 &&
+        (payload == NULL ||
+         pipe_write_all(request_fd, payload, (size_t)request->r_len) == 0) &&
+        pipe_read_all(reply_fd, &response, sizeof(response)) == 0) {
+        result = (ssize_t)response.r_result;
+        if (out != NULL && result > 0 &&
+            ((uint64_t)result > request->r_len ||
+             pipe_read_all(reply_fd, out, (size_t)result) == -1)) {
+            result = -1;
+        }
+    }
+    pthread_mutex_unlock(&lock_pipes);
+    return result;
+}
+
+/*
+ * Sends a request to the server, with its payload (payload, of r_len
+ * bytes, if not NULL), and waits for its response, whose own payload (as
+ * long as the result says) is copied to out
+ * Returns the result of the request, -1 if it could not be carried out
+ */
+static ssize_t request_send(tfs_request_t const *request, void const *payload,
+                            void *out) {
+    if (!mounted) {
+        return -1;
+    }
+    if (shm != NULL) {
+        return request_send_shm(request, payload, out);
+    }
+    return request_send_pipe(request, payload, out);
+}
+
+/*
+ * Sends a request on a path name
+ */
+static ssize_t request_send_name(int32_t op, char const *name, int flags) {
+    size_t len = strlen(name) + 1;
+    if (len > TFS_PATH_MAX) {
+        return -1;
+    }
+    tfs_request_t request = {.r_op = op, .r_flags = flags, .r_len = len};
+    return request_send(&request, name, NULL);
+}
+
+/*
+ * Sends a request on an open file, with no payload
+ */
+static ssize_t request_send_file(int32_t op, int fhandle, size_t len,
+                                 size_t offset) {
+    tfs_request_t request = {
+        .r_op = op, .r_fhandle = fhandle, .r_len = len, .r_offset = offset};
+    return request_send(&request, NULL, NULL);
+}
+
+/*
+ * Reads from or writes to an open file (from in or to out), one request of
+ * up to TFS_TRANSFER_SIZE bytes at a time, stopping at the first one that
+ * falls short
+ * Returns the number of bytes transferred, -1 if none could be
+ */
+static ssize_t file_transfer(int32_t op, int fhandle, void const *in,
+                             void *out, size_t len, size_t offset) {
+    size_t done = 0;
+    do {
+        size_t chunk = len - done;
+        if (chunk > TFS_TRANSFER_SIZE) chunk = TFS_TRANSFER_SIZE;
+        tfs_request_t request = {.r_op = op,
+                                 .r_fhandle = fhandle,
+                                 .r_len = chunk,
+                                 .r_offset = offset + done};
+        ssize_t n =
+            request_send(&request, in == NULL ? NULL : (char const *)in + done,
+                         out == NULL ? NULL : (char *)out + done);
+        if (n == -1) {
+            return done == 0 ? -1 : (ssize_t)done;
+        }
+        done += (size_t)n;
+        if ((size_t)n < chunk) break;
+    } while (done < len);
+    return (ssize_t)done;
+}
+
+/*
+ * Lets go of the pipes and shared memory of the mount
+ */
+static void mount_release() {
+    if (request_fd != -1) close(request_fd);
+    if (reply_fd != -1) close(reply_fd);
+    request_fd = -1;
+    reply_fd = -1;
+    if (shm != NULL) {
+        munmap(shm, sizeof(tfs_shm_t));
+        shm = NULL;
+    }
+    unlink(request_path);
+    unlink(client_path);
+    mounted = false;
+}
+
+/*
+ * Creates a shared memory object for the slots of a mount, named after the
+ * process, and maps it in
+ * Returns 0 if successful, -1 otherwise
+ */
+static int mount_shm_create(char *name) {
+    snprintf(name, TFS_SHM_NAME_MAX, "/tfs.%ld.%u", (long)getpid(),
+             mount_count++);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+        return -1;
+    }
+    /* A new object is all zeros, which leaves every slot free */
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, sizeof(tfs_shm_t)) == 0) {
+        p = mmap(NULL, sizeof(tfs_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+    }
+    close(fd);
+    if (p == MAP_FAILED) {
+        shm_unlink(name);
+        return -1;
+    }
+    shm = p;
+    return 0;
+}
+
+int tfs_mount_transport(char const *client_pipe_path,
+                        char const *server_pipe_path,
+                        tfs_transport_t transport) {
+    if (mounted || strlen(client_pipe_path) >= TFS_PATH_MAX) {
+        return -1;
+    }
+    strcpy(client_path, client_pipe_path);
+    snprintf(request_path, sizeof(request_path), "%s%s", client_path,
+             TFS_REQUEST_PIPE_SUFFIX);
+    if ((unlink(client_path) == -1 && errno != ENOENT) ||
+        (unlink(request_path) == -1 && errno != ENOENT)) {
+        return -1;
+    }
+    if (mkfifo(client_path, 0640) == -1) {
+        return -1;
+    }
+    if (mkfifo(request_path, 0640) == -1) {
+        unlink(client_path);
+        return -1;
+    }
+
+    tfs_mount_t mount;
+    memset(&mount, 0, sizeof(mount));
+    mount.m_op = TFS_REQ_MOUNT;
+    mount.m_transport = transport;
+    strcpy(mount.m_client_path, client_path);
+    if (transport == TFS_TRANSPORT_SHM &&
+        mount_shm_create(mount.m_shm_name) == -1) {
+        mount_release();
+        return -1;
+    }
+
+    /* The server opens the reply pipe first, as done here */
+    tfs_response_t response = {.r_result = -1};
+    int server_fd = open(server_pipe_path, O_WRONLY);
+    if (server_fd != -1) {
+        int ret = pipe_write_all(server_fd, &mount, sizeof(mount));
+        close(server_fd);
+        if (ret == 0) {
+            reply_fd = open(client_path, O_RDONLY);
+        }
+        if (reply_fd != -1) {
+            request_fd = open(request_path, O_WRONLY);
+        }
+        if (request_fd != -1 &&
+            pipe_read_all(reply_fd, &response, sizeof(response)) == -1) {
+            response.r_result = -1;
+        }
+    }
+    /* Once mapped by both, the object needs no name */
+    if (transport == TFS_TRANSPORT_SHM) {
+        shm_unlink(mount.m_shm_name);
+    }
+    if (response.r_result == -1) {
+        mount_release();
+        return -1;
+    }
+    mounted = true;
+    return 0;
+}
+
+int tfs_mount(char const *client_pipe_path, char const *server_pipe_path) {
+    if (tfs_mount_transport(client_pipe_path, server_pipe_path,
+                            TFS_TRANSPORT_SHM) == 0) {
+        return 0;
+    }
+    return tfs_mount_transport(client_pipe_path, server_pipe_path,
+                               TFS_TRANSPORT_PIPE);
+}
+
+int tfs_unmount() {
+    if (!mounted) {
+        return -1;
+    }
+    tfs_request_t request = {.r_op = TFS_REQ_UNMOUNT};
+    pthread_mutex_lock(&lock_pipes);
+    int ret = pipe_write_all(request_fd, &request, sizeof(request));
+    pthread_mutex_unlock(&lock_pipes);
+    mount_release();
+    return ret;
+}
+
+int tfs_shutdown_after_all_closed() {
+    if (!mounted) {
+        return -1;
+    }
+    /* Goes through the pipes whatever the transport */
+    tfs_request_t request = {.r_op = TFS_REQ_SHUTDOWN};
+    tfs_response_t response = {.r_result = -1};
+    pthread_mutex_lock(&lock_pipes);
+    bool answered =
+        pipe_write_all(request_fd, &request, sizeof(request)) == 0 &&
+        pipe_read_all(reply_fd, &response, sizeof(response)) == 0;
+    pthread_mutex_unlock(&lock_pipes);
+    /* A refused shutdown leaves the session as it was */
+    if (!answered || response.r_result != -1) {
+        mount_release();
+    }
+    return answered ? (int)response.r_result : -1;
+}
+
+int tfs_lookup(char const *name) {
+    return (int)request_send_name(TFS_REQ_LOOKUP, name, 0);
+}
+
+int tfs_mkdir(char const *name) {
+    return (int)request_send_name(TFS_REQ_MKDIR, name, 0);
+}
+
+int tfs_open(char const *name, int flags) {
+    return (int)request_send_name(TFS_REQ_OPEN, name, flags);
+}
+
+int tfs_close(int fhandle) {
+    return (int)request_send_file(TFS_REQ_CLOSE, fhandle, 0, 0);
+}
+
+int tfs_fsync(int fhandle) {
+    return (int)request_send_file(TFS_REQ_FSYNC, fhandle, 0, 0);
+}
+
+int tfs_fallocate(int fhandle, size_t offset, size_t len) {
+    return (int)request_send_file(TFS_REQ_FALLOCATE, fhandle, len, offset);
+}
+
+int tfs_ftruncate(int fhandle, size_t length) {
+    return (int)request_send_file(TFS_REQ_FTRUNCATE, fhandle, 0, length);
+}
+
+ssize_t tfs_write(int fhandle, void const *buffer, size_t len) {
+    return file_transfer(TFS_REQ_WRITE, fhandle, buffer, NULL, len, 0);
+}
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    return file_transfer(TFS_REQ_READ, fhandle, NULL, buffer, len, 0);
+}
+
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len,
+                   size_t offset) {
+    return file_transfer(TFS_REQ_PWRITE, fhandle, buffer, NULL, len, offset);
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    return file_transfer(TFS_REQ_PREAD, fhandle, NULL, buffer, len, offset);
+}
@@ -0,0 +1,50 @@
+#ifndef CLIENT_API_H
+#define CLIENT_API_H
+
+#include "common/protocol.h"
+#include "fs/operations.h"
+
+/*
+ * Client of a TecnicoFS server (fs/tfs_server.c): once a process mounts the
+ * server's FS, the calls of fs/operations.h from tfs_lookup() to
+ * tfs_fallocate(), plus tfs_read(), tfs_write(), tfs_pread() and
+ * tfs_pwrite(), are carried out by the server, on the FS it shares with
+ * its other clients (the rest of fs/operations.h is not available).
+ *
+ * Requests go through memory shared with the server, where up to
+ * TFS_SHM_SLOTS threads of the process may have one in flight at once, or
+ * through named pipes, one request at a time. Reads and writes longer than
+ * TFS_TRANSFER_SIZE are split into several requests, so they are not
+ * atomic with respect to other writers of the same file.
+ */
+
+/* Mounts the FS of a server, through shared memory if it can, falling back
+ * to named pipes otherwise
+ * Input:
+ *      - path name of the named pipes of the client (created by the mount,
+ *        and removed by tfs_unmount())
+ *      - path name of the server's named pipe
+ *      Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mount(char const *client_pipe_path, char const *server_pipe_path);
+
+/* Mounts the FS of a server through a given transport (see tfs_mount()) */
+int tfs_mount_transport(char const *client_pipe_path,
+                        char const *server_pipe_path,
+                        tfs_transport_t transport);
+
+/* Unmounts the FS; the files the process left open are closed by the
+ * server
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_unmount();
+
+/* Has the server destroy its FS, once no file of any client is open (see
+ * tfs_destroy_after_all_closed()), and exit; the FS is unmounted. Refused,
+ * leaving the FS mounted, while the process itself has files open (which
+ * it could not close while waiting) or another client already asked for it
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_shutdown_after_all_closed();
+
+#endif // CLIENT_API_H
@@ -0,0 +1,53 @@
+/* futex(2) is Linux specific, and reached through syscall() */
+#define _GNU_SOURCE
+#include "protocol.h"
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+uint32_t futex_wait_change(_Atomic uint32_t *word, uint32_t value) {
+    for (int i = 0; i < TFS_SPIN_COUNT; i++) {
+        uint32_t now = atomic_load_explicit(word, memory_order_acquire);
+        if (now != value) {
+            return now;
+        }
+    }
+
+    uint32_t now;
+    while ((now = atomic_load_explicit(word, memory_order_acquire)) == value) {
+        /* Returns at once if the word changed meanwhile */
+        syscall(SYS_futex, (uint32_t *)word, FUTEX_WAIT, value, NULL, NULL,
+                0);
+    }
+    return now;
+}
+
+void futex_wake(_Atomic uint32_t *word) {
+    syscall(SYS_futex, (uint32_t *)word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+int pipe_read_all(int fd, void *buffer, size_t len) {
+    char *p = buffer;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int pipe_write_all(int fd, void const *buffer, size_t len) {
+    char const *p = buffer;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
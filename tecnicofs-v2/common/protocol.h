@@ -0,0 +1,117 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Protocol between the TecnicoFS server (fs/tfs_server.c) and its clients
+ * (client/tecnicofs_client_api.c).
+ *
+ * A client mounts by creating two named pipes, at its path (for the
+ * server's replies) and at its path plus TFS_REQUEST_PIPE_SUFFIX (for its
+ * requests), and sending a tfs_mount_t to the server's named pipe. Its
+ * requests then go either through a shared memory object, if it made one
+ * (tfs_shm_t), or through its pipes (a tfs_request_t followed by its
+ * payload, answered by a tfs_response_t followed by its own). Either way,
+ * the request pipe stays open while the client is mounted: unmounting and
+ * the client's exit are seen there.
+ */
+
+#define TFS_REQUEST_PIPE_SUFFIX ".req"
+#define TFS_PATH_MAX (256)
+#define TFS_SHM_NAME_MAX (64)
+
+/* Largest payload of a single request or response: longer reads and
+ * writes are split */
+#define TFS_TRANSFER_SIZE (16 * 1024)
+
+/* Requests a client may have in flight at once through shared memory
+ * (one per slot), each served by a server thread of its own */
+#define TFS_SHM_SLOTS (8)
+
+/* Times a thread checks a slot before sleeping on it */
+#define TFS_SPIN_COUNT (2000)
+
+typedef enum {
+    TFS_TRANSPORT_SHM,
+    TFS_TRANSPORT_PIPE,
+} tfs_transport_t;
+
+typedef enum {
+    TFS_REQ_MOUNT,
+    TFS_REQ_UNMOUNT,
+    TFS_REQ_SHUTDOWN, /* tfs_destroy_after_all_closed(), then exit */
+    TFS_REQ_LOOKUP,   /* payload: name */
+    TFS_REQ_MKDIR,    /* payload: name */
+    TFS_REQ_OPEN,     /* payload: name */
+    TFS_REQ_CLOSE,
+    TFS_REQ_WRITE,  /* payload: data */
+    TFS_REQ_READ,   /* response payload: data */
+    TFS_REQ_PWRITE, /* payload: data */
+    TFS_REQ_PREAD,  /* response payload: data */
+    TFS_REQ_FSYNC,
+    TFS_REQ_FTRUNCATE,
+    TFS_REQ_FALLOCATE,
+} tfs_request_op_t;
+
+/* Sent to the server's named pipe; fits in PIPE_BUF, so that mounts from
+ * different clients are never mixed up */
+typedef struct {
+    int32_t m_op; /* TFS_REQ_MOUNT */
+    int32_t m_transport;
+    char m_client_path[TFS_PATH_MAX];
+    char m_shm_name[TFS_SHM_NAME_MAX];
+} tfs_mount_t;
+
+typedef struct {
+    int32_t r_op;
+    int32_t r_fhandle;
+    int32_t r_flags;
+    uint64_t r_len;    /* payload length, or length to read or reserve */
+    uint64_t r_offset; /* offset, or new size for TFS_REQ_FTRUNCATE */
+} tfs_request_t;
+
+typedef struct {
+    int64_t r_result; /* for reads, also the payload length */
+} tfs_response_t;
+
+/* States of a shared memory slot, which are also its futex word */
+enum {
+    TFS_SLOT_FREE,
+    TFS_SLOT_CLAIMED,  /* being filled in by a client thread */
+    TFS_SLOT_REQUEST,  /* waiting for the server */
+    TFS_SLOT_RESPONSE, /* waiting for the client thread */
+    TFS_SLOT_CLOSED,   /* the session is over */
+};
+
+typedef struct {
+    _Alignas(64) _Atomic uint32_t s_state;
+    tfs_request_t s_request;
+    tfs_response_t s_response;
+    char s_data[TFS_TRANSFER_SIZE];
+} tfs_slot_t;
+
+typedef struct {
+    tfs_slot_t shm_slots[TFS_SHM_SLOTS];
+} tfs_shm_t;
+
+/*
+ * Waits until a futex word (in memory shared between processes) no longer
+ * holds a value, spinning for a while before sleeping
+ * Returns the new value
+ */
+uint32_t futex_wait_change(_Atomic uint32_t *word, uint32_t value);
+
+/* Wakes the threads waiting for a futex word to change */
+void futex_wake(_Atomic uint32_t *word);
+
+/* Read or write exactly len bytes from or to a pipe, going on after
+ * interruptions and short transfers
+ * Return 0 if successful, -1 otherwise (end of file included) */
+int pipe_read_all(int fd, void *buffer, size_t len);
+int pipe_write_all(int fd, void const *buffer, size_t len);
+
+#endif // PROTOCOL_H
@@ -0,0 +1,266 @@
+#include "async.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Worker thread of a ring, with the queue of requests routed to it: all
+ * the requests for a given file go to the same worker, which carries them
+ * out in order
+ */
+typedef struct {
+    pthread_t w_tid;
+    tfs_ring_t *w_ring;
+    tfs_sqe_t *w_queue; /* as many entries as the ring */
+    size_t w_head;
+    size_t w_tail;
+    bool w_stop;
+    pthread_mutex_t w_lock;
+    pthread_cond_t w_cond;
+} async_worker_t;
+
+struct tfs_ring {
+    size_t entries;
+    /* Submission ring, only used by the application thread: entries from
+     * sq_head to sq_tail are filled in and waiting to be submitted */
+    tfs_sqe_t *sq;
+    size_t sq_head;
+    size_t sq_tail;
+    /* Completion ring: posted by the workers (under cq_lock) at cq_tail,
+     * reaped by the application thread at cq_head */
+    tfs_cqe_t *cq;
+    _Atomic size_t cq_head;
+    _Atomic size_t cq_tail;
+    pthread_mutex_t cq_lock;
+    pthread_cond_t cq_cond;
+    /* Requests submitted whose completions were not reaped yet; keeping
+     * them (and the entries waiting to be submitted) within the ring's
+     * size leaves room in every queue and in the completion ring */
+    _Atomic size_t inflight;
+    size_t next_worker; /* where the next request for no file goes */
+    size_t worker_count;
+    async_worker_t *workers;
+};
+
+/*
+ * Returns the i-number of the file a request is for, -1 if it is for no
+ * (open) file
+ */
+static int request_inumber(tfs_sqe_t const *sqe) {
+    if (sqe->op == TFS_OP_NOP || sqe->op == TFS_OP_OPEN) {
+        return -1;
+    }
+    open_file_entry_t *file = get_open_file_entry(sqe->fhandle);
+    return file == NULL ? -1 : file->of_inumber;
+}
+
+/*
+ * Carries out a request, returning the result of its call
+ */
+static ssize_t request_run(tfs_sqe_t const *sqe) {
+    switch (sqe->op) {
+    case TFS_OP_NOP:
+        return 0;
+    case TFS_OP_OPEN:
+        return tfs_open(sqe->name, sqe->flags);
+    case TFS_OP_CLOSE:
+        return tfs_close(sqe->fhandle);
+    case TFS_OP_READ:
+        if (sqe->offset == TFS_OFFSET_CURRENT) {
+            return tfs_read(sqe->fhandle, sqe->buffer, sqe->len);
+        }
+        return tfs_pread(sqe->fhandle, sqe->buffer, sqe->len, sqe->offset);
+    case TFS_OP_WRITE:
+        if (sqe->offset == TFS_OFFSET_CURRENT) {
+            return tfs_write(sqe->fhandle, sqe->buffer, sqe->len);
+        }
+        return tfs_pwrite(sqe->fhandle, sqe->buffer, sqe->len, sqe->offset);
+    case TFS_OP_FSYNC:
+        return tfs_fsync(sqe->fhandle);
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Posts completions to a ring's completion ring, all at once
+ */
+static void completions_post(tfs_ring_t *ring, tfs_cqe_t const *cqes,
+                             size_t count) {
+    pthread_mutex_lock(&ring->cq_lock);
+    size_t tail = atomic_load_explicit(&ring->cq_tail, memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) {
+        ring->cq[(tail + i) % ring->entries] = cqes[i];
+    }
+    atomic_store_explicit(&ring->cq_tail, tail + count, memory_order_release);
+    pthread_cond_broadcast(&ring->cq_cond);
+    pthread_mutex_unlock(&ring->cq_lock);
+}
+
+/*
+ * Worker thread: takes the requests waiting in its queue, up to
+ * ASYNC_BATCH_SIZE at a time, and carries them out in order, each call
+ * committing on its own (so that every completion reports what the call
+ * did, as it would if made directly); then posts their completions
+ * together
+ */
+static void *async_worker(void *arg) {
+    async_worker_t *worker = arg;
+    tfs_ring_t *ring = worker->w_ring;
+    tfs_sqe_t batch[ASYNC_BATCH_SIZE];
+    tfs_cqe_t cqes[ASYNC_BATCH_SIZE];
+
+    for (;;) {
+        pthread_mutex_lock(&worker->w_lock);
+        while (worker->w_head == worker->w_tail && !worker->w_stop) {
+            pthread_cond_wait(&worker->w_cond, &worker->w_lock);
+        }
+        size_t count = worker->w_tail - worker->w_head;
+        if (count > ASYNC_BATCH_SIZE) count = ASYNC_BATCH_SIZE;
+        for (size_t i = 0; i < count; i++) {
+            batch[i] = worker->w_queue[(worker->w_head + i) % ring->entries];
+        }
+        worker->w_head += count;
+        pthread_mutex_unlock(&worker->w_lock);
+        if (count == 0) {
+            break; /* stopped, with nothing left to do */
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            cqes[i].user_data = batch[i].user_data;
+            cqes[i].result = request_run(&batch[i]);
+        }
+        completions_post(ring, cqes, count);
+    }
+    return NULL;
+}
+
+/*
+ * Stops the first count workers of a ring, once their queues are empty,
+ * and frees them
+ */
+static void workers_stop(tfs_ring_t *ring, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        async_worker_t *worker = &ring->workers[i];
+        pthread_mutex_lock(&worker->w_lock);
+        worker->w_stop = true;
+        pthread_cond_signal(&worker->w_cond);
+        pthread_mutex_unlock(&worker->w_lock);
+    }
+    for (size_t i = 0; i < count; i++) {
+        async_worker_t *worker = &ring->workers[i];
+        pthread_join(worker->w_tid, NULL);
+        pthread_mutex_destroy(&worker->w_lock);
+        pthread_cond_destroy(&worker->w_cond);
+        free(worker->w_queue);
+    }
+}
+
+static void ring_free(tfs_ring_t *ring) {
+    pthread_mutex_destroy(&ring->cq_lock);
+    pthread_cond_destroy(&ring->cq_cond);
+    free(ring->workers);
+    free(ring->sq);
+    free(ring->cq);
+    free(ring);
+}
+
+tfs_ring_t *tfs_ring_create(size_t entries, size_t workers) {
+    if (entries == 0 || workers == 0) return NULL;
+
+    tfs_ring_t *ring = calloc(1, sizeof(tfs_ring_t));
+    if (ring == NULL) return NULL;
+    ring->entries = entries;
+    atomic_init(&ring->cq_head, 0);
+    atomic_init(&ring->cq_tail, 0);
+    atomic_init(&ring->inflight, 0);
+    pthread_mutex_init(&ring->cq_lock, NULL);
+    pthread_cond_init(&ring->cq_cond, NULL);
+    ring->sq = malloc(entries * sizeof(tfs_sqe_t));
+    ring->cq = malloc(entries * sizeof(tfs_cqe_t));
+    ring->workers = calloc(workers, sizeof(async_worker_t));
+    if (ring->sq == NULL || ring->cq == NULL || ring->workers == NULL) {
+        ring_free(ring);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < workers; i++) {
+        async_worker_t *worker = &ring->workers[i];
+        worker->w_ring = ring;
+        worker->w_queue = malloc(entries * sizeof(tfs_sqe_t));
+        pthread_mutex_init(&worker->w_lock, NULL);
+        pthread_cond_init(&worker->w_cond, NULL);
+        if (worker->w_queue == NULL ||
+            pthread_create(&worker->w_tid, NULL, async_worker, worker) != 0) {
+            pthread_mutex_destroy(&worker->w_lock);
+            pthread_cond_destroy(&worker->w_cond);
+            free(worker->w_queue);
+            workers_stop(ring, i);
+            ring_free(ring);
+            return NULL;
+        }
+        ring->worker_count++;
+    }
+    return ring;
+}
+
+void tfs_ring_destroy(tfs_ring_t *ring) {
+    workers_stop(ring, ring->worker_count);
+    ring_free(ring);
+}
+
+tfs_sqe_t *tfs_ring_get_sqe(tfs_ring_t *ring) {
+    size_t pending = ring->sq_tail - ring->sq_head;
+    if (pending + atomic_load(&ring->inflight) >= ring->entries) {
+        return NULL;
+    }
+
+    tfs_sqe_t *sqe = &ring->sq[ring->sq_tail++ % ring->entries];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+size_t tfs_ring_submit(tfs_ring_t *ring) {
+    size_t count = ring->sq_tail - ring->sq_head;
+    atomic_fetch_add(&ring->inflight, count);
+
+    for (; ring->sq_head != ring->sq_tail; ring->sq_head++) {
+        tfs_sqe_t const *sqe = &ring->sq[ring->sq_head % ring->entries];
+        int inumber = request_inumber(sqe);
+        size_t w = inumber == -1 ? ring->next_worker++ % ring->worker_count
+                                 : (size_t)inumber % ring->worker_count;
+
+        async_worker_t *worker = &ring->workers[w];
+        pthread_mutex_lock(&worker->w_lock);
+        worker->w_queue[worker->w_tail++ % ring->entries] = *sqe;
+        pthread_cond_signal(&worker->w_cond);
+        pthread_mutex_unlock(&worker->w_lock);
+    }
+    return count;
+}
+
+int tfs_ring_peek_cqe(tfs_ring_t *ring, tfs_cqe_t *cqe) {
+    size_t head = atomic_load_explicit(&ring->cq_head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&ring->cq_tail, memory_order_acquire)) {
+        return -1;
+    }
+
+    *cqe = ring->cq[head % ring->entries];
+    atomic_store_explicit(&ring->cq_head, head + 1, memory_order_relaxed);
+    atomic_fetch_sub(&ring->inflight, 1);
+    return 0;
+}
+
+int tfs_ring_wait_cqe(tfs_ring_t *ring, tfs_cqe_t *cqe) {
+    while (tfs_ring_peek_cqe(ring, cqe) == -1) {
+        if (atomic_load(&ring->inflight) == 0) {
+            return -1;
+        }
+        pthread_mutex_lock(&ring->cq_lock);
+        while (atomic_load(&ring->cq_tail) == atomic_load(&ring->cq_head)) {
+            pthread_cond_wait(&ring->cq_cond, &ring->cq_lock);
+        }
+        pthread_mutex_unlock(&ring->cq_lock);
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include "operations.h"
+#include <stdint.h>
+
+/*
+ * Asynchronous I/O: requests are queued in the submission ring of a
+ * tfs_ring_t and carried out by its pool of worker threads, which post
+ * their results to its completion ring. A single application thread may
+ * keep many requests in flight, and the storage delays of requests to
+ * different files overlap.
+ *
+ * Requests for the same file (or file handle) are carried out in the
+ * order they were submitted; requests for different files may complete in
+ * any order. A ring is meant to be used by one application thread at a
+ * time.
+ */
+
+typedef enum {
+    TFS_OP_NOP,
+    TFS_OP_OPEN,  /* tfs_open(name, flags); result: the file handle */
+    TFS_OP_CLOSE, /* tfs_close(fhandle) */
+    TFS_OP_READ,  /* tfs_pread() or, at TFS_OFFSET_CURRENT, tfs_read() */
+    TFS_OP_WRITE, /* tfs_pwrite() or, at TFS_OFFSET_CURRENT, tfs_write() */
+    TFS_OP_FSYNC, /* tfs_fsync(fhandle) */
+} tfs_op_t;
+
+/* Offset of reads and writes that use (and advance) the handle's own */
+#define TFS_OFFSET_CURRENT ((size_t)-1)
+
+/*
+ * Submission queue entry: a request, with the arguments of the call it
+ * stands for, and a value to tell its completion apart
+ */
+typedef struct {
+    tfs_op_t op;
+    int fhandle;
+    char const *name; /* must stay valid until the request completes */
+    int flags;
+    void *buffer; /* must stay valid until the request completes */
+    size_t len;
+    size_t offset;
+    uint64_t user_data;
+} tfs_sqe_t;
+
+/*
+ * Completion queue entry: the user_data of a request and the value its
+ * call returned
+ */
+typedef struct {
+    uint64_t user_data;
+    ssize_t result;
+} tfs_cqe_t;
+
+typedef struct tfs_ring tfs_ring_t;
+
+/* Creates a ring
+ * Input:
+ *      - most requests that may be in flight (submitted or waiting to be
+ *        submitted, and not yet reaped from the completion ring)
+ *      - number of worker threads
+ *      Returns the ring, or NULL in case of error.
+ */
+tfs_ring_t *tfs_ring_create(size_t entries, size_t workers);
+
+/* Destroys a ring, once the requests submitted to it are carried out
+ * (their completions are discarded)
+ */
+void tfs_ring_destroy(tfs_ring_t *ring);
+
+/* Returns the next free submission queue entry, to be filled in, or NULL
+ * if the ring is full (completions must be reaped first). The entry is
+ * only carried out once submitted.
+ */
+tfs_sqe_t *tfs_ring_get_sqe(tfs_ring_t *ring);
+
+/* Submits the entries filled in since the last submission
+ * Returns the number of entries submitted.
+ */
+size_t tfs_ring_submit(tfs_ring_t *ring);
+
+/* Reaps a completion, if there is one, without blocking
+ * Returns 0 if a completion was copied to cqe, -1 otherwise.
+ */
+int tfs_ring_peek_cqe(tfs_ring_t *ring, tfs_cqe_t *cqe);
+
+/* Reaps a completion, waiting for one if needed
+ * Returns 0 if a completion was copied to cqe, -1 if no request is in
+ * flight.
+ */
+int tfs_ring_wait_cqe(tfs_ring_t *ring, tfs_cqe_t *cqe);
+
+#endif // ASYNC_H
@@ -7,9 +7,62 @@
 #define BLOCK_SIZE (1024)
 #define DATA_BLOCKS (1024)
 #define INODE_TABLE_SIZE (50)
-#define MAX_OPEN_FILES (20)
+/* Open files: the table grows a segment at a time up to MAX_OPEN_FILES
+ * entries (at most 1 << 16), and its free entries are kept in
+ * OPEN_FILE_SHARDS independent lists */
+#define MAX_OPEN_FILES (65536)
+#define OPEN_FILE_SEGMENT_SIZE (64)
+#define OPEN_FILE_SHARDS (8)
 #define MAX_FILE_NAME (40)
-#define MAX_DIRECT_BLOCKS (10)
+#define MAX_DIRECT_EXTENTS (4)
+/* Levels of indirect extent blocks (1 to 3): single, double, triple */
+#define INDIRECT_LEVELS (3)
+
+/* Number of groups the free block bitmap is split into, each allocated
+ * under its own lock */
+#define BLOCK_GROUPS (4)
+
+/* Number of free blocks each thread keeps cached for allocation */
+#define BLOCK_MAGAZINE_SIZE (16)
+
+/* Dentry cache size (in entries) and number of independently locked shards */
+#define DCACHE_SIZE (1024)
+#define DCACHE_SHARDS (16)
+
+/* Buffer cache size (in blocks and i-nodes held) and number of
+ * independently locked shards */
+#define BUFFER_CACHE_SIZE (256)
+#define BUFFER_CACHE_SHARDS (8)
+
+/* Read-ahead window for sequential reads (in blocks), which starts at the
+ * minimum and doubles on every read that continues the previous one, and
+ * number of prefetches that may wait for the background thread */
+#define READAHEAD_MIN_BLOCKS (4)
+#define READAHEAD_MAX_BLOCKS (64)
+#define PREFETCH_QUEUE_SIZE (64)
+
+/* Delayed allocation: data written past the end of a file is kept in memory
+ * and only gets blocks, in one contiguous batch, when the file is closed or
+ * synced, or once its buffer would hold more than DELALLOC_FILE_BLOCKS or
+ * all buffers together more than DELALLOC_TOTAL_BLOCKS */
+#define DELALLOC_FILE_BLOCKS (64)
+#define DELALLOC_TOTAL_BLOCKS (256)
+
+/* Files are copied out of the FS in chunks of this many blocks, written
+ * straight from the blocks holding them */
+#define COPY_CHUNK_BLOCKS (64)
+
+/* Most requests an asynchronous I/O worker takes from its queue at once
+ * (see async.h) */
+#define ASYNC_BATCH_SIZE (32)
+
+/* Size (in bytes) the journal of an image file may grow to before the
+ * image is written back and the journal emptied */
+#define JOURNAL_CHECKPOINT_SIZE (1 << 20)
+
+/* Size of a cache line: structures written by different threads are
+ * aligned to it so that they never share one */
+#define CACHE_LINE_SIZE (64)
 
 #define DELAY (5000)
 
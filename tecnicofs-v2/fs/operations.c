@@ -1,15 +1,36 @@
 #include "operations.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Set once tfs_destroy_after_all_closed() is waiting: no file may be
+ * opened from then on */
+static _Atomic bool destroying;
+
+int tfs_init() { return tfs_init_image(NULL); }
+
+int tfs_init_image(char const *image_path) {
+    int found = state_init(image_path);
+    if (found == -1) return -1;
+    atomic_store(&destroying, false);
+    if (found) {
+        /* The image already holds a FS, root directory included */
+        return 0;
+    }
 
-int tfs_init() {
-    if (state_init() == -1) return -1;
-    
     /* Create root inode */
+    journal_begin();
     int root = inode_create(T_DIRECTORY);
-    if (root != ROOT_DIR_INUM) {
+    if (journal_commit() == -1 || root != ROOT_DIR_INUM) {
         return -1;
     }
 
@@ -21,28 +42,101 @@ int tfs_destroy() {
     return 0;
 }
 
+int tfs_destroy_after_all_closed() {
+    atomic_store(&destroying, true);
+    wait_open_file_table_empty();
+    return tfs_destroy();
+}
+
 static bool valid_pathname(char const *name) {
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
 
 
+/*
+ * Walks a path name, one component at a time, starting at the root
+ * directory.
+ * Input:
+ *  - name: absolute path name
+ *  - last: if not NULL, the walk stops at the directory holding the last
+ *    component, whose name is copied here (a buffer of MAX_FILE_NAME chars)
+ * Returns: i-number of the file named by the path (or of its parent
+ *  directory, if last is not NULL), -1 if unsuccessful
+ */
+static int walk_path(char const *name, char *last) {
+    char component[MAX_FILE_NAME];
+    int inum = ROOT_DIR_INUM;
+
+    while (*name != '\0') {
+        /* Skip the '/' separators */
+        while (*name == '/') {
+            name++;
+        }
+        size_t len = strcspn(name, "/");
+        if (len == 0) {
+            break;
+        }
+        if (len >= MAX_FILE_NAME) {
+            return -1;
+        }
+        memcpy(component, name, len);
+        component[len] = '\0';
+        name += len;
+
+        if (last != NULL && name[strspn(name, "/")] == '\0') {
+            strcpy(last, component);
+            return inum;
+        }
+        inum = find_in_dir(inum, component);
+        if (inum == -1) {
+            return -1;
+        }
+    }
+    return last != NULL ? -1 : inum;
+}
+
 int tfs_lookup(char const *name) {
     if (!valid_pathname(name)) {
         return -1;
     }
 
-    // skip the initial '/' character
-    name++;
+    return walk_path(name, NULL);
+}
+
+int tfs_mkdir(char const *name) {
+    char dir_name[MAX_FILE_NAME];
+
+    if (!valid_pathname(name)) {
+        return -1;
+    }
+
+    int parent = walk_path(name, dir_name);
+    if (parent == -1) {
+        return -1;
+    }
 
-    return find_in_dir(ROOT_DIR_INUM, name);
+    journal_begin();
+    int inum = inode_create(T_DIRECTORY);
+    if (inum != -1 && add_dir_entry(parent, inum, dir_name) == -1) {
+        inode_delete(inum);
+        inum = -1;
+    }
+    if (journal_commit() == -1 || inum == -1) {
+        return -1;
+    }
+    return 0;
 }
 
-int tfs_open(char const *name, int flags) {
+/*
+ * Opens a file (see tfs_open()), within the caller's journal transaction
+ * Returns the file handle, -1 if unsuccessful
+ */
+static int file_open(char const *name, int flags) {
     int inum;
     size_t offset;
 
     /* Checks if the path name is valid */
-    if (!valid_pathname(name)) {
+    if (!valid_pathname(name) || atomic_load(&destroying)) {
         return -1;
     }
 
@@ -50,50 +144,45 @@ int tfs_open(char const *name, int flags) {
     if (inum >= 0) {
         /* The file already exists */
         inode_t *inode = inode_get(inum);
-        if (inode == NULL) {
+        if (inode == NULL || inode->i_node_type != T_FILE) {
             return -1;
         }
 
         /* Trucate (if requested) */
         if (flags & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                int size = BLOCK_SIZE/sizeof(int), j = 0, i = 0, *pointer = NULL;
-                lock_write_datablocks();
-                pthread_rwlock_wrlock(&inode->rwlock);
-                while (j < size) {
-                    if (i > MAX_DIRECT_BLOCKS) {
-                        if (pointer[j] == -1) break;
-                        else data_block_free(pointer[j]);
-                        j++;
-                    } else {
-                        if (inode->i_data_block[i] == -1) break; // Get a direct block
-                        if (i == MAX_DIRECT_BLOCKS) pointer = data_block_get(inode->i_data_block[i]); // Set pointer to the allocation block
-                        else data_block_free(inode->i_data_block[i]);
-                    }
-                    i++;
-                }
-                if (i >= MAX_DIRECT_BLOCKS) data_block_free(inode->i_data_block[MAX_DIRECT_BLOCKS]);
-                inode->i_size = 0;
-            }
+            pthread_rwlock_wrlock(&inode->rwlock);
+            int ret = inode_free_blocks(inode);
             pthread_rwlock_unlock(&inode->rwlock);
-            unlock_datablocks();
+            if (ret == -1) {
+                return -1;
+            }
         }
         /* Determine initial offset */
         if (flags & TFS_O_APPEND) {
-            offset = inode->i_size % BLOCK_SIZE;
+            inode_stat(inode, &offset, NULL);
         } else {
             offset = 0;
         }
     } else if (flags & TFS_O_CREAT) {
         /* The file doesn't exist; the flags specify that it should be created*/
+        char file_name[MAX_FILE_NAME];
+        int parent = walk_path(name, file_name);
+        if (parent == -1) {
+            return -1;
+        }
         /* Create inode */
         inum = inode_create(T_FILE);
         if (inum == -1) {
             return -1;
         }
-        /* Add entry in the root directory */
-        if (add_dir_entry(ROOT_DIR_INUM, inum, name + 1) == -1) {
+        /* Add entry in the parent directory */
+        if (add_dir_entry(parent, inum, file_name) == -1) {
             inode_delete(inum);
+            /* Another thread may have created the same name in the
+             * meantime, in which case that file is the one to open */
+            if (find_in_dir(parent, file_name) >= 0) {
+                return file_open(name, flags & ~TFS_O_CREAT);
+            }
             return -1;
         }
         offset = 0;
@@ -102,124 +191,383 @@ int tfs_open(char const *name, int flags) {
     }
 
     /* Finally, add entry to the open file table and
-     * return the corresponding handle */
-    return add_to_open_file_table(inum, offset);
+     * return the corresponding handle; one added as the FS started waiting
+     * to be destroyed (which may have seen it) is taken back */
+    int fhandle = add_to_open_file_table(inum, offset);
+    if (fhandle != -1 && atomic_load(&destroying)) {
+        remove_from_open_file_table(fhandle);
+        return -1;
+    }
+    return fhandle;
 
     /* Note: for simplification, if file was created with TFS_O_CREAT and there
      * is an error adding an entry to the open file table, the file is not
      * opened but it remains created */
 }
 
-int tfs_close(int fhandle) { return remove_from_open_file_table(fhandle); }
+int tfs_open(char const *name, int flags) {
+    /* A file created or truncated is only opened once that is on disk */
+    journal_begin();
+    int fhandle = file_open(name, flags);
+    if (journal_commit() == -1 && fhandle != -1) {
+        remove_from_open_file_table(fhandle);
+        return -1;
+    }
+    return fhandle;
+}
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+/*
+ * Flushes the dirty buffer of an open file, so that the data waiting there
+ * gets its blocks, and optionally writes the file back to the image it is
+ * kept in.
+ * Returns 0 if successful, -1 otherwise
+ */
+static int file_flush(int fhandle, bool sync) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) return -1;
 
-    /* From the open file table entry, we get the inode */
     inode_t *inode = inode_get(file->of_inumber);
     if (inode == NULL) return -1;
 
-    if (to_write > 0) {
-        int counter = 0, *pointer = NULL, *indexes = NULL;
-        size_t size = BLOCK_SIZE/sizeof(int), index_direct = 0, index_allocated = 0;
-        void *block = NULL;
+    /* Nothing is buffered unless the size goes past the mapped blocks */
+    size_t size, blocks;
+    inode_stat(inode, &size, &blocks);
+    int ret = 0;
+    if (size > blocks * BLOCK_SIZE) {
+        journal_begin();
         pthread_rwlock_wrlock(&inode->rwlock);
-        if (inode->i_size == 0) {
-            if (to_write > (size_t)BLOCK_SIZE*(size + (size_t)MAX_DIRECT_BLOCKS)) 
-                to_write = (size_t)BLOCK_SIZE*(size + (size_t)MAX_DIRECT_BLOCKS);
-            indexes = to_alloc(to_write);
-        } else {
-            lock_read_datablocks();
-            while (index_allocated < size) {
-                if (index_direct < MAX_DIRECT_BLOCKS) {
-                    if (inode->i_data_block[index_direct] == -1) break;
-                    index_direct++;
-                } else if (index_direct == MAX_DIRECT_BLOCKS) {
-                    pointer = data_block_get(inode->i_data_block[MAX_DIRECT_BLOCKS]);
-                    index_direct++;
-                } else {
-                    if (pointer[index_allocated] == -1) break;
-                    index_allocated++;
-                }
-            }
-            unlock_datablocks();
-            index_direct--;
-            if (to_write > (size_t)BLOCK_SIZE*(size - index_allocated + 
-            (size_t)MAX_DIRECT_BLOCKS - index_direct) + (size_t)BLOCK_SIZE - file->of_offset) {
-                to_write = (size_t)BLOCK_SIZE*(size - index_allocated +
-                (size_t)MAX_DIRECT_BLOCKS - index_direct) + (size_t)BLOCK_SIZE - file->of_offset;
-            }
-            size_t temp = to_write - (BLOCK_SIZE-file->of_offset);
-            if (temp > to_write) temp = 0;
-            // If we have to allocate more than 10 blocks, we also need to allocate the indirect block
-            else if (temp >= MAX_DIRECT_BLOCKS*BLOCK_SIZE && index_allocated == 0) temp += BLOCK_SIZE;
-            indexes = to_alloc(temp);
-        }
-        if (indexes != NULL) {
-            int size_indexes = give_size(indexes);
-            for (; index_direct < MAX_DIRECT_BLOCKS && counter < size_indexes; index_direct++, counter++) {
-                inode->i_data_block[index_direct] = indexes[counter];
-            }
-            if (size_indexes != 0 && index_direct != MAX_DIRECT_BLOCKS) inode->i_data_block[index_direct] = -1;
-            if (index_direct == MAX_DIRECT_BLOCKS) {
-                lock_write_datablocks();
-                pointer = data_block_get(inode->i_data_block[MAX_DIRECT_BLOCKS]);
-                for (int z = counter; index_allocated < size && z < size_indexes; index_allocated++, z++) {
-                    pointer[index_allocated] = indexes[z];
-                }
-                if (index_allocated != size) pointer[index_allocated] = -1;
-                unlock_datablocks();
-            }
-            index_allocated = index_allocated > 0 ? index_allocated - 1 : index_allocated;
-            index_direct = index_direct > 0 && index_direct < MAX_DIRECT_BLOCKS ? index_direct - 1 : index_direct;
-        } else return -1;
-
-        lock_write_datablocks();
-        for (size_t aux = to_write; aux > 0 && aux <= to_write && index_allocated < size; aux -= BLOCK_SIZE) {
-            size_t temp = aux / BLOCK_SIZE > 1 ? BLOCK_SIZE : aux;
-            if (index_direct < MAX_DIRECT_BLOCKS) {
-                block = data_block_get(inode->i_data_block[index_direct]); // Get a direct block
-                if (block == NULL) {
-                    unlock_datablocks();
-                    pthread_rwlock_unlock(&inode->rwlock);
-                    return -1;
-                }
-                if (aux == to_write) {
-                    block += file->of_offset;
-                    temp -= file->of_offset;
-                    aux += file->of_offset;
-                }
-                memcpy(block, buffer, temp); // Write an entire block or the last part if smaller than a block
-                index_direct++; 
+        ret = inode_flush(inode);
+        pthread_rwlock_unlock(&inode->rwlock);
+        if (journal_commit() == -1) ret = -1;
+    }
+
+    if (sync) {
+        pthread_rwlock_rdlock(&inode->rwlock);
+        if (inode_sync(inode) == -1) ret = -1;
+        pthread_rwlock_unlock(&inode->rwlock);
+    }
+    return ret;
+}
+
+int tfs_close(int fhandle) {
+    /* The handle is closed even if the data could not be flushed */
+    int ret = file_flush(fhandle, false);
+    if (remove_from_open_file_table(fhandle) == -1) return -1;
+    return ret;
+}
+
+int tfs_fsync(int fhandle) { return file_flush(fhandle, true); }
+
+/*
+ * Finds where a given offset of a file is stored.
+ * Input:
+ *  - inode: the file's i-node (whose rwlock the caller holds)
+ *  - offset: offset in the file, within its mapped blocks or its dirty
+ *    buffer (which holds the data past them)
+ *  - want: number of bytes needed from there on; only the blocks holding
+ *    them are brought in, so that blocks still ahead of a reader are left
+ *    to read-ahead
+ *  - avail: set to the number of contiguous bytes stored from there on
+ * Returns: pointer to the data, NULL if the offset is not mapped
+ */
+static char *file_data_at(inode_t *inode, size_t offset, size_t want,
+                          size_t *avail) {
+    size_t mapped = inode->i_blocks * BLOCK_SIZE;
+    if (offset >= mapped) {
+        if (offset - mapped >= inode->i_dirty_capacity) {
+            return NULL;
+        }
+        *avail = inode->i_dirty_capacity - (offset - mapped);
+        return inode->i_dirty + (offset - mapped);
+    }
+
+    size_t run;
+    int block = inode_get_block(inode, offset / BLOCK_SIZE, &run);
+    size_t needed = (offset % BLOCK_SIZE + want + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (run > needed) {
+        run = needed;
+    }
+    char *data = data_blocks_get(block, run);
+    if (data == NULL) {
+        return NULL;
+    }
+    *avail = run * BLOCK_SIZE - offset % BLOCK_SIZE;
+    return data + offset % BLOCK_SIZE;
+}
+
+/*
+ * Adds up the lengths of an iovec array
+ * Returns the total, or -1 if the array is invalid
+ */
+static ssize_t iov_total(struct iovec const *iov, int iovcnt) {
+    if (iovcnt < 0 || (iov == NULL && iovcnt > 0)) {
+        return -1;
+    }
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len > SSIZE_MAX - total) {
+            return -1;
+        }
+        total += iov[i].iov_len;
+    }
+    return (ssize_t)total;
+}
+
+/*
+ * Copies len bytes between an inode, starting at offset, and the buffers
+ * of an iovec array, in the direction given by to_file; the data is looked
+ * up one run of contiguous blocks at a time and split across the buffers
+ * The caller must hold the inode's lock and the blocks must be mapped;
+ * what is copied to the file is written through to its image file
+ * Returns the number of bytes copied
+ */
+static size_t inode_copy(inode_t *inode, struct iovec const *iov,
+                         size_t offset, size_t len, bool to_file) {
+    size_t done = 0;
+    size_t iov_done = 0;
+    while (done < len) {
+        size_t avail;
+        char *data = file_data_at(inode, offset + done, len - done, &avail);
+        if (data == NULL) {
+            break;
+        }
+        if (avail > len - done) avail = len - done;
+        char *run = data;
+        size_t run_len = avail;
+
+        while (avail > 0) {
+            size_t n = iov->iov_len - iov_done;
+            if (n > avail) n = avail;
+            char *buffer = (char *)iov->iov_base + iov_done;
+            if (to_file) {
+                memcpy(data, buffer, n);
             } else {
-                // Again apenas leitura, atÃ© chegar ao memcpy
-                if (index_direct++ == MAX_DIRECT_BLOCKS) 
-                    pointer = data_block_get(inode->i_data_block[MAX_DIRECT_BLOCKS]); // Set pointer to the allocation block
-                block = data_block_get(pointer[index_allocated++]);
-                if (block == NULL) {
-                    unlock_datablocks();
-                    pthread_rwlock_unlock(&inode->rwlock);
-                    return -1;
-                }
-                if (aux == to_write) {
-                    block += file->of_offset;
-                    temp -= file->of_offset;
-                    aux += file->of_offset;
-                }
-                memcpy(block, buffer, temp); // Write an entire block or the last part if smaller than a block
+                memcpy(buffer, data, n);
+            }
+            data += n;
+            avail -= n;
+            iov_done += n;
+            if (iov_done == iov->iov_len) {
+                iov++;
+                iov_done = 0;
             }
-            inode->i_size += temp;
         }
-        unlock_datablocks();
-        pthread_rwlock_unlock(&inode->rwlock);
-        file->of_offset = to_write % BLOCK_SIZE;
+        if (to_file && data_blocks_written(run, run_len) == -1) {
+            break;
+        }
+        done += run_len;
     }
+    return done;
+}
 
-    return (ssize_t)to_write;
+/*
+ * Makes room in an inode for data up to the given end, past its mapped
+ * blocks, in its dirty buffer, to get blocks later (delayed allocation);
+ * a buffer that cannot take it gets its blocks first, and a new one is
+ * tried
+ * The caller must hold the inode's write lock, outside a metadata change
+ * Returns true if there is room, false if the blocks must be mapped now
+ * (see inode_map_upto())
+ */
+static bool inode_buffer_upto(inode_t *inode, size_t end) {
+    if (end <= inode->i_blocks * BLOCK_SIZE ||
+        inode_buffer(inode, end - inode->i_blocks * BLOCK_SIZE) == 0) {
+        return true;
+    }
+    inode_flush(inode);
+    return end <= inode->i_blocks * BLOCK_SIZE ||
+           inode_buffer(inode, end - inode->i_blocks * BLOCK_SIZE) == 0;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+/*
+ * Maps the blocks an inode is still missing up to the given end, all at
+ * once
+ * The caller must hold the inode's write lock, within a metadata change
+ * Returns the number of bytes mapped, lower than end if the file cannot
+ * grow that much
+ */
+static size_t inode_map_upto(inode_t *inode, size_t end) {
+    size_t needed = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (needed > inode->i_blocks) {
+        inode_alloc_blocks(inode, needed - inode->i_blocks);
+    }
+    size_t mapped = inode->i_blocks * BLOCK_SIZE;
+    return mapped < end ? mapped : end;
+}
+
+/*
+ * Zeroes the bytes of an inode between two offsets, which must be mapped
+ * (or buffered)
+ * The caller must hold the inode's write lock
+ */
+static void inode_zero(inode_t *inode, size_t from, size_t to) {
+    for (size_t pos = from; pos < to;) {
+        size_t avail;
+        char *data = file_data_at(inode, pos, to - pos, &avail);
+        if (data == NULL) {
+            break;
+        }
+        if (avail > to - pos) avail = to - pos;
+        memset(data, 0, avail);
+        /* If it cannot be written through, the next checkpoint writes it */
+        data_blocks_written(data, avail);
+        pos += avail;
+    }
+}
+
+/*
+ * Writes the buffers of an iovec array to an inode at the given offset,
+ * growing it as needed
+ * The caller must hold the inode's write lock
+ * Returns the number of bytes written
+ */
+static size_t inode_write_at(inode_t *inode, struct iovec const *iov,
+                             size_t to_write, size_t offset) {
+    size_t end = offset + to_write;
+    bool buffered = inode_buffer_upto(inode, end);
+
+    size_t size = inode->i_size;
+    size_t blocks = inode->i_blocks;
+    inode_meta_begin(inode);
+
+    /* Otherwise (the write is too large to be buffered, or the FS is
+     * nearly full) the blocks are mapped now; if the file cannot grow that
+     * much, the write is cut short */
+    if (!buffered) {
+        size_t mapped = inode_map_upto(inode, end);
+        if (end > mapped) {
+            to_write = mapped > offset ? mapped - offset : 0;
+        }
+        /* Blocks mapped for a gap that nothing is written past would only
+         * be wasted */
+        if (to_write == 0) {
+            inode_trim_blocks(inode, blocks);
+        }
+    }
+
+    /* The file may have been truncated through another handle, leaving a
+     * gap before the offset that must read as zeros */
+    if (to_write > 0) {
+        inode_zero(inode, inode->i_size, offset);
+    }
+
+    size_t written = inode_copy(inode, iov, offset, to_write, true);
+
+    if (offset + written > inode->i_size) {
+        inode->i_size = offset + written;
+    }
+    /* Only writes that grow the file change its metadata */
+    if (inode->i_size != size || inode->i_blocks != blocks) {
+        inode_journal(inode);
+    }
+    inode_meta_end(inode);
+    return written;
+}
+
+/*
+ * Reads from an inode at the given offset into the buffers of an iovec
+ * array, up to the inode's current size
+ * The caller must hold the inode's lock, in either mode
+ * Returns the number of bytes read
+ */
+static size_t inode_read_at(inode_t *inode, struct iovec const *iov,
+                            size_t len, size_t offset) {
+    size_t to_read = inode->i_size > offset ? inode->i_size - offset : 0;
+    if (to_read > len) to_read = len;
+
+    return inode_copy(inode, iov, offset, to_read, false);
+}
+
+/*
+ * Asks for the blocks of an inode in a range of file blocks (up to its
+ * size) to be prefetched, one run of contiguous blocks at a time
+ * The caller must hold the inode's lock
+ * Returns the file block where the requests stopped
+ */
+static size_t inode_prefetch(inode_t *inode, size_t first, size_t end) {
+    size_t blocks = (inode->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (end > blocks) end = blocks;
+
+    while (first < end) {
+        size_t run;
+        int block = inode_get_block(inode, first, &run);
+        if (block == -1) {
+            break;
+        }
+        if (run > end - first) run = end - first;
+        data_blocks_prefetch(block, run);
+        first += run;
+    }
+    return first;
+}
+
+/*
+ * Tracks the reads made through an open file and, while they are
+ * sequential, asks for the blocks that will be read next to be prefetched.
+ * The window of blocks prefetched ahead doubles with every read that
+ * continues the previous one, and falls back to nothing on a jump.
+ * The caller must hold the open file's lock and the inode's lock
+ * Input:
+ *  - file: the open file
+ *  - inode: its inode
+ *  - offset, read: where the read started and how many bytes it got
+ */
+static void file_readahead(open_file_entry_t *file, inode_t *inode,
+                           size_t offset, size_t read) {
+    if (offset != file->of_ra_next) {
+        file->of_ra_window = 0;
+        file->of_ra_end = 0;
+    } else if (file->of_ra_window == 0) {
+        file->of_ra_window = READAHEAD_MIN_BLOCKS;
+    } else if (file->of_ra_window < READAHEAD_MAX_BLOCKS) {
+        file->of_ra_window *= 2;
+    }
+    file->of_ra_next = offset + read;
+    if (file->of_ra_window == 0) {
+        return;
+    }
+
+    /* Only the blocks past the ones already read or requested */
+    size_t first = (offset + read + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t end = first + file->of_ra_window;
+    if (first < file->of_ra_end) first = file->of_ra_end;
+
+    first = inode_prefetch(inode, first, end);
+    if (first > file->of_ra_end) {
+        file->of_ra_end = first;
+    }
+}
+
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt) {
+    ssize_t to_write = iov_total(iov, iovcnt);
+    if (to_write == -1) return -1;
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) return -1;
+
+    /* From the open file table entry, we get the inode */
+    inode_t *inode = inode_get(file->of_inumber);
+    if (inode == NULL) return -1;
+
+    journal_begin();
+    pthread_mutex_lock(&file->of_lock);
+    pthread_rwlock_wrlock(&inode->rwlock);
+    size_t written =
+        inode_write_at(inode, iov, (size_t)to_write, file->of_offset);
+    file->of_offset += written;
+    pthread_rwlock_unlock(&inode->rwlock);
+    pthread_mutex_unlock(&file->of_lock);
+    if (journal_commit() == -1) return -1;
+
+    return (ssize_t)written;
+}
+
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt) {
+    ssize_t len = iov_total(iov, iovcnt);
+    if (len == -1) {
+        return -1;
+    }
+
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
         return -1;
@@ -231,76 +579,638 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
         return -1;
     }
 
-    /* Determine how many bytes to read */
-    size_t to_read = inode->i_size - file->of_offset;
-    if (to_read > len) to_read = len;
+    pthread_mutex_lock(&file->of_lock);
 
-    if (to_read > 0) {
-        int i = 0, j = 0, *pointer = NULL;
-        void *block = NULL;
-        pthread_rwlock_wrlock(&inode->rwlock);
-        lock_write_datablocks();
-        for (size_t aux = to_read; aux > 0 && aux <= to_read; aux -= BLOCK_SIZE) {
-            size_t temp = aux / BLOCK_SIZE > 1 ? BLOCK_SIZE : aux;
-            if (i < MAX_DIRECT_BLOCKS) {
-                block = data_block_get(inode->i_data_block[i]);
-                if (block == NULL)  {
-                    unlock_datablocks();
-                    pthread_rwlock_unlock(&inode->rwlock);
-                    return -1;
-                }
-            } else {
-                if (i == MAX_DIRECT_BLOCKS) pointer = block; // Set pointer to the allocation block
-                block = data_block_get(pointer[j++]);
-                if (block == NULL) {
-                    unlock_datablocks();
-                    pthread_rwlock_unlock(&inode->rwlock);
-                    return -1;
-                }
-            }
-            if (aux == to_read) {
-                block += file->of_offset;
-                temp -= file->of_offset;
-                aux += file->of_offset;
-            }
-            memcpy(buffer, block, temp); // Perform the actual read
-            i++;
+    /* Reads at the end of the file need not touch the i-node's lock */
+    size_t size;
+    inode_stat(inode, &size, NULL);
+    if (len == 0 || file->of_offset >= size) {
+        pthread_mutex_unlock(&file->of_lock);
+        return 0;
+    }
+
+    /* Readers of the same file through other handles share the i-node */
+    pthread_rwlock_rdlock(&inode->rwlock);
+    size_t read = inode_read_at(inode, iov, (size_t)len, file->of_offset);
+    file_readahead(file, inode, file->of_offset, read);
+    file->of_offset += read;
+    pthread_rwlock_unlock(&inode->rwlock);
+    pthread_mutex_unlock(&file->of_lock);
+
+    return (ssize_t)read;
+}
+
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    struct iovec iov = {(void *)buffer, to_write};
+    return tfs_writev(fhandle, &iov, 1);
+}
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    struct iovec iov = {buffer, len};
+    return tfs_readv(fhandle, &iov, 1);
+}
+
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len,
+                   size_t offset) {
+    struct iovec iov = {(void *)buffer, len};
+    if (iov_total(&iov, 1) == -1 || offset + len < offset) return -1;
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) return -1;
+
+    inode_t *inode = inode_get(file->of_inumber);
+    if (inode == NULL) return -1;
+
+    journal_begin();
+    pthread_rwlock_wrlock(&inode->rwlock);
+    size_t written = inode_write_at(inode, &iov, len, offset);
+    pthread_rwlock_unlock(&inode->rwlock);
+    if (journal_commit() == -1) return -1;
+
+    return (ssize_t)written;
+}
+
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset) {
+    struct iovec iov = {buffer, len};
+    if (iov_total(&iov, 1) == -1) return -1;
+
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) return -1;
+
+    inode_t *inode = inode_get(file->of_inumber);
+    if (inode == NULL) return -1;
+
+    /* Reads at the end of the file need not touch the i-node's lock */
+    size_t size;
+    inode_stat(inode, &size, NULL);
+    if (len == 0 || offset >= size) {
+        return 0;
+    }
+
+    /* The handle's offset is left alone, so readers only need to keep
+     * writers out and can run in parallel */
+    pthread_rwlock_rdlock(&inode->rwlock);
+    size_t read = inode_read_at(inode, &iov, len, offset);
+    pthread_rwlock_unlock(&inode->rwlock);
+
+    return (ssize_t)read;
+}
+
+int tfs_fallocate(int fhandle, size_t offset, size_t len) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) return -1;
+
+    inode_t *inode = inode_get(file->of_inumber);
+    if (inode == NULL || offset + len < offset) return -1;
+
+    journal_begin();
+    pthread_rwlock_wrlock(&inode->rwlock);
+    /* Buffered data gets its blocks first, so that the ones reserved here
+     * come after them */
+    int ret = inode_flush(inode);
+    size_t needed = (offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (ret == 0 && needed > inode->i_blocks) {
+        size_t blocks = inode->i_blocks;
+        inode_meta_begin(inode);
+        inode_alloc_blocks(inode, needed - blocks);
+        if (inode->i_blocks < needed) {
+            /* Nothing is kept of a reservation that cannot be made whole */
+            inode_trim_blocks(inode, blocks);
+            ret = -1;
         }
-    unlock_datablocks();
+        inode_journal(inode);
+        inode_meta_end(inode);
+    }
     pthread_rwlock_unlock(&inode->rwlock);
+    if (journal_commit() == -1) ret = -1;
+    return ret;
+}
+
+int tfs_ftruncate(int fhandle, size_t length) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) return -1;
+
+    inode_t *inode = inode_get(file->of_inumber);
+    if (inode == NULL) return -1;
+
+    journal_begin();
+    pthread_rwlock_wrlock(&inode->rwlock);
+    int ret = 0;
+    if (length <= inode->i_size) {
+        ret = inode_truncate(inode, length);
+    } else {
+        /* Grown like a write of zeros past the end */
+        bool buffered = inode_buffer_upto(inode, length);
+        size_t blocks = inode->i_blocks;
+        inode_meta_begin(inode);
+        if (!buffered && inode_map_upto(inode, length) < length) {
+            inode_trim_blocks(inode, blocks);
+            ret = -1;
+        } else {
+            inode_zero(inode, inode->i_size, length);
+            inode->i_size = length;
+        }
+        inode_journal(inode);
+        inode_meta_end(inode);
     }
+    pthread_rwlock_unlock(&inode->rwlock);
+    if (journal_commit() == -1) ret = -1;
+    return ret;
+}
 
-    return (ssize_t)to_read;
+/*
+ * Writes all the buffers of an iovec array to a host file descriptor,
+ * going on after short writes
+ * Returns 0 if successful, -1 otherwise
+ */
+static int write_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        size_t left = (size_t)written;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
 }
 
-int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+/*
+ * Writes the contents of an inode to a host file descriptor, a chunk of
+ * up to COPY_CHUNK_BLOCKS blocks at a time: each chunk is copied into a
+ * buffer under the inode's lock, and written out once the lock is released
+ * (so that a slow destination does not hold up the file's writers); the
+ * blocks of the next chunk are prefetched meanwhile
+ * Only the data up to the size the inode had when the copy started is
+ * written; exported is set to the number of bytes written
+ * Returns 0 if successful, -1 otherwise
+ */
+static int inode_export(inode_t *inode, int fd, size_t *exported) {
+    size_t size;
+    inode_stat(inode, &size, NULL);
+    *exported = 0;
 
-    int sourcefhandle, file_inum;
-    FILE *destination;
-    inode_t *source;
-    size_t to_write;
-    char *array;
+    char *chunk = malloc(COPY_CHUNK_BLOCKS * BLOCK_SIZE);
+    if (chunk == NULL) return -1;
+
+    int ret = 0;
+    for (size_t offset = 0; offset < size;) {
+        size_t len = size - offset;
+        if (len > COPY_CHUNK_BLOCKS * BLOCK_SIZE) {
+            len = COPY_CHUNK_BLOCKS * BLOCK_SIZE;
+        }
+        struct iovec iov = {.iov_base = chunk, .iov_len = len};
+
+        pthread_rwlock_rdlock(&inode->rwlock);
+        size_t done = inode_read_at(inode, &iov, len, offset);
+        size_t next = (offset + done) / BLOCK_SIZE;
+        inode_prefetch(inode, next, next + COPY_CHUNK_BLOCKS);
+        pthread_rwlock_unlock(&inode->rwlock);
+
+        if (done == 0) {
+            break; /* truncated meanwhile */
+        }
+        iov.iov_len = done;
+        if (write_all(fd, &iov, 1) == -1) {
+            ret = -1;
+            break;
+        }
+        offset += done;
+        *exported = offset;
+    }
+    free(chunk);
+    return ret;
+}
+
+/*
+ * Copies a file out of TecnicoFS (see tfs_copy_to_external_fs()), setting
+ * exported to the number of bytes copied
+ * Returns 0 if successful, -1 otherwise
+ */
+static int file_export(char const *source_path, char const *dest_path,
+                       size_t *exported) {
+    *exported = 0;
 
-    // Check if both pathnames are valid and if source_path 
     if (!valid_pathname(source_path)) return -1;
-    if ((file_inum = tfs_lookup(source_path)) == -1) return -1;
+    int inum = tfs_lookup(source_path);
+    if (inum == -1) return -1;
+    inode_t *source = inode_get(inum);
+    if (source == NULL || source->i_node_type != T_FILE) return -1;
+
+    /* Overwritten in place and only then cut to the new size, so that
+     * copies of the same contents racing on it never leave it short */
+    int fd = open(dest_path, O_WRONLY | O_CREAT, 0666);
+    if (fd == -1) return -1;
+
+    struct stat st;
+    int ret = fstat(fd, &st);
+    if (ret == 0) ret = inode_export(source, fd, exported);
+    if (ret == 0 && S_ISREG(st.st_mode) &&
+        ftruncate(fd, (off_t)*exported) == -1) {
+        ret = -1;
+    }
+    if (close(fd) == -1) ret = -1;
+    return ret;
+}
+
+int tfs_copy_to_external_fs(char const *source_path, char const *dest_path) {
+    size_t exported;
+    return file_export(source_path, dest_path, &exported);
+}
+
+/*
+ * Starts up to count threads running a worker function, their ids going
+ * to tids (which may be NULL when count is 0)
+ * Returns the number of threads started
+ */
+static size_t workers_start(void *(*worker)(void *), void *arg,
+                            pthread_t *tids, size_t count) {
+    size_t started = 0;
+    while (tids != NULL && started < count &&
+           pthread_create(&tids[started], NULL, worker, arg) == 0) {
+        started++;
+    }
+    return started;
+}
+
+static void workers_join(pthread_t *tids, size_t started) {
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+}
 
-    if ((destination = fopen(dest_path, "w")) == NULL) return -1;
+/*
+ * Runs a worker function on a pool of threads, the calling thread
+ * included, returning once they all have; if fewer threads can be
+ * started, the work is left to those that were
+ */
+static void workers_run(void *(*worker)(void *), void *arg, size_t workers) {
+    if (workers == 0) workers = 1;
+    pthread_t *tids = malloc((workers - 1) * sizeof(pthread_t));
+    size_t started = workers_start(worker, arg, tids, workers - 1);
+    worker(arg);
+    workers_join(tids, started);
+    free(tids);
+}
+
+/*
+ * Batch export: the files still to be copied, taken by the workers in
+ * order
+ */
+typedef struct {
+    tfs_export_t *files;
+    size_t count;
+    tfs_export_progress_t progress;
+    void *progress_arg;
+    _Atomic size_t next;
+} export_batch_t;
 
-    source = inode_get(file_inum);
-    if (source == NULL) return -1;
-    to_write = source->i_size;
+static double elapsed_seconds(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) +
+           (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-    sourcefhandle = tfs_open(source_path, 0);
-    if (sourcefhandle == -1) return -1;
-    array = (char *)malloc(to_write + 1);
-    if (array == NULL) return -1;
+static void *export_worker(void *arg) {
+    export_batch_t *batch = arg;
 
-    if (tfs_read(sourcefhandle, array, to_write) == -1) return -1;
-    if (fwrite(array, sizeof(char), to_write, destination) != to_write) return -1;
-    if (tfs_close(sourcefhandle) == -1) return -1;
-    if (fclose(destination) == EOF) return -1;
-    free(array);
+    for (;;) {
+        size_t i = atomic_fetch_add(&batch->next, 1);
+        if (i >= batch->count) break;
+        tfs_export_t *file = &batch->files[i];
 
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        file->status =
+            file_export(file->source_path, file->dest_path, &file->bytes);
+        file->seconds = elapsed_seconds(&start);
+        if (batch->progress != NULL) {
+            batch->progress(file, batch->progress_arg);
+        }
+    }
+    return NULL;
+}
+
+int tfs_export_batch(tfs_export_t *files, size_t count, size_t workers,
+                     tfs_export_progress_t progress, void *progress_arg) {
+    export_batch_t batch = {.files = files,
+                            .count = count,
+                            .progress = progress,
+                            .progress_arg = progress_arg};
+    atomic_init(&batch.next, 0);
+    workers_run(export_worker, &batch, workers);
+
+    for (size_t i = 0; i < count; i++) {
+        if (files[i].status == -1) return -1;
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Writes the contents of a host file to an open file, straight from a
+ * mapping of the host file, with the blocks it needs preallocated so that
+ * the write never goes back to the allocator; if it fails, the file is
+ * left empty
+ * Input:
+ *  - fd: host file descriptor, open for reading
+ *  - fhandle: open file (empty) to write to
+ * Returns 0 if successful, -1 otherwise
+ */
+static int file_import(int fd, int fhandle) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) return -1;
+    size_t size = (size_t)st.st_size;
+    if (size == 0) return 0;
+
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return -1;
+    posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+
+    int ret = 0;
+    if (tfs_fallocate(fhandle, 0, size) == -1 ||
+        tfs_write(fhandle, data, size) != (ssize_t)size) {
+        ret = -1;
+        tfs_ftruncate(fhandle, 0);
+    }
+    munmap(data, size);
+    return ret;
+}
+
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
+    if (!valid_pathname(dest_path)) return -1;
+    int fd = open(source_path, O_RDONLY);
+    if (fd == -1) return -1;
+
+    /* The file is created, written and closed in a single transaction */
+    journal_begin();
+    int fhandle = file_open(dest_path, TFS_O_CREAT | TFS_O_TRUNC);
+    int ret = fhandle == -1 ? -1 : file_import(fd, fhandle);
+    if (fhandle != -1 && tfs_close(fhandle) == -1) ret = -1;
+    if (journal_commit() == -1) ret = -1;
+    close(fd);
+    return ret;
+}
+
+/*
+ * Bulk import: the files found in the host directory tree, each created
+ * (empty) and left open, waiting to be written by the workers, which start
+ * on them while the tree is still being walked
+ */
+typedef struct {
+    char *host_path;
+    int fhandle;
+} import_job_t;
+
+typedef struct {
+    import_job_t *jobs;
+    size_t count;
+    size_t capacity;
+    size_t next;  /* next job to be taken by a worker */
+    bool walked;  /* no more jobs will be pushed */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    _Atomic bool failed;
+} import_t;
+
+static int import_push(import_t *import, char const *host_path, int fhandle) {
+    char *path = strdup(host_path);
+    if (path == NULL) return -1;
+
+    pthread_mutex_lock(&import->lock);
+    if (import->count == import->capacity) {
+        size_t capacity = import->capacity == 0 ? 64 : 2 * import->capacity;
+        import_job_t *jobs =
+            realloc(import->jobs, capacity * sizeof(import_job_t));
+        if (jobs == NULL) {
+            pthread_mutex_unlock(&import->lock);
+            free(path);
+            return -1;
+        }
+        import->jobs = jobs;
+        import->capacity = capacity;
+    }
+    import->jobs[import->count].host_path = path;
+    import->jobs[import->count].fhandle = fhandle;
+    import->count++;
+    pthread_cond_signal(&import->cond);
+    pthread_mutex_unlock(&import->lock);
+    return 0;
+}
+
+/*
+ * Takes the next job of a bulk import, waiting for one while the tree is
+ * still being walked
+ * Returns false once every job was taken and no more will come
+ */
+static bool import_take(import_t *import, import_job_t *job) {
+    pthread_mutex_lock(&import->lock);
+    while (import->next == import->count && !import->walked) {
+        pthread_cond_wait(&import->cond, &import->lock);
+    }
+    bool taken = import->next < import->count;
+    if (taken) {
+        *job = import->jobs[import->next++];
+    }
+    pthread_mutex_unlock(&import->lock);
+    return taken;
+}
+
+/*
+ * Joins a directory path name and an entry name
+ * Returns 0 if successful, -1 if the result does not fit in PATH_MAX
+ */
+static int path_join(char *path, char const *dir, char const *name) {
+    size_t len = strlen(dir);
+    bool slash = len > 0 && dir[len - 1] == '/';
+    int n = snprintf(path, PATH_MAX, "%s%s%s", dir, slash ? "" : "/", name);
+    return n < 0 || n >= PATH_MAX ? -1 : 0;
+}
+
+/*
+ * An entry of a host directory to be imported: its name, whether it is a
+ * directory (or else a regular file) and, once created, the handle of the
+ * file
+ */
+typedef struct {
+    char *name;
+    bool dir;
+    int fhandle;
+} import_entry_t;
+
+/*
+ * Lists the directories and regular files of a host directory (with
+ * their types found before any transaction is started, so that none is
+ * kept open across the calls to stat())
+ * Returns the number of entries, with entries set to an array that must
+ * be freed (as must their names); ret is set to -1 if some entry could
+ * not be listed
+ */
+static size_t import_list(char const *host_dir, import_entry_t **entries,
+                          int *ret) {
+    *entries = NULL;
+    DIR *dir = opendir(host_dir);
+    if (dir == NULL) {
+        *ret = -1;
+        return 0;
+    }
+
+    char host_path[PATH_MAX];
+    size_t count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char const *name = entry->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        struct stat st;
+        if (strlen(name) >= MAX_FILE_NAME ||
+            path_join(host_path, host_dir, name) == -1 ||
+            stat(host_path, &st) == -1) {
+            *ret = -1;
+            continue;
+        }
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) continue;
+
+        import_entry_t *more =
+            realloc(*entries, (count + 1) * sizeof(import_entry_t));
+        if (more == NULL) {
+            *ret = -1;
+            continue;
+        }
+        *entries = more;
+        more[count].name = strdup(name);
+        more[count].dir = S_ISDIR(st.st_mode);
+        more[count].fhandle = -1;
+        if (more[count].name == NULL) {
+            *ret = -1;
+            continue;
+        }
+        count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+/*
+ * Creates, in a TecnicoFS directory, the files and directories found in a
+ * host directory, and then does the same for each subdirectory. The
+ * entries of a directory are inserted in a single transaction, so that
+ * they go to the journal together; once it commits, the files are handed,
+ * still open, to the workers that fill them
+ * Returns 0 if successful, -1 if some entry could not be created
+ */
+static int import_walk(import_t *import, char const *host_dir,
+                       char const *tfs_dir) {
+    char host_path[PATH_MAX];
+    char tfs_path[PATH_MAX];
+    int ret = 0;
+    import_entry_t *entries;
+    size_t count = import_list(host_dir, &entries, &ret);
+
+    journal_begin();
+    for (size_t i = 0; i < count; i++) {
+        if (path_join(tfs_path, tfs_dir, entries[i].name) == -1) {
+            ret = -1;
+        } else if (entries[i].dir) {
+            if (tfs_lookup(tfs_path) == -1 && tfs_mkdir(tfs_path) == -1) {
+                ret = -1;
+            }
+        } else {
+            entries[i].fhandle =
+                file_open(tfs_path, TFS_O_CREAT | TFS_O_TRUNC);
+            if (entries[i].fhandle == -1) ret = -1;
+        }
+    }
+    if (journal_commit() == -1) ret = -1;
+
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].fhandle == -1) continue;
+        if (path_join(host_path, host_dir, entries[i].name) == -1 ||
+            import_push(import, host_path, entries[i].fhandle) == -1) {
+            tfs_close(entries[i].fhandle);
+            ret = -1;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].dir &&
+            (path_join(host_path, host_dir, entries[i].name) == -1 ||
+             path_join(tfs_path, tfs_dir, entries[i].name) == -1 ||
+             import_walk(import, host_path, tfs_path) == -1)) {
+            ret = -1;
+        }
+        free(entries[i].name);
+    }
+    free(entries);
+    return ret;
+}
+
+/*
+ * Worker of a bulk import: takes the next file to be filled until none is
+ * left, writing and closing each in a single transaction (whose commits
+ * the journal groups with the other workers')
+ */
+static void *import_worker(void *arg) {
+    import_t *import = arg;
+    import_job_t job;
+
+    while (import_take(import, &job)) {
+        journal_begin();
+        int fd = open(job.host_path, O_RDONLY);
+        int ret = fd == -1 ? -1 : file_import(fd, job.fhandle);
+        if (tfs_close(job.fhandle) == -1) ret = -1;
+        if (journal_commit() == -1) ret = -1;
+        if (fd != -1) close(fd);
+        if (ret == -1) {
+            atomic_store(&import->failed, true);
+        }
+    }
+    return NULL;
+}
+
+int tfs_import_dir(char const *source_dir, char const *dest_dir,
+                   size_t workers) {
+    /* The destination directory is created if needed (the root always
+     * exists) */
+    bool root = strcmp(dest_dir, "/") == 0;
+    if (!root && !valid_pathname(dest_dir)) return -1;
+    if (!root && tfs_lookup(dest_dir) == -1 && tfs_mkdir(dest_dir) == -1) {
+        return -1;
+    }
+
+    import_t import = {.jobs = NULL, .count = 0, .capacity = 0, .next = 0,
+                       .walked = false};
+    pthread_mutex_init(&import.lock, NULL);
+    pthread_cond_init(&import.cond, NULL);
+    atomic_init(&import.failed, false);
+
+    /* The other workers fill files as the calling thread finds them, and
+     * it joins them once the walk is done */
+    if (workers == 0) workers = 1;
+    pthread_t *tids = malloc((workers - 1) * sizeof(pthread_t));
+    size_t started = workers_start(import_worker, &import, tids, workers - 1);
+    int ret = import_walk(&import, source_dir, dest_dir);
+    pthread_mutex_lock(&import.lock);
+    import.walked = true;
+    pthread_cond_broadcast(&import.cond);
+    pthread_mutex_unlock(&import.lock);
+    import_worker(&import);
+    workers_join(tids, started);
+    free(tids);
+
+    for (size_t i = 0; i < import.count; i++) {
+        free(import.jobs[i].host_path);
+    }
+    free(import.jobs);
+    pthread_mutex_destroy(&import.lock);
+    pthread_cond_destroy(&import.cond);
+    return ret == -1 || atomic_load(&import.failed) ? -1 : 0;
+}
@@ -4,6 +4,7 @@
 #include "config.h"
 #include "state.h"
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <pthread.h>
 
 enum {
@@ -18,6 +19,19 @@ enum {
  */
 int tfs_init();
 
+/*
+ * Initializes tecnicofs keeping its state in an image file, which is mapped
+ * into memory: the FS left in it by a previous run is found as it was
+ * (without being read in), and what is changed is written back to it by
+ * tfs_destroy()
+ * Input:
+ *  - image_path: path name of the image file, created (holding an empty
+ *    FS) if it does not exist; NULL keeps the FS in memory, as tfs_init()
+ * Returns 0 if successful, -1 otherwise (e.g., if the file is not an image
+ * of a FS with the geometry in config.h).
+ */
+int tfs_init_image(char const *image_path);
+
 /*
  * Destroy tecnicofs
  * Returns 0 if successful, -1 otherwise.
@@ -25,7 +39,8 @@ int tfs_init();
 int tfs_destroy();
 
 /*
- * Waits until no file is open and then destroy tecnicofs 
+ * Waits until no file is open and then destroy tecnicofs; files can no
+ * longer be opened once it starts waiting
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_destroy_after_all_closed();
@@ -33,13 +48,20 @@ int tfs_destroy_after_all_closed();
 
 /*
  * Looks for a file
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported Input:
- *  - name: absolute path name
+ * Input:
+ *  - name: absolute path name, whose components are separated by '/'
  * Returns the inumber of the file, -1 if unsuccessful
  */
 int tfs_lookup(char const *name);
 
+/*
+ * Creates a directory
+ * Input:
+ *  - name: absolute path name of the new directory (its parent must exist)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_mkdir(char const *name);
+
 /*
  * Opens a file
  * Input:
@@ -51,13 +73,46 @@ int tfs_lookup(char const *name);
  */
 int tfs_open(char const *name, int flags);
 
-/* Closes a file
+/* Closes a file, flushing the data written to it that is still waiting
+ * in memory (see tfs_fsync())
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_close(int fhandle);
 
+/* Flushes an open file: the data written to it (through any handle) that
+ * is still waiting in memory gets its blocks, and, if the FS is kept in an
+ * image file, the file's contents (written through to it as they are
+ * stored) are waited for to reach the disk
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
+/* Preallocates space for an open file: the blocks it is still missing up
+ * to offset + len are reserved, in as few contiguous runs as possible, so
+ * that writes within them never have to allocate. The size of the file is
+ * left unchanged (see tfs_ftruncate())
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- offset and length of the range to preallocate
+ * Returns 0 if successful, -1 otherwise (if the FS or the file cannot
+ * grow that much, part of the space may have been reserved).
+ */
+int tfs_fallocate(int fhandle, size_t offset, size_t len);
+
+/* Sets the size of an open file: a file that grows reads as zeros past its
+ * old end, and one that shrinks frees the blocks past its new end
+ * (preallocated ones included)
+ * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- new size (in bytes)
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_ftruncate(int fhandle, size_t length);
+
 /* Writes to an open file, starting at the current offset
  * Input:
  * 	- file handle (obtained from a previous call to tfs_open)
@@ -79,8 +134,60 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/* Writes the contents of several buffers to an open file, one after the
+ * other, starting at the current offset, as a single operation
+ * * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- array of buffers, each with its length (see writev(2))
+ * 	- number of buffers in the array
+ * 	Returns the number of bytes that were written (can be lower than the
+ * 	total length if the maximum file size is exceeded), or -1 in case of
+ * 	error
+ */
+ssize_t tfs_writev(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Reads from an open file into several buffers, filling each one before
+ * moving on to the next, starting at the current offset
+ * * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- array of destination buffers, each with its length (see readv(2))
+ * 	- number of buffers in the array
+ * 	Returns the number of bytes that were copied from the file (can be
+ * 	lower than the total length if the file size was reached), or -1 in
+ * 	case of error
+ */
+ssize_t tfs_readv(int fhandle, struct iovec const *iov, int iovcnt);
+
+/* Writes to an open file at the given offset, leaving the current offset
+ * of the handle untouched; a gap past the end of the file reads as zeros
+ * * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- buffer containing the contents to write
+ * 	- length of the contents (in bytes)
+ * 	- offset in the file where the write starts
+ * 	Returns the number of bytes that were written (can be lower than
+ * 	'len' if the maximum file size is exceeded), or -1 in case of error
+ */
+ssize_t tfs_pwrite(int fhandle, void const *buffer, size_t len,
+                   size_t offset);
+
+/* Reads from an open file at the given offset, leaving the current offset
+ * of the handle untouched, so several threads may read through the same
+ * handle in parallel
+ * * Input:
+ * 	- file handle (obtained from a previous call to tfs_open)
+ * 	- destination buffer
+ * 	- length of the buffer
+ * 	- offset in the file where the read starts
+ * 	Returns the number of bytes that were copied from the file to the buffer
+ * 	(can be lower than 'len' if the file size was reached), or -1 in case of
+ * error
+ */
+ssize_t tfs_pread(int fhandle, void *buffer, size_t len, size_t offset);
+
 /* Copies the contents of a file that exists in TecnicoFS to the contents
  * of another file in the OS' file system tree (outside TecnicoFS).
+ * The contents are streamed in chunks of COPY_CHUNK_BLOCKS blocks.
  * Devolve 0 em caso de sucesso, -1 em caso de erro.
  * * Input:
  *      - path name of the source file (from TecnicoFS)
@@ -90,4 +197,63 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 */ 
 int tfs_copy_to_external_fs(char const *source_path, char const *dest_path);
 
+/*
+ * A file to be exported by tfs_export_batch(): its source (in TecnicoFS)
+ * and destination (in the main file system), and how its copy went
+ */
+typedef struct {
+    char const *source_path;
+    char const *dest_path;
+    int status;     /* 0 if copied, -1 otherwise */
+    size_t bytes;   /* bytes copied */
+    double seconds; /* time taken */
+} tfs_export_t;
+
+/* Called as each file of a batch export is done (from the thread that
+ * copied it), with that file and the argument given to the export */
+typedef void (*tfs_export_progress_t)(tfs_export_t const *file, void *arg);
+
+/* Copies several files out of TecnicoFS at once, as with
+ * tfs_copy_to_external_fs(): the files are taken in order by a pool of
+ * worker threads, and files that are copied at the same time only share
+ * locks if they are the same file.
+ * Input:
+ *      - array of files to copy, whose status, bytes and seconds are set
+ *      - number of files in the array
+ *      - number of worker threads (the calling thread included)
+ *      - function called as each file is done (may be NULL), and its
+ *        argument
+ *      Returns 0 if every file was copied, -1 otherwise.
+ */
+int tfs_export_batch(tfs_export_t *files, size_t count, size_t workers,
+                     tfs_export_progress_t progress, void *progress_arg);
+
+/* Copies the contents of a file in the OS' file system tree (outside
+ * TecnicoFS) to a file in TecnicoFS, which is created if needed, and
+ * overwritten if it already exists. The source file is mapped and written
+ * in one go, with the blocks it needs preallocated.
+ * Input:
+ *      - path name of the source file (in the main file system)
+ *      - path name of the destination file (in TecnicoFS)
+ *      Returns 0 if successful, -1 otherwise.
+ */
+int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
+
+/* Imports a directory tree of the OS' file system into TecnicoFS: its
+ * directories and files are created one directory (and journal
+ * transaction) at a time by the calling thread, while a pool of worker
+ * threads fills the files already created, as with
+ * tfs_copy_from_external_fs(). Entries that are neither files nor
+ * directories are skipped.
+ * Input:
+ *      - path name of the source directory (in the main file system)
+ *      - path name of the destination directory (in TecnicoFS), which is
+ *        created if needed
+ *      - number of worker threads (the calling thread included)
+ *      Returns 0 if successful, -1 otherwise (in which case some of the
+ *      files may have been imported).
+ */
+int tfs_import_dir(char const *source_dir, char const *dest_dir,
+                   size_t workers);
+
 #endif // OPERATIONS_H
@@ -1,28 +1,321 @@
 #include "state.h"
 
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /* Persistent FS state  (in reality, it should be maintained in secondary
- * memory; for simplicity, this project maintains it in primary memory) */
+ * memory; for simplicity, this project maintains it in primary memory,
+ * or in a file mapped into it, see fs_image_t below) */
 
 /* I-node table */
-static inode_t inode_table[INODE_TABLE_SIZE];
+static inode_t *inode_table;
 pthread_rwlock_t lock_inodetable;
-static char freeinode_ts[INODE_TABLE_SIZE];
+
+/* Free i-node bitmap, claimed lock-free with compare-and-swap starting at a
+ * next-fit cursor (a word index), so concurrent creations do not scan from
+ * the start of the table nor serialize on a lock */
+#define INODE_BITMAP_WORDS ((INODE_TABLE_SIZE + 63) / 64)
+static _Atomic uint64_t *freeinode_ts;
+static _Atomic size_t freeinode_hint;
 
 /* Data blocks */
-static char fs_data[BLOCK_SIZE * DATA_BLOCKS];
-pthread_rwlock_t lock_datablocks;
-static char free_blocks[DATA_BLOCKS];
+static char *fs_data;
+
+/* Free block bitmap: bit (i % 64) of word (i / 64) is set when block i is
+ * taken. Words are atomic so that blocks can be freed without any lock.
+ * The words are split in BLOCK_GROUPS groups of consecutive blocks, each
+ * allocated under its own lock, and every thread starts its allocations in
+ * a group of its own, so that threads growing different files rarely
+ * contend. */
+#define BITMAP_WORD_BITS (64)
+#define BLOCK_BITMAP_WORDS                                                     \
+    ((DATA_BLOCKS + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS)
+#define GROUP_WORDS ((BLOCK_BITMAP_WORDS + BLOCK_GROUPS - 1) / BLOCK_GROUPS)
+static _Atomic uint64_t *free_blocks;
+
+/* Image holding the persistent state: a superblock describing it, then the
+ * bitmaps, the i-node table and the data blocks. It is kept in memory
+ * unless state_init() is given a file, which is then mapped in as is, so
+ * that a FS left in it is found again without being loaded. The mapping is
+ * private: what changes in memory only reaches the file when written to
+ * it (see the journal below). Images are
+ * only valid for the build that formatted them (the superblock records the
+ * geometry, and is checked when the file is mapped). */
+#define IMAGE_MAGIC UINT64_C(0x5446535f494d4731) /* "TFS_IMG1" */
+
+typedef struct {
+    uint64_t magic; /* IMAGE_MAGIC once formatted, 0 before */
+    uint64_t image_size;
+    uint32_t block_size;
+    uint32_t data_blocks;
+    uint32_t inode_table_size;
+    uint32_t inode_size;
+    uint32_t clean; /* 1 if the image was unmapped with its journal empty */
+} superblock_t;
+
+typedef struct {
+    superblock_t sb;
+    _Atomic uint64_t freeinode_ts[INODE_BITMAP_WORDS];
+    _Atomic uint64_t free_blocks[BLOCK_BITMAP_WORDS];
+    inode_t inode_table[INODE_TABLE_SIZE];
+    char fs_data[BLOCK_SIZE * DATA_BLOCKS];
+} fs_image_t;
+
+static fs_image_t memory_image;
+static fs_image_t *image = &memory_image;
+static int image_fd = -1; /* file the image is mapped from, -1 if none */
+
+/* Bytes of an i-node that are part of the image (its lock is not) */
+#define INODE_PERSISTENT_SIZE offsetof(inode_t, rwlock)
+
+/* Journal of an image mapped from a file (kept next to it, in a file named
+ * after it plus JOURNAL_SUFFIX): a redo log of the changes to i-nodes,
+ * directory entries and extent tree blocks. Each operation is a
+ * transaction, whose changes are appended as records holding their offset
+ * in the image and their new contents, followed by a commit record.
+ * Records are buffered in memory, and a committing thread that finds no
+ * write under way writes out everything buffered so far, with a single
+ * fdatasync() covering every transaction committed by then (group commit).
+ * Once the journal grows past JOURNAL_CHECKPOINT_SIZE, new transactions
+ * wait for the ones under way, the image is written back and the journal
+ * emptied. That is the only time metadata reaches the image file, so that
+ * nothing changed by a transaction that did not commit is ever found there;
+ * file data, which is not logged, is written through to the file as it is
+ * stored (see data_blocks_written()). The bitmaps are not logged either:
+ * after a crash, the committed transactions are replayed and the bitmaps
+ * are rebuilt from the i-nodes reachable from the root directory. */
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_DATA (1)
+#define JOURNAL_COMMIT (2)
+
+typedef struct {
+    uint32_t jr_type;
+    uint32_t jr_length; /* bytes of contents following the record */
+    uint64_t jr_txn;
+    uint64_t jr_offset; /* of the contents in the image */
+    uint64_t jr_checksum; /* of the record (with 0 here) and its contents */
+} journal_record_t;
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} journal_buffer_t;
+
+static int journal_fd = -1; /* -1 when the FS is kept in memory */
+static pthread_mutex_t lock_journal = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+/* Records being appended to, and records being written out */
+static journal_buffer_t journal_buffers[2];
+static uint64_t journal_appended; /* bytes appended since the journal opened */
+static uint64_t journal_flushed;  /* bytes of those already on disk */
+static size_t journal_file_size;
+static bool journal_flushing;
+static bool journal_failed;
+static bool journal_checkpointing;
+static size_t journal_active; /* transactions under way */
+static uint64_t journal_next_txn;
+/* Transaction of the calling thread: nesting depth, number (0 if none) and
+ * whether it logged anything */
+static _Thread_local size_t journal_depth;
+static _Thread_local uint64_t journal_txn;
+static _Thread_local bool journal_dirty;
+/* Runs of blocks freed by the calling thread's transaction, held back until
+ * it commits (see data_block_release()) */
+typedef struct {
+    int start;
+    size_t length;
+} journal_freed_t;
+
+static _Thread_local journal_freed_t *journal_freed;
+static _Thread_local size_t journal_freed_count;
+static _Thread_local size_t journal_freed_capacity;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    size_t hint; /* word where the next allocation starts searching */
+} block_group_t;
+
+static block_group_t block_groups[BLOCK_GROUPS];
+
+/* Per-thread magazines of blocks already taken from the bitmap, so that
+ * most allocations and frees do not touch the bitmap. Every magazine
+ * is registered in a global list so the blocks can be reclaimed when the
+ * bitmap runs out. */
+typedef struct block_magazine {
+    pthread_mutex_t lock;
+    size_t count;
+    int blocks[BLOCK_MAGAZINE_SIZE];
+    struct block_magazine *next;
+} block_magazine_t;
+
+static block_magazine_t *magazines;
+static pthread_mutex_t lock_magazines = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local block_magazine_t *thread_magazine;
+static pthread_key_t magazine_key;
+static pthread_once_t magazine_key_once = PTHREAD_ONCE_INIT;
+
+/* Blocks that allocations may still take: those not mapped by any file,
+ * less the ones reserved for the data waiting in dirty buffers (see
+ * inode_buffer()). Signed, as a flush allocates blocks before giving their
+ * reservation back. */
+static _Atomic long available_blocks;
+/* Reserved blocks that the calling thread's allocations draw on first */
+static _Thread_local size_t reserved_credit;
+/* Data blocks needed by all dirty buffers together */
+static _Atomic size_t dirty_blocks;
 
 /* Volatile FS state */
-static open_file_entry_t open_file_table[MAX_OPEN_FILES];
-pthread_rwlock_t lock_openfiletable;
-static char free_open_file_entries[MAX_OPEN_FILES];
+
+/* Bumped by every state_init(), so that volatile structures built for a
+ * previous state can tell they are stale */
+static _Atomic unsigned state_generation;
+
+/* Directory indexes: open addressing hash tables mapping entry names to
+ * their slot in the directory, one per i-node (only used by directories).
+ * Each is protected by its directory's rwlock and built on first use. */
+#define DIR_INDEX_EMPTY (-1)
+#define DIR_INDEX_DELETED (-2)
+
+typedef struct {
+    uint32_t hash;
+    int slot; /* entry number, DIR_INDEX_EMPTY or DIR_INDEX_DELETED */
+} dir_index_entry_t;
+
+typedef struct {
+    /* State generation the index was built for */
+    _Alignas(CACHE_LINE_SIZE) unsigned generation;
+    size_t capacity;     /* power of two */
+    size_t used;         /* live entries plus tombstones */
+    dir_index_entry_t *table;
+    /* Stack of empty slots */
+    size_t free_count;
+    size_t free_capacity;
+    int *free_slots;
+} dir_index_t;
+
+static dir_index_t dir_indexes[INODE_TABLE_SIZE];
+
+/* Dentry cache: direct-mapped table of (parent i-number, name) -> i-number
+ * translations, split in shards that are locked independently. It lets
+ * path walks skip the directory accesses for components seen before.
+ * Entries are only inserted and invalidated while holding the parent
+ * directory's rwlock, so they never outlive the directory entry. */
+typedef struct {
+    unsigned generation; /* state generation the entry belongs to */
+    int parent;
+    int child;
+    char name[MAX_FILE_NAME];
+} dcache_entry_t;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t lock;
+} dcache_shard_t;
+
+static dcache_entry_t dcache[DCACHE_SIZE];
+static dcache_shard_t dcache_shards[DCACHE_SHARDS];
+
+/* Buffer cache: the blocks and i-nodes that would currently be held in
+ * memory, were the FS state kept in secondary storage. Their contents stay
+ * in fs_data and inode_table, which play the role of the storage device;
+ * the cache only decides which accesses pay the storage delay (misses).
+ * It is a hash table split in shards that are locked independently, each
+ * with its own frames, reclaimed with the CLOCK algorithm: the hand skips
+ * (and clears) frames referenced since it last passed. */
+#define CACHE_SHARD_FRAMES (BUFFER_CACHE_SIZE / BUFFER_CACHE_SHARDS)
+#define CACHE_SHARD_BUCKETS (2 * CACHE_SHARD_FRAMES)
+/* Blocks are cached under their number, i-nodes after the last block */
+#define INODE_CACHE_KEY(inumber) (DATA_BLOCKS + (inumber))
+
+typedef struct {
+    int key;  /* block or i-node held, -1 if none */
+    int next; /* next frame in the same bucket, -1 if none */
+    bool referenced;
+} cache_frame_t;
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t lock;
+    size_t hand;
+    size_t hits;
+    size_t misses;
+    int buckets[CACHE_SHARD_BUCKETS]; /* first frame of each, -1 if none */
+    cache_frame_t frames[CACHE_SHARD_FRAMES];
+} cache_shard_t;
+
+static cache_shard_t cache_shards[BUFFER_CACHE_SHARDS];
+
+/* Read-ahead: runs of blocks waiting to be brought into the buffer cache by
+ * a background thread, which is started on first use. Requests that find
+ * the queue full are dropped. */
+typedef struct {
+    int start;
+    size_t count;
+} prefetch_request_t;
+
+static prefetch_request_t prefetch_queue[PREFETCH_QUEUE_SIZE];
+static size_t prefetch_head;
+static size_t prefetch_count;
+static bool prefetch_running;
+static bool prefetch_busy; /* a request was taken and is being served */
+static bool prefetch_stop;
+static pthread_t prefetch_thread;
+static pthread_mutex_t lock_prefetch = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t prefetch_idle_cond = PTHREAD_COND_INITIALIZER;
+
+/* Open file table: segments of OPEN_FILE_SEGMENT_SIZE entries, allocated
+ * as handles are needed and never moved, so that entries can be reached
+ * without any lock. Free entries are kept in lock-free stacks, one per
+ * shard, whose heads hold the top entry (plus one) in their low half and a
+ * counter bumped on every change in their high half, so that a stack that
+ * changed and came back to the same top is told apart. Each thread takes
+ * and returns entries through a shard of its own first. */
+#define OPEN_FILE_SEGMENTS (MAX_OPEN_FILES / OPEN_FILE_SEGMENT_SIZE)
+/* A handle is its entry's number, in the low OPEN_FILE_INDEX_BITS bits,
+ * with the entry's generation above it */
+#define OPEN_FILE_INDEX_BITS (16)
+#define OPEN_FILE_GENERATION_MASK ((1U << (31 - OPEN_FILE_INDEX_BITS)) - 1)
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint64_t head;
+} open_file_shard_t;
+
+static open_file_entry_t *_Atomic open_file_segments[OPEN_FILE_SEGMENTS];
+static _Atomic size_t open_file_segment_count;
+static open_file_shard_t open_file_shards[OPEN_FILE_SHARDS];
+/* Serializes the growth of the table */
+static pthread_mutex_t lock_openfiletable = PTHREAD_MUTEX_INITIALIZER;
+/* Handles currently open; whoever closes the last one wakes the threads
+ * waiting for none to be */
+static _Atomic size_t open_file_count;
+static pthread_mutex_t lock_open_file_count = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t open_file_count_cond = PTHREAD_COND_INITIALIZER;
+
+/* Number given to the calling thread, round-robin, plus one (0 if unset);
+ * picks the block group and the open file shard it uses first */
+static _Thread_local size_t thread_number;
+static _Atomic size_t next_thread_number;
+
+/* Optimistic reads of an i-node's size given up on before taking its lock */
+#define INODE_STAT_RETRIES (3)
+
+/* First file block of unused extents and index entries, which sorts last */
+#define UNUSED_BLOCK INT_MAX
+
+/* Entries in a leaf and in an index block of an indirect extent tree */
+#define LEAF_EXTENTS (BLOCK_SIZE / sizeof(extent_t))
+#define INDEX_ENTRIES (BLOCK_SIZE / sizeof(extent_index_t))
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -32,8 +325,48 @@ static inline bool valid_block_number(int block_number) {
     return block_number >= 0 && block_number < DATA_BLOCKS;
 }
 
-static inline bool valid_file_handle(int file_handle) {
-    return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
+/*
+ * Takes blocks from the ones available for allocation.
+ * Input:
+ *  - n: number of blocks wanted
+ *  - partial: whether fewer than n blocks will do
+ * Returns: the number of blocks taken (n or 0, unless partial)
+ */
+static size_t blocks_claim(size_t n, bool partial) {
+    long available = atomic_load(&available_blocks);
+    size_t granted;
+    do {
+        granted = available <= 0 ? 0 : (size_t)available;
+        if (granted > n) {
+            granted = n;
+        }
+        if (granted == 0 || (granted < n && !partial)) {
+            return 0;
+        }
+    } while (!atomic_compare_exchange_weak(&available_blocks, &available,
+                                           available - (long)granted));
+    return granted;
+}
+
+/*
+ * Accounts for an allocation of blocks, drawing on the calling thread's
+ * reserved blocks first (see blocks_claim()).
+ */
+static size_t blocks_take(size_t n, bool partial) {
+    size_t credit = reserved_credit < n ? reserved_credit : n;
+    size_t claimed = blocks_claim(n - credit, partial);
+    if (claimed < n - credit && !partial) {
+        return 0;
+    }
+    reserved_credit -= credit;
+    return credit + claimed;
+}
+
+/*
+ * Makes blocks available for allocation again.
+ */
+static void blocks_give(size_t n) {
+    atomic_fetch_add(&available_blocks, (long)n);
 }
 
 
@@ -66,398 +399,3056 @@ static void insert_delay() {
 }
 
 /*
- * Initializes FS state
+ * Frees a run of contiguous data blocks. Short runs go to the thread's
+ * magazine, long ones straight back to the bitmap.
  */
-int state_init() {
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
+static void data_block_free_run(int start, size_t length) {
+    if (length <= BLOCK_MAGAZINE_SIZE / 2) {
+        for (size_t i = 0; i < length; i++) {
+            data_block_free(start + (int)i);
+        }
+        return;
     }
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+    insert_delay(); // simulate storage access delay to free_blocks
+    for (size_t b = (size_t)start; b < (size_t)start + length; b++) {
+        atomic_fetch_and(&free_blocks[b / BITMAP_WORD_BITS],
+                         ~(UINT64_C(1) << (b % BITMAP_WORD_BITS)));
     }
+    blocks_give(length);
+}
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+/*
+ * Frees a run of data blocks that a file maps in the committed state. Within
+ * a transaction, the blocks are only freed once it commits (see
+ * journal_commit()): were they handed out before, a transaction committed
+ * ahead of this one would map them as well after a crash.
+ */
+static void data_block_release(int start, size_t length) {
+    if (journal_fd == -1 || journal_depth == 0) {
+        data_block_free_run(start, length);
+        return;
     }
 
-    if (pthread_rwlock_init(&lock_inodetable, NULL) != 0) return -1;
-    if (pthread_rwlock_init(&lock_datablocks, NULL) != 0) return -1;
-    if (pthread_rwlock_init(&lock_openfiletable, NULL) != 0) return -1;
+    if (journal_freed_count == journal_freed_capacity) {
+        size_t capacity =
+            journal_freed_capacity == 0 ? 16 : 2 * journal_freed_capacity;
+        journal_freed_t *freed =
+            realloc(journal_freed, capacity * sizeof(journal_freed_t));
+        if (freed == NULL) {
+            /* Better to risk it after a crash than to leak the blocks */
+            data_block_free_run(start, length);
+            return;
+        }
+        journal_freed = freed;
+        journal_freed_capacity = capacity;
+    }
+    journal_freed[journal_freed_count].start = start;
+    journal_freed[journal_freed_count].length = length;
+    journal_freed_count++;
+}
 
-    return 0;
+/*
+ * Returns the buffer cache shard and hash bucket of a block or i-node.
+ */
+static cache_shard_t *cache_slot(int key, int **bucket) {
+    uint32_t h = (uint32_t)key * UINT32_C(2654435761);
+    cache_shard_t *shard = &cache_shards[h % BUFFER_CACHE_SHARDS];
+    *bucket = &shard->buckets[h / BUFFER_CACHE_SHARDS % CACHE_SHARD_BUCKETS];
+    return shard;
+}
+
+/*
+ * Returns the frame holding a block or i-node in a bucket, -1 if none.
+ * Must be called with the shard's lock held.
+ */
+static int cache_find(cache_shard_t *shard, int const *bucket, int key) {
+    for (int f = *bucket; f != -1; f = shard->frames[f].next) {
+        if (shard->frames[f].key == key) {
+            return f;
+        }
+    }
+    return -1;
 }
 
-void state_destroy() { /* nothing to do */
+/*
+ * Tells whether a block or i-node is in the buffer cache, without
+ * counting it as an access.
+ */
+static bool cache_contains(int key) {
+    int *bucket;
+    cache_shard_t *shard = cache_slot(key, &bucket);
+    pthread_mutex_lock(&shard->lock);
+    bool found = cache_find(shard, bucket, key) != -1;
+    pthread_mutex_unlock(&shard->lock);
+    return found;
 }
 
 /*
- * Creates a new i-node in the i-node table.
+ * Looks up a block or i-node in the buffer cache, bringing it in (and
+ * evicting another one) if it is not there.
  * Input:
- *  - n_type: the type of the node (file or directory)
- * Returns:
- *  new i-node's number if successfully created, -1 otherwise
+ *  - key: block number, or INODE_CACHE_KEY() of an i-node number
+ *  - demand: whether to count the access as a hit or a miss (read-ahead
+ *    accesses are not counted)
+ * Returns: true if it was cached (a hit), false otherwise
  */
-int inode_create(inode_type n_type) {
-    for (int inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * (int) sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
-        }
-
-        /* Finds first free entry in i-node table */
-        if (freeinode_ts[inumber] == FREE) {
-            /* Found a free entry, so takes it for the new i-node*/
-            freeinode_ts[inumber] = TAKEN;
-            insert_delay(); // simulate storage access delay (to i-node)
-            inode_table[inumber].i_node_type = n_type;
-
-            if (n_type == T_DIRECTORY) {
-                /* Initializes directory (filling its block with empty
-                 * entries, labeled with inumber==-1) */
-                int b = data_block_alloc();
-                if (b == -1) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
-                
-                inode_table[inumber].i_size = BLOCK_SIZE;
-                inode_table[inumber].i_data_block[0] = b;
-                inode_table[inumber].i_data_block[1] = -1;
-                if (pthread_rwlock_init(&inode_table[inumber].rwlock, NULL) != 0) return -1;
-
-                dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-                if (dir_entry == NULL) {
-                    freeinode_ts[inumber] = FREE;
-                    return -1;
-                }
-
-                for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-                    dir_entry[i].d_inumber = -1;
-                }
-            } else {
-                /* In case of a new file, simply sets its size to 0 */
-                inode_table[inumber].i_size = 0;
-                inode_table[inumber].i_data_block[0] = -1;
-                if (pthread_rwlock_init(&inode_table[inumber].rwlock, NULL) != 0) return -1;
+static bool cache_access(int key, bool demand) {
+    int *bucket;
+    cache_shard_t *shard = cache_slot(key, &bucket);
+
+    pthread_mutex_lock(&shard->lock);
+    int f = cache_find(shard, bucket, key);
+    if (f != -1) {
+        shard->frames[f].referenced = true;
+        if (demand) {
+            shard->hits++;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        return true;
+    }
+    if (demand) {
+        shard->misses++;
+    }
 
-            }
-            return inumber;
+    /* Advance the hand to the first frame not referenced recently */
+    cache_frame_t *frame = &shard->frames[shard->hand];
+    while (frame->key != -1 && frame->referenced) {
+        frame->referenced = false;
+        shard->hand = (shard->hand + 1) % CACHE_SHARD_FRAMES;
+        frame = &shard->frames[shard->hand];
+    }
+    int victim = (int)shard->hand;
+    shard->hand = (shard->hand + 1) % CACHE_SHARD_FRAMES;
+
+    if (frame->key != -1) {
+        int *p;
+        cache_slot(frame->key, &p);
+        while (*p != victim) {
+            p = &shard->frames[*p].next;
         }
+        *p = frame->next;
     }
-    return -1;
+    frame->key = key;
+    frame->referenced = true;
+    frame->next = *bucket;
+    *bucket = victim;
+    pthread_mutex_unlock(&shard->lock);
+    return false;
 }
 
 /*
- * Deletes the i-node.
- * Input:
- *  - inumber: i-node's number
- * Returns: 0 if successful, -1 if failed
+ * Accesses a block or i-node through the buffer cache, paying the storage
+ * delay only if it was not cached.
  */
-int inode_delete(int inumber) {
-    // simulate storage access delay (to i-node and freeinode_ts)
-    insert_delay();
-    insert_delay();
+static void storage_access(int key) {
+    if (!cache_access(key, true)) {
+        insert_delay(); // simulate storage access delay (a cache miss)
+    }
+}
 
-    if (!valid_inumber(inumber) || freeinode_ts[inumber] == FREE) {
-        return -1;
+/*
+ * Returns the number of the calling thread, assigning one on first use.
+ */
+static size_t thread_id() {
+    if (thread_number == 0) {
+        thread_number = atomic_fetch_add(&next_thread_number, 1) + 1;
     }
+    return thread_number - 1;
+}
 
-    inode_t inode = inode_table[inumber];
+/*
+ * Returns the open file entry with the given number, NULL if the table has
+ * not grown that far.
+ */
+static open_file_entry_t *open_file_entry_at(size_t index) {
+    if (index >= MAX_OPEN_FILES) {
+        return NULL;
+    }
+    open_file_entry_t *segment =
+        atomic_load_explicit(&open_file_segments[index / OPEN_FILE_SEGMENT_SIZE],
+                             memory_order_acquire);
+    if (segment == NULL) {
+        return NULL;
+    }
+    return &segment[index % OPEN_FILE_SEGMENT_SIZE];
+}
 
-    freeinode_ts[inumber] = FREE;
+/*
+ * Pushes a free open file entry onto a shard's stack.
+ */
+static void open_file_push(size_t shard, size_t index) {
+    open_file_entry_t *entry = open_file_entry_at(index);
+    if (entry == NULL) {
+        return;
+    }
 
-    pthread_rwlock_wrlock(&lock_datablocks);
-    pthread_rwlock_wrlock(&inode_get(inumber)->rwlock);
-    if (inode_table[inumber].i_size > 0) {
-        int size = BLOCK_SIZE/sizeof(int), i = 0, j = 0, *pointer;
-        while (j < size) {
-            if (i > MAX_DIRECT_BLOCKS) {
-                if (pointer[j] == -1) break;
-                else if (data_block_free(pointer[j]) == -1) {
-                    pthread_rwlock_unlock(&lock_datablocks);
-                    pthread_rwlock_unlock(&inode_get(inumber)->rwlock);
-                    return -1;
-                }
-                j++;
-            } else {
-                if (inode.i_data_block[i] == -1) break; // Get a direct block
-                if (i == MAX_DIRECT_BLOCKS) pointer = data_block_get(inode.i_data_block[i]); // Set pointer to the allocation block
-                else if (data_block_free(inode.i_data_block[i]) == -1) {
-                    pthread_rwlock_unlock(&lock_datablocks);
-                    pthread_rwlock_unlock(&inode_get(inumber)->rwlock);
-                    return -1;
-                }
-            }
-            i++;
+    _Atomic uint64_t *head = &open_file_shards[shard].head;
+    uint64_t old = atomic_load(head);
+    uint64_t new;
+    do {
+        atomic_store_explicit(&entry->of_next, (int)(old & UINT32_MAX),
+                              memory_order_relaxed);
+        new = ((old >> 32) + 1) << 32 | (index + 1);
+    } while (!atomic_compare_exchange_weak(head, &old, new));
+}
+
+/*
+ * Pops a free open file entry from a shard's stack.
+ * Returns: the entry's number, -1 if the stack is empty
+ */
+static int open_file_pop(size_t shard) {
+    _Atomic uint64_t *head = &open_file_shards[shard].head;
+    uint64_t old = atomic_load(head);
+    for (;;) {
+        size_t top = (size_t)(old & UINT32_MAX);
+        open_file_entry_t *entry = top == 0 ? NULL : open_file_entry_at(top - 1);
+        if (entry == NULL) {
+            return -1;
+        }
+        /* If the entry is taken by someone else first, the counter will
+         * have changed and the exchange fails */
+        uint64_t next = (uint64_t)atomic_load_explicit(&entry->of_next,
+                                                       memory_order_relaxed);
+        if (atomic_compare_exchange_weak(head, &old,
+                                         ((old >> 32) + 1) << 32 | next)) {
+            return (int)(top - 1);
         }
     }
-    pthread_rwlock_unlock(&lock_datablocks);
-    pthread_rwlock_unlock(&inode_get(inumber)->rwlock);
-    return 0;
 }
 
 /*
- * Returns a pointer to an existing i-node.
- * Input:
- *  - inumber: identifier of the i-node
- * Returns: pointer if successful, NULL if failed
+ * Closes an open file entry, provided it is still open with the given
+ * generation, and hands it to the calling thread's free list.
+ * Returns: 0 if successful, -1 otherwise
  */
-inode_t *inode_get(int inumber) {
-    if (!valid_inumber(inumber)) {
-        return NULL;
+static int open_file_close(size_t index, unsigned generation) {
+    open_file_entry_t *entry = open_file_entry_at(index);
+    if (entry == NULL || generation % 2 == 0 ||
+        !atomic_compare_exchange_strong(&entry->of_generation, &generation,
+                                        generation + 1)) {
+        return -1;
+    }
+    open_file_push(thread_id() % OPEN_FILE_SHARDS, index);
+    if (atomic_fetch_sub(&open_file_count, 1) == 1) {
+        pthread_mutex_lock(&lock_open_file_count);
+        pthread_cond_broadcast(&open_file_count_cond);
+        pthread_mutex_unlock(&lock_open_file_count);
     }
+    return 0;
+}
 
-    insert_delay(); // simulate storage access delay to i-node
-    return &inode_table[inumber];
+/*
+ * Points the persistent state at an image.
+ */
+static void image_use(fs_image_t *img) {
+    image = img;
+    inode_table = img->inode_table;
+    freeinode_ts = img->freeinode_ts;
+    fs_data = img->fs_data;
+    free_blocks = img->free_blocks;
 }
 
 /*
- * Adds an entry to the i-node directory data.
+ * Maps an image file in (creating the file if it does not exist) and makes
+ * it the one in use.
  * Input:
- *  - inumber: identifier of the i-node
- *  - sub_inumber: identifier of the sub i-node entry
- *  - sub_name: name of the sub i-node entry
- * Returns: SUCCESS or FAIL
+ *  - path: path name of the image file
+ * Returns: 1 if the image holds a FS, 0 if it has yet to be formatted, -1
+ *  if it could not be mapped or was formatted with a different geometry
  */
-int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
-    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
+static int image_attach(char const *path) {
+    int fd = open(path, O_RDWR | O_CREAT, 0666);
+    if (fd == -1) {
         return -1;
     }
 
-    insert_delay(); // simulate storage access delay to i-node with inumber
-    if (inode_table[inumber].i_node_type != T_DIRECTORY) {
+    /* A new (empty) file is grown to the size of an image, which reads as
+     * zeros, i.e., not formatted */
+    struct stat st;
+    if (fstat(fd, &st) == -1 ||
+        (st.st_size == 0 && ftruncate(fd, (off_t)sizeof(fs_image_t)) == -1) ||
+        (st.st_size != 0 && st.st_size != (off_t)sizeof(fs_image_t))) {
+        close(fd);
         return -1;
     }
 
-    if (strlen(sub_name) == 0) {
+    fs_image_t *img = mmap(NULL, sizeof(fs_image_t), PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 0);
+    if (img == MAP_FAILED) {
+        close(fd);
         return -1;
     }
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block[0]);
-    if (dir_entry == NULL) {
+    superblock_t const *sb = &img->sb;
+    if (sb->magic != 0 &&
+        (sb->magic != IMAGE_MAGIC || sb->image_size != sizeof(fs_image_t) ||
+         sb->block_size != BLOCK_SIZE || sb->data_blocks != DATA_BLOCKS ||
+         sb->inode_table_size != INODE_TABLE_SIZE ||
+         sb->inode_size != sizeof(inode_t))) {
+        munmap(img, sizeof(fs_image_t));
+        close(fd);
         return -1;
     }
 
-    /* Finds and fills the first empty entry */
-    pthread_rwlock_wrlock(&lock_datablocks);
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = 0;
-            pthread_rwlock_unlock(&lock_datablocks);
-            return 0;
-        } 
-    }
-    pthread_rwlock_unlock(&lock_datablocks);
-    return -1;
+    image_fd = fd;
+    image_use(img);
+    return sb->magic == IMAGE_MAGIC;
 }
 
-/* Looks for a given name inside a directory
+/*
+ * Writes a part of the image in use, as it is in memory, to the file it is
+ * mapped from, waiting for it to reach the disk if sync is set.
  * Input:
- * 	- parent directory's i-node number
- * 	- name to search
- * 	Returns i-number linked to the target name, -1 if not found
+ *  - ptr: start of the part, within the image
+ *  - length: its length
+ *  - sync: whether to wait for the file's data to reach the disk
+ * Returns: 0 if successful, -1 otherwise
  */
-int find_in_dir(int inumber, char const *sub_name) {
-    insert_delay(); // simulate storage access delay to i-node with inumber
-    if (!valid_inumber(inumber) ||
-        inode_table[inumber].i_node_type != T_DIRECTORY) {
-        return -1;
+static int image_write(void const *ptr, size_t length, bool sync) {
+    off_t offset = (off_t)((char const *)ptr - (char const *)image);
+    for (size_t done = 0; done < length;) {
+        ssize_t n = pwrite(image_fd, (char const *)ptr + done, length - done,
+                           offset + (off_t)done);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += (size_t)n;
+    }
+    int synced = 0;
+    if (sync) {
+        do {
+            synced = fdatasync(image_fd);
+        } while (synced == -1 && errno == EINTR);
     }
+    return synced;
+}
 
-    /* Locates the block containing the directory's entries */
-    dir_entry_t *dir_entry =
-        (dir_entry_t *)data_block_get(inode_table[inumber].i_data_block[0]);
-    if (dir_entry == NULL) {
-        return -1;
+/*
+ * Returns the checksum (64-bit FNV-1a) of a journal record and its
+ * contents, taken with the record's own checksum field set to 0.
+ */
+static uint64_t journal_checksum(journal_record_t const *record,
+                                 void const *contents) {
+    journal_record_t header = *record;
+    header.jr_checksum = 0;
+
+    uint64_t hash = UINT64_C(14695981039346656037);
+    unsigned char const *bytes = (unsigned char const *)&header;
+    for (size_t i = 0; i < sizeof(header); i++) {
+        hash = (hash ^ bytes[i]) * UINT64_C(1099511628211);
     }
+    bytes = contents;
+    for (size_t i = 0; i < record->jr_length; i++) {
+        hash = (hash ^ bytes[i]) * UINT64_C(1099511628211);
+    }
+    return hash;
+}
 
-    /* Iterates over the directory entries looking for one that has the target
-     * name */
-    pthread_rwlock_wrlock(&lock_datablocks);
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-            pthread_rwlock_unlock(&lock_datablocks);
-            return dir_entry[i].d_inumber;
+/*
+ * Appends a record of the calling thread's transaction to the journal
+ * buffer.
+ * Must be called with lock_journal held.
+ * Input:
+ *  - type: JOURNAL_DATA or JOURNAL_COMMIT
+ *  - offset, contents, length: for data records, where the contents go in
+ *    the image, and the contents themselves
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_append(uint32_t type, uint64_t offset,
+                          void const *contents, size_t length) {
+    journal_buffer_t *buffer = &journal_buffers[0];
+    size_t needed = sizeof(journal_record_t) + length;
+    if (buffer->length + needed > buffer->capacity) {
+        size_t capacity = buffer->capacity == 0 ? BLOCK_SIZE : buffer->capacity;
+        while (capacity < buffer->length + needed) {
+            capacity *= 2;
+        }
+        char *data = realloc(buffer->data, capacity);
+        if (data == NULL) {
+            journal_failed = true;
+            return -1;
         }
+        buffer->data = data;
+        buffer->capacity = capacity;
     }
-    pthread_rwlock_unlock(&lock_datablocks);
-    return -1;
+
+    journal_record_t record = {type, (uint32_t)length, journal_txn, offset, 0};
+    record.jr_checksum = journal_checksum(&record, contents);
+    memcpy(buffer->data + buffer->length, &record, sizeof(record));
+    if (length > 0) {
+        memcpy(buffer->data + buffer->length + sizeof(record), contents,
+               length);
+    }
+    buffer->length += needed;
+    journal_appended += needed;
+    return 0;
 }
 
 /*
- * Allocated a new data block
- * Returns: block index if successful, -1 otherwise
+ * Waits until the journal is on disk up to a given point. If no other
+ * thread is writing it out, the calling thread writes out everything
+ * appended so far, on behalf of every transaction waiting for it.
+ * Must be called with lock_journal held, which is released meanwhile.
+ * Input:
+ *  - upto: number of bytes appended that must be on disk
+ * Returns: 0 if successful, -1 if the journal could not be written
  */
-int data_block_alloc() {
-    pthread_rwlock_wrlock(&lock_datablocks);
-    for (int i = 0; i < DATA_BLOCKS; i++) {
-        if (i * (int) sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
+static int journal_flush(uint64_t upto) {
+    while (journal_flushed < upto && !journal_failed) {
+        if (journal_flushing) {
+            pthread_cond_wait(&journal_cond, &lock_journal);
+            continue;
         }
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-            pthread_rwlock_unlock(&lock_datablocks);
-            return i;
+        /* Threads keep appending to the other buffer while this one is
+         * written */
+        journal_buffer_t buffer = journal_buffers[0];
+        journal_buffers[0] = journal_buffers[1];
+        journal_buffers[0].length = 0;
+        journal_buffers[1] = buffer;
+        uint64_t end = journal_appended;
+        journal_flushing = true;
+        pthread_mutex_unlock(&lock_journal);
+
+        /* Interrupted and short writes are taken up where they left off */
+        bool ok = true;
+        for (size_t done = 0; ok && done < buffer.length;) {
+            ssize_t n = write(journal_fd, buffer.data + done,
+                              buffer.length - done);
+            if (n == -1 && errno == EINTR) continue;
+            ok = n > 0;
+            done += ok ? (size_t)n : 0;
+        }
+        int synced;
+        do {
+            synced = fdatasync(journal_fd);
+        } while (synced == -1 && errno == EINTR);
+        ok = ok && synced == 0;
+
+        pthread_mutex_lock(&lock_journal);
+        journal_flushing = false;
+        journal_file_size += buffer.length;
+        if (ok) {
+            journal_flushed = end;
+        } else {
+            journal_failed = true;
         }
+        pthread_cond_broadcast(&journal_cond);
     }
-    pthread_rwlock_unlock(&lock_datablocks);
-    return -1;
+    return journal_failed ? -1 : 0;
 }
 
-
-// METEMOS OU NAO
-/* Frees a data block
- * Input
- * 	- the block index
- * Returns: 0 if success, -1 otherwise
+/*
+ * Writes the image back to its file and empties the journal.
+ * Must be called with lock_journal held and no transaction under way.
+ * Returns: 0 if successful, -1 otherwise
  */
-int data_block_free(int block_number) {
-    if (!valid_block_number(block_number)) {
+static int journal_checkpoint() {
+    if (journal_flush(journal_appended) == -1 ||
+        image_write(image, sizeof(fs_image_t), true) == -1 ||
+        ftruncate(journal_fd, 0) == -1) {
+        journal_failed = true;
         return -1;
     }
-
-    insert_delay(); // simulate storage access delay to free_blocks
-    free_blocks[block_number] = FREE;
+    journal_file_size = 0;
     return 0;
 }
 
-
-// METEMOS OU NAO
-/* Returns a pointer to the contents of a given block
- * Input:
- * 	- Block's index
- * Returns: pointer to the first byte of the block, NULL otherwise
+/*
+ * Starts a transaction for the calling thread, which groups the changes it
+ * makes until journal_commit(); nested calls join the transaction already
+ * started.
  */
-void *data_block_get(int block_number) {
-    if (!valid_block_number(block_number)) {
-        return NULL;
+void journal_begin() {
+    if (journal_fd == -1 || journal_depth++ > 0) {
+        return;
     }
 
-    insert_delay(); // simulate storage access delay to block
-    return &fs_data[block_number * BLOCK_SIZE];
+    pthread_mutex_lock(&lock_journal);
+    while (journal_checkpointing) {
+        pthread_cond_wait(&journal_cond, &lock_journal);
+    }
+    journal_active++;
+    journal_txn = ++journal_next_txn;
+    pthread_mutex_unlock(&lock_journal);
 }
 
-/* Add new entry to the open file table
- * Inputs:
- * 	- I-node number of the file to open
- * 	- Initial offset
- * Returns: file handle if successful, -1 otherwise
+/*
+ * Logs the new contents of a part of the image in the calling thread's
+ * transaction.
+ * Must be called with the lock protecting that part held, so that changes
+ * to it are logged in the order they are made.
  */
-int add_to_open_file_table(int inumber, size_t offset) {
-    pthread_rwlock_wrlock(&lock_openfiletable);
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            pthread_rwlock_unlock(&lock_openfiletable);
-            return i;
-        }
+static void journal_log(void const *ptr, size_t length) {
+    if (journal_fd == -1) {
+        return;
     }
-    pthread_rwlock_unlock(&lock_openfiletable);
-    return -1;
-}
 
-// METEMOS OU NAO
-/* Frees an entry from the open file table
- * Inputs:
- * 	- file handle to free/close
- * Returns 0 is success, -1 otherwise
- */
-int remove_from_open_file_table(int fhandle) {
-    if (!valid_file_handle(fhandle) ||
-        free_open_file_entries[fhandle] != TAKEN) {
-        return -1;
+    uint64_t offset = (uint64_t)((char const *)ptr - (char const *)image);
+    pthread_mutex_lock(&lock_journal);
+    if (journal_append(JOURNAL_DATA, offset, ptr, length) == 0) {
+        journal_dirty = true;
     }
-    free_open_file_entries[fhandle] = FREE;
-    return 0;
+    pthread_mutex_unlock(&lock_journal);
 }
 
-/* Returns pointer to a given entry in the open file table
- * Inputs:
- * 	 - file handle
- * Returns: pointer to the entry if sucessful, NULL otherwise
+/*
+ * Ends the calling thread's transaction (the outermost one, if nested),
+ * returning once it is on disk.
+ * Returns: 0 if successful, -1 if the journal could not be written
  */
-open_file_entry_t *get_open_file_entry(int fhandle) {
-    if (!valid_file_handle(fhandle)) {
-        return NULL;
+int journal_commit() {
+    if (journal_fd == -1 || --journal_depth > 0) {
+        return 0;
     }
-    return &open_file_table[fhandle];
-}
 
-int* to_alloc(size_t to_write) {
-    
-    size_t divided = to_write > BLOCK_SIZE ? to_write / BLOCK_SIZE : 1, 
-    size = divided % 1 != 0 ? divided - divided % 1 + 1: divided;
-    int *indexes = (int*) malloc(sizeof(int)*(size + 1)), index;
+    pthread_mutex_lock(&lock_journal);
+    int ret = journal_failed ? -1 : 0;
+    if (journal_dirty && ret == 0) {
+        ret = journal_append(JOURNAL_COMMIT, 0, NULL, 0);
+        if (ret == 0) {
+            ret = journal_flush(journal_appended);
+        }
+    }
+    journal_active--;
 
-    if (indexes == NULL) return NULL;
-    if (to_write == 0) {
-        indexes[0] = -1;
-        return indexes;
+    if (journal_file_size >= JOURNAL_CHECKPOINT_SIZE) {
+        journal_checkpointing = true;
     }
-    insert_delay();
+    if (journal_checkpointing && journal_active == 0) {
+        journal_checkpoint();
+        journal_checkpointing = false;
+        pthread_cond_broadcast(&journal_cond);
+    }
+    pthread_mutex_unlock(&lock_journal);
 
-    for (int i = 0; i < size; i++) {
-        index = data_block_alloc();
-        if (index == -1) {
-            return NULL;
-        }
-        indexes[i] = index;
+    /* Even if the commit failed: the FS in memory no longer maps them */
+    for (size_t i = 0; i < journal_freed_count; i++) {
+        data_block_free_run(journal_freed[i].start, journal_freed[i].length);
     }
-    indexes[size] = -1;
-    return indexes;
+    free(journal_freed);
+    journal_freed = NULL;
+    journal_freed_count = 0;
+    journal_freed_capacity = 0;
+
+    journal_txn = 0;
+    journal_dirty = false;
+    return ret;
 }
 
-int give_size(int* array) {
+static int txn_compare(void const *a, void const *b) {
+    uint64_t x = *(uint64_t const *)a;
+    uint64_t y = *(uint64_t const *)b;
+    return (x > y) - (x < y);
+}
 
-    int counter = 0;
+/*
+ * Applies the data records of the committed transactions in a journal to
+ * the image, in the order they were logged. The journal ends at the first
+ * record that was not completely written.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_replay(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0) {
+        return 0;
+    }
 
-    while (array[counter] != -1) {
-        counter++;
+    char *log = malloc(size);
+    uint64_t *committed =
+        malloc(size / sizeof(journal_record_t) * sizeof(uint64_t));
+    if (log == NULL || committed == NULL) {
+        free(log);
+        free(committed);
+        return -1;
+    }
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = pread(fd, log + got, size - got, (off_t)got);
+        if (n <= 0) {
+            break;
+        }
+        got += (size_t)n;
     }
 
-    return counter;
-}
+    /* First the extent of the journal and the transactions it commits */
+    journal_record_t record;
+    size_t end = 0;
+    size_t count = 0;
+    while (end + sizeof(record) <= got) {
+        memcpy(&record, log + end, sizeof(record));
+        char const *contents = log + end + sizeof(record);
+        if (record.jr_length > got - end - sizeof(record) ||
+            journal_checksum(&record, contents) != record.jr_checksum) {
+            break;
+        }
+        if (record.jr_type == JOURNAL_COMMIT) {
+            committed[count++] = record.jr_txn;
+        }
+        end += sizeof(record) + record.jr_length;
+    }
+    qsort(committed, count, sizeof(uint64_t), txn_compare);
+
+    for (size_t pos = 0; pos < end;) {
+        memcpy(&record, log + pos, sizeof(record));
+        char const *contents = log + pos + sizeof(record);
+        pos += sizeof(record) + record.jr_length;
+
+        if (record.jr_type == JOURNAL_DATA &&
+            record.jr_offset >= offsetof(fs_image_t, inode_table) &&
+            record.jr_offset <= sizeof(fs_image_t) - record.jr_length &&
+            bsearch(&record.jr_txn, committed, count, sizeof(uint64_t),
+                    txn_compare) != NULL) {
+            memcpy((char *)image + record.jr_offset, contents,
+                   record.jr_length);
+        }
+    }
 
-void lock_write_inodetable() {
-    pthread_rwlock_wrlock(&lock_inodetable);
+    free(log);
+    free(committed);
+    return 0;
 }
 
-void lock_read_inodetable() {
-    pthread_rwlock_rdlock(&lock_inodetable);
-}
+/*
+ * Marks every i-node and block as free in the bitmaps of the image in use.
+ */
+static void bitmaps_clear() {
+    for (size_t i = 0; i < INODE_BITMAP_WORDS; i++) {
+        atomic_store(&freeinode_ts[i], 0);
+    }
+    if (INODE_TABLE_SIZE % 64 != 0) {
+        atomic_store(&freeinode_ts[INODE_BITMAP_WORDS - 1],
+                     ~UINT64_C(0) << (INODE_TABLE_SIZE % 64));
+    }
 
-void unlock_inodetable() {
-    pthread_rwlock_unlock(&lock_inodetable);
+    for (size_t i = 0; i < BLOCK_BITMAP_WORDS; i++) {
+        atomic_store(&free_blocks[i], 0);
+    }
+    /* Bits past the last block in the last word are permanently taken */
+    if (DATA_BLOCKS % BITMAP_WORD_BITS != 0) {
+        atomic_store(&free_blocks[BLOCK_BITMAP_WORDS - 1],
+                     ~UINT64_C(0) << (DATA_BLOCKS % BITMAP_WORD_BITS));
+    }
 }
 
-void lock_write_datablocks() {
-    pthread_rwlock_wrlock(&lock_datablocks);
-}
+/*
+ * Marks a run of blocks as taken while rebuilding the bitmaps and, if they
+ * hold the entries of a directory, the i-nodes these point to, which are
+ * added to the ones still to visit.
+ * Input:
+ *  - extent: the run, as mapped by an i-node
+ *  - inode: the i-node
+ *  - pending, count: i-nodes still to visit
+ */
+static void recover_run(extent_t const *extent, inode_t const *inode,
+                        int pending[], size_t *count) {
+    if (extent->e_start < 0 || extent->e_length < 0 ||
+        extent->e_start > DATA_BLOCKS - extent->e_length) {
+        return;
+    }
 
-void lock_read_datablocks() {
-    pthread_rwlock_rdlock(&lock_datablocks);
-}
+    size_t dir_blocks =
+        inode->i_node_type == T_DIRECTORY ? inode->i_size / BLOCK_SIZE : 0;
+    for (int i = 0; i < extent->e_length; i++) {
+        int b = extent->e_start + i;
+        atomic_fetch_or(&free_blocks[b / BITMAP_WORD_BITS],
+                        UINT64_C(1) << (b % BITMAP_WORD_BITS));
+        if ((size_t)(extent->e_block + i) >= dir_blocks) {
+            continue;
+        }
 
-void unlock_datablocks() {
-    pthread_rwlock_unlock(&lock_datablocks);
+        dir_entry_t const *entries =
+            (dir_entry_t const *)&fs_data[b * BLOCK_SIZE];
+        for (size_t e = 0; e < MAX_DIR_ENTRIES; e++) {
+            int child = entries[e].d_inumber;
+            if (!valid_inumber(child)) {
+                continue;
+            }
+            uint64_t bit = UINT64_C(1) << (child % 64);
+            if (!(atomic_fetch_or(&freeinode_ts[child / 64], bit) & bit)) {
+                pending[(*count)++] = child;
+            }
+        }
+    }
 }
 
-void lock_write_openfiletable() {
-    pthread_rwlock_wrlock(&lock_openfiletable);
+/*
+ * Marks the blocks of an indirect extent tree, and the ones it maps, as
+ * taken while rebuilding the bitmaps (see recover_run()).
+ */
+static void recover_tree(int block, int level, inode_t const *inode,
+                         int pending[], size_t *count) {
+    if (!valid_block_number(block)) {
+        return;
+    }
+    atomic_fetch_or(&free_blocks[block / BITMAP_WORD_BITS],
+                    UINT64_C(1) << (block % BITMAP_WORD_BITS));
+
+    if (level == 0) {
+        extent_t const *extents = (extent_t const *)&fs_data[block * BLOCK_SIZE];
+        for (size_t i = 0;
+             i < LEAF_EXTENTS && extents[i].e_block != UNUSED_BLOCK; i++) {
+            recover_run(&extents[i], inode, pending, count);
+        }
+    } else {
+        extent_index_t const *entries =
+            (extent_index_t const *)&fs_data[block * BLOCK_SIZE];
+        for (size_t i = 0; i < INDEX_ENTRIES && entries[i].ei_child != -1;
+             i++) {
+            recover_tree(entries[i].ei_child, level - 1, inode, pending,
+                         count);
+        }
+    }
 }
 
-void lock_read_openfiletable() {
-    pthread_rwlock_rdlock(&lock_openfiletable);
+/*
+ * Rebuilds the bitmaps from the i-nodes reachable from the root directory:
+ * those i-nodes and the blocks they map are taken, everything else is free
+ * (including what uncommitted transactions had allocated).
+ */
+static void recover_bitmaps() {
+    bitmaps_clear();
+
+    int pending[INODE_TABLE_SIZE];
+    size_t count = 0;
+    atomic_fetch_or(&freeinode_ts[ROOT_DIR_INUM / 64],
+                    UINT64_C(1) << (ROOT_DIR_INUM % 64));
+    pending[count++] = ROOT_DIR_INUM;
+
+    while (count > 0) {
+        inode_t *inode = &inode_table[pending[--count]];
+        /* Data still waiting in a dirty buffer never got its blocks */
+        if (inode->i_size > inode->i_blocks * BLOCK_SIZE) {
+            inode->i_size = inode->i_blocks * BLOCK_SIZE;
+        }
+        for (size_t k = 0; k < inode->i_extent_count && k < MAX_DIRECT_EXTENTS;
+             k++) {
+            recover_run(&inode->i_extents[k], inode, pending, &count);
+        }
+        for (int level = 0; level < INDIRECT_LEVELS; level++) {
+            if (inode->i_indirect[level].ei_child != -1) {
+                recover_tree(inode->i_indirect[level].ei_child, level, inode,
+                             pending, &count);
+            }
+        }
+    }
 }
 
-void unlock_openfiletable() {
-    pthread_rwlock_unlock(&lock_openfiletable);
+/*
+ * Opens the journal of the image mapped from a file, after recovering the
+ * image from it if the image was not unmapped cleanly, and marks the image
+ * as in use.
+ * Input:
+ *  - image_path: path name of the image file
+ *  - found: whether the image already held a FS
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int journal_open(char const *image_path, bool found) {
+    size_t len = strlen(image_path);
+    char *path = malloc(len + sizeof(JOURNAL_SUFFIX));
+    if (path == NULL) {
+        return -1;
+    }
+    memcpy(path, image_path, len);
+    memcpy(path + len, JOURNAL_SUFFIX, sizeof(JOURNAL_SUFFIX));
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+    free(path);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (found && !image->sb.clean) {
+        if (journal_replay(fd) == -1) {
+            close(fd);
+            return -1;
+        }
+        recover_bitmaps();
+    }
+    /* The journal only starts over once the image holds all it recorded,
+     * and the image is only marked in use after that */
+    if (image_write(image, sizeof(fs_image_t), true) == -1 ||
+        ftruncate(fd, 0) == -1) {
+        close(fd);
+        return -1;
+    }
+    image->sb.clean = 0;
+    if (image_write(&image->sb, sizeof(superblock_t), true) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    journal_fd = fd;
+    journal_appended = 0;
+    journal_flushed = 0;
+    journal_file_size = 0;
+    journal_failed = false;
+    journal_next_txn = 0;
+    return 0;
+}
+
+/*
+ * Writes the image back and closes its journal, which is left empty.
+ * Returns: 0 if successful, -1 if the journal could not be written (or was
+ *  not open)
+ */
+static int journal_close() {
+    if (journal_fd == -1) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock_journal);
+    int ret = journal_failed ? -1 : journal_checkpoint();
+    pthread_mutex_unlock(&lock_journal);
+
+    close(journal_fd);
+    journal_fd = -1;
+    for (size_t i = 0; i < 2; i++) {
+        free(journal_buffers[i].data);
+        journal_buffers[i] = (journal_buffer_t){NULL, 0, 0};
+    }
+    return ret;
+}
+
+/*
+ * Writes the image mapped from a file, if any, back to it and unmaps it,
+ * going back to the in-memory image. The image is marked clean only if
+ * everything its journal recorded made it to the image.
+ */
+static void image_detach() {
+    if (image_fd == -1) {
+        return;
+    }
+
+    /* Closing the journal wrote the image back */
+    if (journal_close() == 0) {
+        image->sb.clean = 1;
+        image_write(&image->sb, sizeof(superblock_t), true);
+    }
+    munmap(image, sizeof(fs_image_t));
+    close(image_fd);
+    image_fd = -1;
+    image_use(&memory_image);
+}
+
+/*
+ * Formats the image in use: every i-node and block is free.
+ */
+static void image_format() {
+    bitmaps_clear();
+
+    /* Written last, so that an image is not taken as formatted before its
+     * bitmaps are */
+    image->sb.image_size = sizeof(fs_image_t);
+    image->sb.block_size = BLOCK_SIZE;
+    image->sb.data_blocks = DATA_BLOCKS;
+    image->sb.inode_table_size = INODE_TABLE_SIZE;
+    image->sb.inode_size = sizeof(inode_t);
+    image->sb.magic = IMAGE_MAGIC;
+}
+
+/*
+ * Returns the blocks held by every thread's magazine to the bitmap they
+ * were taken from, so that they are not lost with the image in use.
+ */
+static void magazines_drain() {
+    pthread_mutex_lock(&lock_magazines);
+    for (block_magazine_t *mag = magazines; mag != NULL; mag = mag->next) {
+        pthread_mutex_lock(&mag->lock);
+        for (size_t i = 0; i < mag->count; i++) {
+            int block = mag->blocks[i];
+            atomic_fetch_and(&free_blocks[block / BITMAP_WORD_BITS],
+                             ~(UINT64_C(1) << (block % BITMAP_WORD_BITS)));
+        }
+        mag->count = 0;
+        pthread_mutex_unlock(&mag->lock);
+    }
+    pthread_mutex_unlock(&lock_magazines);
+}
+
+/*
+ * Gives blocks to the data waiting in the dirty buffers of every i-node
+ * (there are none before the state is first initialized).
+ */
+static void dirty_buffers_flush() {
+    if (inode_table == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        inode_t *inode = &inode_table[i];
+        if (inode->i_dirty != NULL) {
+            journal_begin();
+            pthread_rwlock_wrlock(&inode->rwlock);
+            inode_flush(inode);
+            pthread_rwlock_unlock(&inode->rwlock);
+            journal_commit();
+        }
+    }
+}
+
+/*
+ * Initializes FS state
+ * Input:
+ *  - image_path: path name of a file holding the FS image, which is
+ *    created (and formatted) if it does not exist; NULL to keep the FS in
+ *    memory only, starting empty
+ * Returns: 1 if an existing FS was found in the image file, 0 if the FS
+ *  starts empty, -1 if unsuccessful
+ */
+int state_init(char const *image_path) {
+    /* The data in the dirty buffers and the blocks cached by the magazines
+     * belong to the previous image */
+    dirty_buffers_flush();
+    magazines_drain();
+    image_detach();
+    image_use(&memory_image);
+
+    int found = 0;
+    if (image_path != NULL) {
+        found = image_attach(image_path);
+        if (found == -1) {
+            return -1;
+        }
+        if (journal_open(image_path, found) == -1) {
+            image_detach();
+            return -1;
+        }
+    }
+    if (found) {
+        /* Only the locks and sequence counters, which may have been left
+         * taken, need resetting; everything else is used as it was left
+         * (or as its journal recorded it, after a crash) */
+        for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+            atomic_store(&inode_table[i].i_seq, 0);
+            inode_table[i].i_dirty = NULL;
+            inode_table[i].i_dirty_capacity = 0;
+            inode_table[i].i_dirty_blocks = 0;
+            if (pthread_rwlock_init(&inode_table[i].rwlock, NULL) != 0) {
+                return -1;
+            }
+        }
+    } else {
+        image_format();
+        /* Written out at once, or a crash would leave it unformatted and
+         * its journal ignored */
+        if (image_fd != -1 && image_write(image, sizeof(fs_image_t), true) ==
+                                  -1) {
+            image_detach();
+            return -1;
+        }
+    }
+
+    /* Every block free in the bitmap (the magazines start empty) can be
+     * allocated */
+    long available = 0;
+    for (size_t i = 0; i < BLOCK_BITMAP_WORDS; i++) {
+        available +=
+            BITMAP_WORD_BITS - __builtin_popcountll(atomic_load(&free_blocks[i]));
+    }
+    atomic_store(&available_blocks, available);
+    atomic_store(&dirty_blocks, 0);
+
+    atomic_store(&freeinode_hint, 0);
+    atomic_fetch_add(&state_generation, 1);
+    for (size_t g = 0; g < BLOCK_GROUPS; g++) {
+        block_groups[g].hint = g * GROUP_WORDS;
+    }
+
+    /* Files left open belong to the previous state */
+    size_t open_files =
+        atomic_load(&open_file_segment_count) * OPEN_FILE_SEGMENT_SIZE;
+    for (size_t i = 0; i < open_files; i++) {
+        open_file_entry_t *entry = open_file_entry_at(i);
+        if (entry != NULL) {
+            open_file_close(i, atomic_load(&entry->of_generation));
+        }
+    }
+    atomic_store(&open_file_count, 0);
+
+    if (pthread_rwlock_init(&lock_inodetable, NULL) != 0) return -1;
+    for (size_t g = 0; g < BLOCK_GROUPS; g++) {
+        if (pthread_mutex_init(&block_groups[g].lock, NULL) != 0) return -1;
+    }
+    /* Prefetches requested for the previous state are of no use now */
+    pthread_mutex_lock(&lock_prefetch);
+    prefetch_count = 0;
+    pthread_mutex_unlock(&lock_prefetch);
+
+    for (size_t s = 0; s < BUFFER_CACHE_SHARDS; s++) {
+        cache_shard_t *shard = &cache_shards[s];
+        if (pthread_mutex_init(&shard->lock, NULL) != 0) return -1;
+        shard->hand = 0;
+        shard->hits = 0;
+        shard->misses = 0;
+        for (size_t b = 0; b < CACHE_SHARD_BUCKETS; b++) {
+            shard->buckets[b] = -1;
+        }
+        for (size_t f = 0; f < CACHE_SHARD_FRAMES; f++) {
+            shard->frames[f].key = -1;
+            shard->frames[f].next = -1;
+            shard->frames[f].referenced = false;
+        }
+    }
+    for (size_t i = 0; i < DCACHE_SHARDS; i++) {
+        if (pthread_rwlock_init(&dcache_shards[i].lock, NULL) != 0) return -1;
+    }
+
+    return found;
+}
+
+void state_destroy() {
+    dirty_buffers_flush();
+
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        free(dir_indexes[i].table);
+        dir_indexes[i].table = NULL;
+        dir_indexes[i].capacity = 0;
+        free(dir_indexes[i].free_slots);
+        dir_indexes[i].free_slots = NULL;
+        dir_indexes[i].free_count = 0;
+        dir_indexes[i].free_capacity = 0;
+        dir_indexes[i].generation = 0;
+    }
+
+    pthread_mutex_lock(&lock_prefetch);
+    bool running = prefetch_running;
+    prefetch_stop = true;
+    pthread_cond_signal(&prefetch_cond);
+    pthread_cond_broadcast(&prefetch_idle_cond);
+    pthread_mutex_unlock(&lock_prefetch);
+    if (running) {
+        pthread_join(prefetch_thread, NULL);
+    }
+    pthread_mutex_lock(&lock_prefetch);
+    prefetch_running = false;
+    prefetch_stop = false;
+    prefetch_count = 0;
+    pthread_mutex_unlock(&lock_prefetch);
+
+    size_t segments = atomic_load(&open_file_segment_count);
+    for (size_t s = 0; s < segments; s++) {
+        open_file_entry_t *segment = atomic_load(&open_file_segments[s]);
+        for (size_t i = 0; i < OPEN_FILE_SEGMENT_SIZE; i++) {
+            pthread_mutex_destroy(&segment[i].of_lock);
+        }
+        atomic_store(&open_file_segments[s], NULL);
+        free(segment);
+    }
+    atomic_store(&open_file_segment_count, 0);
+    for (size_t i = 0; i < OPEN_FILE_SHARDS; i++) {
+        atomic_store(&open_file_shards[i].head, 0);
+    }
+
+    magazines_drain();
+    image_detach();
+}
+
+/*
+ * Takes a free i-node number from the bitmap.
+ * Returns: the i-node number, -1 if the table is full
+ */
+static int inode_claim() {
+    insert_delay(); // simulate storage access delay (to freeinode_ts)
+
+    size_t start = atomic_load(&freeinode_hint);
+    for (size_t scanned = 0; scanned < INODE_BITMAP_WORDS; scanned++) {
+        size_t w = (start + scanned) % INODE_BITMAP_WORDS;
+        uint64_t word = atomic_load(&freeinode_ts[w]);
+        while (word != ~UINT64_C(0)) {
+            int bit = __builtin_ctzll(~word);
+            /* On failure, word is reloaded and we retry with its new value */
+            if (atomic_compare_exchange_weak(&freeinode_ts[w], &word,
+                                             word | (UINT64_C(1) << bit))) {
+                atomic_store(&freeinode_hint, w);
+                return (int)(w * 64) + bit;
+            }
+        }
+    }
+    return -1;
+}
+
+/*
+ * Gives an i-node number back to the bitmap.
+ */
+static void inode_release(int inumber) {
+    atomic_fetch_and(&freeinode_ts[inumber / 64],
+                     ~(UINT64_C(1) << (inumber % 64)));
+}
+
+static bool inode_taken(int inumber) {
+    return (atomic_load(&freeinode_ts[inumber / 64]) >> (inumber % 64)) & 1;
+}
+
+/*
+ * Logs the size, the extents and the other fields of an i-node kept in the
+ * image, as they are now, in the calling thread's transaction.
+ * Must be called with the i-node's rwlock held for writing (or before the
+ * i-node can be reached by other threads).
+ */
+void inode_journal(inode_t *inode) {
+    journal_log(inode, INODE_PERSISTENT_SIZE);
+}
+
+/*
+ * Creates a new i-node in the i-node table.
+ * Input:
+ *  - n_type: the type of the node (file or directory)
+ * Returns:
+ *  new i-node's number if successfully created, -1 otherwise
+ */
+int inode_create(inode_type n_type) {
+    int inumber = inode_claim();
+    if (inumber == -1) {
+        return -1;
+    }
+
+    storage_access(INODE_CACHE_KEY(inumber));
+    inode_table[inumber].i_node_type = n_type;
+    if (pthread_rwlock_init(&inode_table[inumber].rwlock, NULL) != 0) {
+        inode_release(inumber);
+        return -1;
+    }
+
+    inode_table[inumber].i_size = 0;
+    inode_table[inumber].i_blocks = 0;
+    inode_table[inumber].i_extent_count = 0;
+    for (size_t i = 0; i < INDIRECT_LEVELS; i++) {
+        inode_table[inumber].i_indirect[i].ei_block = UNUSED_BLOCK;
+        inode_table[inumber].i_indirect[i].ei_child = -1;
+    }
+
+    if (n_type == T_DIRECTORY) {
+        /* Initializes directory (filling its block with empty
+         * entries, labeled with inumber==-1) */
+        if (inode_alloc_blocks(&inode_table[inumber], 1) != 1) {
+            inode_release(inumber);
+            return -1;
+        }
+        inode_table[inumber].i_size = BLOCK_SIZE;
+
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(
+            inode_get_block(&inode_table[inumber], 0, NULL));
+        if (dir_entry == NULL) {
+            inode_free_blocks(&inode_table[inumber]);
+            inode_release(inumber);
+            return -1;
+        }
+
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+            dir_entry[i].d_inumber = -1;
+        }
+        journal_log(dir_entry, BLOCK_SIZE);
+    }
+    inode_journal(&inode_table[inumber]);
+    return inumber;
+}
+
+/*
+ * Deletes the i-node.
+ * Input:
+ *  - inumber: i-node's number
+ * Returns: 0 if successful, -1 if failed
+ */
+int inode_delete(int inumber) {
+    insert_delay(); // simulate storage access delay (to freeinode_ts)
+
+    if (!valid_inumber(inumber) || !inode_taken(inumber)) {
+        return -1;
+    }
+    storage_access(INODE_CACHE_KEY(inumber));
+
+    pthread_rwlock_wrlock(&inode_table[inumber].rwlock);
+    int ret = inode_free_blocks(&inode_table[inumber]);
+    pthread_rwlock_unlock(&inode_table[inumber].rwlock);
+    if (ret == -1) {
+        return -1;
+    }
+
+    /* Only now can the i-node be handed out again */
+    inode_release(inumber);
+    return 0;
+}
+
+/*
+ * Returns a pointer to an existing i-node.
+ * Input:
+ *  - inumber: identifier of the i-node
+ * Returns: pointer if successful, NULL if failed
+ */
+inode_t *inode_get(int inumber) {
+    if (!valid_inumber(inumber)) {
+        return NULL;
+    }
+
+    storage_access(INODE_CACHE_KEY(inumber));
+    return &inode_table[inumber];
+}
+
+/*
+ * Extents that do not fit in the i-node live in indirect extent trees. The
+ * tree at level 0 is a single leaf block of extents; at level n, the root
+ * is an index block whose entries point to trees of level n-1. Trees are
+ * filled in order and index entries record the first file block below
+ * them, so a file block is found by a binary search in each block on the
+ * way down: one block access per level.
+ */
+
+/*
+ * Returns the number of extents held by a tree of a given level.
+ */
+static size_t tree_capacity(int level) {
+    size_t capacity = LEAF_EXTENTS;
+    for (int i = 0; i < level; i++) {
+        capacity *= INDEX_ENTRIES;
+    }
+    return capacity;
+}
+
+/*
+ * Allocates a block for an indirect extent tree, with all entries unused.
+ * Returns: block index if successful, -1 otherwise
+ */
+static int tree_node_alloc(bool leaf) {
+    int b = data_block_alloc();
+    void *node = data_block_get(b);
+    if (node == NULL) {
+        return -1;
+    }
+
+    if (leaf) {
+        extent_t *extents = node;
+        for (size_t i = 0; i < LEAF_EXTENTS; i++) {
+            extents[i].e_block = UNUSED_BLOCK;
+            extents[i].e_length = 0;
+        }
+    } else {
+        extent_index_t *entries = node;
+        for (size_t i = 0; i < INDEX_ENTRIES; i++) {
+            entries[i].ei_block = UNUSED_BLOCK;
+            entries[i].ei_child = -1;
+        }
+    }
+    journal_log(node, BLOCK_SIZE);
+    return b;
+}
+
+/*
+ * Returns a pointer to the k-th extent of an indirect extent tree,
+ * optionally allocating the blocks on the way.
+ * Input:
+ *  - root: the tree's root entry (in the i-node)
+ *  - level: the tree's level
+ *  - k: extent number within the tree
+ *  - first_block: when allocating, the first file block of the extent
+ * Returns: pointer to the extent, NULL if failed (or not allocated)
+ */
+static extent_t *tree_extent(extent_index_t *root, int level, size_t k,
+                             int first_block, bool alloc) {
+    extent_index_t *entry = root;
+
+    for (int d = level; d >= 0; d--) {
+        if (entry->ei_child == -1) {
+            if (!alloc) {
+                return NULL;
+            }
+            entry->ei_child = tree_node_alloc(d == 0);
+            if (entry->ei_child == -1) {
+                return NULL;
+            }
+            entry->ei_block = first_block;
+            journal_log(entry, sizeof(*entry));
+        }
+
+        void *node = data_block_get(entry->ei_child);
+        if (node == NULL) {
+            return NULL;
+        }
+        if (d == 0) {
+            return &((extent_t *)node)[k];
+        }
+        size_t span = tree_capacity(d - 1);
+        entry = &((extent_index_t *)node)[k / span];
+        k %= span;
+    }
+    return NULL;
+}
+
+/*
+ * Returns a pointer to the k-th extent of an i-node.
+ * Input:
+ *  - inode: the i-node
+ *  - k: extent number
+ *  - alloc: whether to allocate the tree blocks it needs (used when
+ *    appending extent number i_extent_count)
+ * Returns: pointer to the extent, NULL if failed
+ */
+static extent_t *inode_extent(inode_t *inode, size_t k, bool alloc) {
+    if (k < MAX_DIRECT_EXTENTS) {
+        return &inode->i_extents[k];
+    }
+
+    k -= MAX_DIRECT_EXTENTS;
+    for (int level = 0; level < INDIRECT_LEVELS; level++) {
+        if (k < tree_capacity(level)) {
+            return tree_extent(&inode->i_indirect[level], level, k,
+                               (int)inode->i_blocks, alloc);
+        }
+        k -= tree_capacity(level);
+    }
+    return NULL;
+}
+
+/*
+ * Maps the next length file blocks of an i-node to the data blocks
+ * starting at start, extending the last extent when they follow it.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int inode_extent_append(inode_t *inode, int start, size_t length) {
+    size_t count = inode->i_extent_count;
+
+    if (count > 0) {
+        extent_t *last = inode_extent(inode, count - 1, false);
+        if (last == NULL) {
+            return -1;
+        }
+        if (last->e_start + last->e_length == start) {
+            last->e_length += (int)length;
+            journal_log(last, sizeof(*last));
+            inode->i_blocks += length;
+            return 0;
+        }
+    }
+
+    extent_t *extent = inode_extent(inode, count, true);
+    if (extent == NULL) {
+        return -1;
+    }
+    extent->e_block = (int)inode->i_blocks;
+    extent->e_start = start;
+    extent->e_length = (int)length;
+    journal_log(extent, sizeof(*extent));
+    inode->i_extent_count++;
+    inode->i_blocks += length;
+    return 0;
+}
+
+/*
+ * Maps more blocks at the end of an i-node.
+ * Blocks are allocated in as few contiguous runs as possible: small
+ * requests come from the thread's magazine (which hands out consecutive
+ * blocks after each refill), larger ones straight from the bitmap.
+ * Must be called with the i-node's rwlock held for writing.
+ * Input:
+ *  - inode: the i-node
+ *  - count: number of blocks to add
+ * Returns: the number of blocks added, lower than count if the FS or the
+ *  i-node's extents are full
+ */
+size_t inode_alloc_blocks(inode_t *inode, size_t count) {
+    int blocks[BLOCK_MAGAZINE_SIZE];
+    size_t added = 0;
+
+    while (added < count) {
+        size_t want = count - added;
+
+        if (want <= BLOCK_MAGAZINE_SIZE && data_block_alloc_n(want, blocks) == 0) {
+            size_t i = 0;
+            while (i < want) {
+                /* Coalesce consecutive block numbers into one run */
+                size_t length = 1;
+                while (i + length < want &&
+                       blocks[i + length] == blocks[i] + (int)length) {
+                    length++;
+                }
+                if (inode_extent_append(inode, blocks[i], length) == -1) {
+                    for (size_t j = i; j < want; j++) {
+                        data_block_free(blocks[j]);
+                    }
+                    return added;
+                }
+                i += length;
+                added += length;
+            }
+            continue;
+        }
+
+        size_t got;
+        int start = data_block_alloc_run(want, &got);
+        if (start == -1) {
+            break;
+        }
+        if (inode_extent_append(inode, start, got) == -1) {
+            data_block_free_run(start, got);
+            break;
+        }
+        added += got;
+    }
+    return added;
+}
+
+/*
+ * Returns the position of the last extent starting at or before a file
+ * block, among n extents sorted by their first block.
+ */
+static size_t extent_search(extent_t const *extents, size_t n,
+                            size_t file_block) {
+    size_t lo = 0, hi = n;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((size_t)extents[mid].e_block <= file_block) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Same as extent_search(), for the entries of an index block.
+ */
+static size_t index_search(extent_index_t const *entries, size_t n,
+                           size_t file_block) {
+    size_t lo = 0, hi = n;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((size_t)entries[mid].ei_block <= file_block) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * Translates a file block into the data block that holds it.
+ * Costs one block access per level of the extent tree holding it.
+ * Input:
+ *  - inode: the i-node
+ *  - file_block: block number within the file
+ *  - run: if not NULL, set to the number of blocks, starting at the
+ *    returned one, that hold consecutive file blocks
+ * Returns: data block index if mapped, -1 otherwise
+ */
+int inode_get_block(inode_t *inode, size_t file_block, size_t *run) {
+    if (file_block >= inode->i_blocks) {
+        return -1;
+    }
+
+    /* Find the last tree starting at or before file_block, if any */
+    int level = -1;
+    for (int l = 0; l < INDIRECT_LEVELS; l++) {
+        if (inode->i_indirect[l].ei_child != -1 &&
+            (size_t)inode->i_indirect[l].ei_block <= file_block) {
+            level = l;
+        }
+    }
+
+    extent_t const *extent;
+    if (level == -1) {
+        size_t n = inode->i_extent_count < MAX_DIRECT_EXTENTS
+                       ? inode->i_extent_count
+                       : MAX_DIRECT_EXTENTS;
+        extent = &inode->i_extents[extent_search(inode->i_extents, n,
+                                                 file_block)];
+    } else {
+        int block = inode->i_indirect[level].ei_child;
+        for (int d = level; d > 0; d--) {
+            extent_index_t const *entries = data_block_get(block);
+            if (entries == NULL) {
+                return -1;
+            }
+            block = entries[index_search(entries, INDEX_ENTRIES, file_block)]
+                        .ei_child;
+        }
+        extent_t const *extents = data_block_get(block);
+        if (extents == NULL) {
+            return -1;
+        }
+        extent = &extents[extent_search(extents, LEAF_EXTENTS, file_block)];
+    }
+
+    size_t delta = file_block - (size_t)extent->e_block;
+    if (run != NULL) {
+        *run = (size_t)extent->e_length - delta;
+    }
+    return extent->e_start + (int)delta;
+}
+
+/*
+ * Returns the number of blocks reserved for a dirty buffer needing a given
+ * number of data blocks: those, plus the extent tree blocks that mapping
+ * them could take at worst (one extent per block).
+ */
+static size_t dirty_reservation(size_t blocks) {
+    return blocks == 0 ? 0 : blocks + blocks / LEAF_EXTENTS + 2 * INDIRECT_LEVELS;
+}
+
+/*
+ * Discards the dirty buffer of an i-node, giving its reservation back.
+ */
+static void inode_buffer_drop(inode_t *inode) {
+    blocks_give(dirty_reservation(inode->i_dirty_blocks));
+    atomic_fetch_sub(&dirty_blocks, inode->i_dirty_blocks);
+    free(inode->i_dirty);
+    inode->i_dirty = NULL;
+    inode->i_dirty_capacity = 0;
+    inode->i_dirty_blocks = 0;
+}
+
+/*
+ * Makes room in the dirty buffer of an i-node for data past its mapped
+ * blocks, reserving the blocks the data will need once flushed.
+ * Must be called with the i-node's rwlock held for writing.
+ * Input:
+ *  - inode: the i-node
+ *  - length: number of bytes from the end of the mapped blocks on
+ * Returns: 0 if successful, -1 if the buffer would grow past the limits in
+ *  config.h, or no memory or blocks are left for it
+ */
+int inode_buffer(inode_t *inode, size_t length) {
+    size_t blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blocks <= inode->i_dirty_blocks) {
+        return 0;
+    }
+    if (blocks > DELALLOC_FILE_BLOCKS) {
+        return -1;
+    }
+
+    size_t more = blocks - inode->i_dirty_blocks;
+    if (atomic_fetch_add(&dirty_blocks, more) + more > DELALLOC_TOTAL_BLOCKS) {
+        atomic_fetch_sub(&dirty_blocks, more);
+        return -1;
+    }
+    size_t reserve =
+        dirty_reservation(blocks) - dirty_reservation(inode->i_dirty_blocks);
+    if (blocks_claim(reserve, false) != reserve) {
+        atomic_fetch_sub(&dirty_blocks, more);
+        return -1;
+    }
+
+    /* Grown by doubling, so that small appends seldom reallocate it */
+    if (blocks * BLOCK_SIZE > inode->i_dirty_capacity) {
+        size_t capacity = inode->i_dirty_capacity == 0
+                              ? BLOCK_SIZE
+                              : 2 * inode->i_dirty_capacity;
+        while (capacity < blocks * BLOCK_SIZE) {
+            capacity *= 2;
+        }
+        char *dirty = realloc(inode->i_dirty, capacity);
+        if (dirty == NULL) {
+            blocks_give(reserve);
+            atomic_fetch_sub(&dirty_blocks, more);
+            return -1;
+        }
+        /* Holes left by writes past the end of the file read as zeros */
+        memset(dirty + inode->i_dirty_capacity, 0,
+               capacity - inode->i_dirty_capacity);
+        inode->i_dirty = dirty;
+        inode->i_dirty_capacity = capacity;
+    }
+    inode->i_dirty_blocks = blocks;
+    return 0;
+}
+
+/*
+ * Flushes the dirty buffer of an i-node: its data gets blocks, allocated
+ * in as few contiguous runs as possible, all at once, and is copied to
+ * them. Data that cannot get blocks (which only happens if the extent
+ * trees run out of room) is dropped, and the i-node cut short.
+ * Must be called with the i-node's rwlock held for writing.
+ * Returns: 0 if successful, -1 otherwise
+ */
+int inode_flush(inode_t *inode) {
+    if (inode->i_dirty == NULL) {
+        return 0;
+    }
+
+    size_t mapped = inode->i_blocks * BLOCK_SIZE;
+    size_t length = inode->i_size > mapped ? inode->i_size - mapped : 0;
+    size_t count = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    inode_meta_begin(inode);
+    reserved_credit = dirty_reservation(inode->i_dirty_blocks);
+    size_t added = inode_alloc_blocks(inode, count);
+
+    for (size_t done = 0; done < added;) {
+        size_t run;
+        int block = inode_get_block(inode, mapped / BLOCK_SIZE + done, &run);
+        if (run > added - done) run = added - done;
+        char *data = data_blocks_get(block, run);
+        if (data == NULL) {
+            added = done;
+            break;
+        }
+        size_t bytes = length - done * BLOCK_SIZE;
+        if (bytes > run * BLOCK_SIZE) bytes = run * BLOCK_SIZE;
+        memcpy(data, inode->i_dirty + done * BLOCK_SIZE, bytes);
+        if (data_blocks_written(data, bytes) == -1) {
+            added = done;
+            break;
+        }
+        done += run;
+    }
+    if (added < count) {
+        inode->i_size = mapped + added * BLOCK_SIZE;
+    }
+    inode_journal(inode);
+    inode_meta_end(inode);
+
+    /* What was reserved and not used (tree blocks, mostly) is available
+     * again, and so is the dirty buffer's share of the reservation */
+    blocks_give(reserved_credit);
+    reserved_credit = 0;
+    atomic_fetch_sub(&dirty_blocks, inode->i_dirty_blocks);
+    free(inode->i_dirty);
+    inode->i_dirty = NULL;
+    inode->i_dirty_capacity = 0;
+    inode->i_dirty_blocks = 0;
+    return added < count ? -1 : 0;
+}
+
+/*
+ * Writes data just stored in data blocks through to the image file the FS
+ * is kept in, if any (see the journal above).
+ * Input:
+ *  - data: the data; if it is not within the data blocks (it is in a
+ *    dirty buffer, say), nothing is written
+ *  - length: its length
+ * Returns: 0 if successful, -1 otherwise
+ */
+int data_blocks_written(void const *data, size_t length) {
+    uintptr_t start = (uintptr_t)data;
+    uintptr_t blocks = (uintptr_t)fs_data;
+    if (image_fd == -1 || start < blocks ||
+        start >= blocks + (uintptr_t)DATA_BLOCKS * BLOCK_SIZE) {
+        return 0;
+    }
+    return image_write(data, length, false);
+}
+
+/*
+ * Waits for the data blocks of an i-node, already written through to the
+ * image file the FS is kept in (if any), to reach the disk (its metadata
+ * goes through the journal).
+ * Must be called with the i-node's rwlock held.
+ * Returns: 0 if successful, -1 otherwise
+ */
+int inode_sync(inode_t *inode) {
+    (void)inode;
+    if (image_fd == -1) {
+        return 0;
+    }
+
+    int synced;
+    do {
+        synced = fdatasync(image_fd);
+    } while (synced == -1 && errno == EINTR);
+    return synced;
+}
+
+/*
+ * Frees an indirect extent tree: the blocks its extents map and its own.
+ */
+static void tree_free(int block, int level) {
+    if (level == 0) {
+        extent_t const *extents = data_block_get(block);
+        for (size_t i = 0; extents != NULL && i < LEAF_EXTENTS &&
+                           extents[i].e_block != UNUSED_BLOCK;
+             i++) {
+            data_block_release(extents[i].e_start,
+                               (size_t)extents[i].e_length);
+        }
+    } else {
+        extent_index_t const *entries = data_block_get(block);
+        for (size_t i = 0; entries != NULL && i < INDEX_ENTRIES &&
+                           entries[i].ei_child != -1;
+             i++) {
+            tree_free(entries[i].ei_child, level - 1);
+        }
+    }
+    data_block_release(block, 1);
+}
+
+/*
+ * Frees all the blocks of an i-node, leaving it empty.
+ * Must be called with the i-node's rwlock held for writing.
+ * Returns: 0 if successful, -1 otherwise
+ */
+int inode_free_blocks(inode_t *inode) {
+    inode_buffer_drop(inode);
+    inode_meta_begin(inode);
+    for (size_t k = 0; k < inode->i_extent_count && k < MAX_DIRECT_EXTENTS;
+         k++) {
+        data_block_release(inode->i_extents[k].e_start,
+                           (size_t)inode->i_extents[k].e_length);
+    }
+    for (int level = 0; level < INDIRECT_LEVELS; level++) {
+        if (inode->i_indirect[level].ei_child != -1) {
+            tree_free(inode->i_indirect[level].ei_child, level);
+        }
+        inode->i_indirect[level].ei_block = UNUSED_BLOCK;
+        inode->i_indirect[level].ei_child = -1;
+    }
+
+    inode->i_size = 0;
+    inode->i_blocks = 0;
+    inode->i_extent_count = 0;
+    inode_journal(inode);
+    inode_meta_end(inode);
+    return 0;
+}
+
+/*
+ * Frees the blocks of an extent past the first keep file blocks, shrinking
+ * or emptying it.
+ * Returns: true if the extent still maps blocks
+ */
+static bool extent_trim(extent_t *extent, size_t keep) {
+    size_t first = (size_t)extent->e_block;
+    size_t length = (size_t)extent->e_length;
+    if (first + length <= keep) {
+        return true;
+    }
+
+    if (first >= keep) {
+        data_block_release(extent->e_start, length);
+        extent->e_block = UNUSED_BLOCK;
+        extent->e_length = 0;
+    } else {
+        data_block_release(extent->e_start + (int)(keep - first),
+                           first + length - keep);
+        extent->e_length = (int)(keep - first);
+    }
+    journal_log(extent, sizeof(*extent));
+    return extent->e_block != UNUSED_BLOCK;
+}
+
+/*
+ * Frees the blocks an indirect extent tree maps past the first keep file
+ * blocks, along with the tree blocks left empty.
+ * Input:
+ *  - entry: the entry pointing to the tree (left unused if it empties)
+ *  - level: the tree's level
+ *  - keep: number of file blocks to keep
+ * Returns: number of extents left in the tree
+ */
+static size_t tree_trim(extent_index_t *entry, int level, size_t keep) {
+    size_t left = 0;
+    if (level == 0) {
+        extent_t *extents = data_block_get(entry->ei_child);
+        size_t n = 0;
+        while (extents != NULL && n < LEAF_EXTENTS &&
+               extents[n].e_block != UNUSED_BLOCK) {
+            n++;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (extent_trim(&extents[i], keep)) {
+                left++;
+            }
+        }
+    } else {
+        extent_index_t *entries = data_block_get(entry->ei_child);
+        size_t n = 0;
+        while (entries != NULL && n < INDEX_ENTRIES &&
+               entries[n].ei_child != -1) {
+            n++;
+        }
+        for (size_t i = 0; i < n; i++) {
+            /* Extents are appended in order, so every subtree but the last
+             * is full; those ending before keep are left alone */
+            if (i + 1 < n && (size_t)entries[i + 1].ei_block <= keep) {
+                left += tree_capacity(level - 1);
+            } else {
+                left += tree_trim(&entries[i], level - 1, keep);
+            }
+        }
+    }
+
+    if (left == 0) {
+        data_block_release(entry->ei_child, 1);
+        entry->ei_block = UNUSED_BLOCK;
+        entry->ei_child = -1;
+        journal_log(entry, sizeof(*entry));
+    }
+    return left;
+}
+
+/*
+ * Frees the blocks an i-node maps past its first keep file blocks, leaving
+ * its size alone.
+ * Must be called with the i-node's rwlock held for writing, within a
+ * metadata change (see inode_meta_begin()).
+ */
+void inode_trim_blocks(inode_t *inode, size_t keep) {
+    if (keep >= inode->i_blocks) {
+        return;
+    }
+
+    size_t left = 0;
+    for (size_t k = 0; k < inode->i_extent_count && k < MAX_DIRECT_EXTENTS;
+         k++) {
+        if (extent_trim(&inode->i_extents[k], keep)) {
+            left++;
+        }
+    }
+    for (int level = 0; level < INDIRECT_LEVELS; level++) {
+        if (inode->i_indirect[level].ei_child != -1) {
+            left += tree_trim(&inode->i_indirect[level], level, keep);
+        }
+    }
+    inode->i_extent_count = left;
+    inode->i_blocks = keep;
+}
+
+/*
+ * Cuts an i-node down to a given size, freeing the blocks (and the
+ * buffered data) past it, preallocated ones included.
+ * Must be called with the i-node's rwlock held for writing.
+ * Input:
+ *  - inode: the i-node
+ *  - length: new size, no larger than the current one
+ * Returns: 0 if successful, -1 otherwise
+ */
+int inode_truncate(inode_t *inode, size_t length) {
+    if (length > inode->i_size) {
+        return -1;
+    }
+    if (length <= inode->i_blocks * BLOCK_SIZE) {
+        inode_buffer_drop(inode);
+    }
+
+    inode_meta_begin(inode);
+    inode_trim_blocks(inode, (length + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    inode->i_size = length;
+    inode_journal(inode);
+    inode_meta_end(inode);
+    return 0;
+}
+
+/*
+ * Starts a change to the size or the extents of an i-node, which readers
+ * going through inode_stat() must not see half done.
+ * Must be called with the i-node's rwlock held for writing, and followed by
+ * inode_meta_end() once the change is complete.
+ */
+void inode_meta_begin(inode_t *inode) {
+    atomic_store_explicit(&inode->i_seq,
+                          atomic_load_explicit(&inode->i_seq,
+                                               memory_order_relaxed) + 1,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+/*
+ * Ends a change started by inode_meta_begin().
+ */
+void inode_meta_end(inode_t *inode) {
+    atomic_store_explicit(&inode->i_seq,
+                          atomic_load_explicit(&inode->i_seq,
+                                               memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+/*
+ * Reads the size and the number of mapped blocks of an i-node as a
+ * consistent pair, without writing to it: the values are read
+ * optimistically and read again if a change was under way or happened
+ * meanwhile. If writers keep getting in the way, the rwlock is taken in
+ * shared mode instead.
+ * Input:
+ *  - inode: the i-node
+ *  - size, blocks: set to the i-node's size and blocks (either may be NULL)
+ */
+void inode_stat(inode_t *inode, size_t *size, size_t *blocks) {
+    size_t s = 0, b = 0;
+    bool consistent = false;
+    for (int attempt = 0; attempt < INODE_STAT_RETRIES && !consistent;
+         attempt++) {
+        unsigned seq = atomic_load_explicit(&inode->i_seq, memory_order_acquire);
+        if (seq % 2 != 0) {
+            continue;
+        }
+        s = atomic_load_explicit(&inode->i_size, memory_order_relaxed);
+        b = atomic_load_explicit(&inode->i_blocks, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        consistent =
+            atomic_load_explicit(&inode->i_seq, memory_order_relaxed) == seq;
+    }
+
+    if (!consistent) {
+        pthread_rwlock_rdlock(&inode->rwlock);
+        s = inode->i_size;
+        b = inode->i_blocks;
+        pthread_rwlock_unlock(&inode->rwlock);
+    }
+
+    if (size != NULL) *size = s;
+    if (blocks != NULL) *blocks = b;
+}
+
+/*
+ * FNV-1a hash of a directory entry name
+ */
+static uint32_t name_hash(char const *name) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < MAX_FILE_NAME && name[i] != '\0'; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * Returns the dentry cache position for a (parent, name) pair
+ */
+static size_t dcache_position(int parent, char const *name) {
+    return (name_hash(name) ^ ((uint32_t)parent * 2654435761u)) % DCACHE_SIZE;
+}
+
+static pthread_rwlock_t *dcache_lock(size_t pos) {
+    return &dcache_shards[pos % DCACHE_SHARDS].lock;
+}
+
+/*
+ * Looks up a (parent, name) pair in the dentry cache.
+ * Returns: the cached i-number, -1 on a miss
+ */
+static int dcache_lookup(int parent, char const *name) {
+    size_t pos = dcache_position(parent, name);
+    int child = -1;
+
+    pthread_rwlock_rdlock(dcache_lock(pos));
+    dcache_entry_t *entry = &dcache[pos];
+    if (entry->generation == atomic_load(&state_generation) &&
+        entry->parent == parent &&
+        strncmp(entry->name, name, MAX_FILE_NAME) == 0) {
+        child = entry->child;
+    }
+    pthread_rwlock_unlock(dcache_lock(pos));
+    return child;
+}
+
+/*
+ * Caches a (parent, name) -> child translation, replacing whatever was in
+ * its position. Must be called with the parent's rwlock held.
+ */
+static void dcache_insert(int parent, char const *name, int child) {
+    size_t pos = dcache_position(parent, name);
+
+    pthread_rwlock_wrlock(dcache_lock(pos));
+    dcache_entry_t *entry = &dcache[pos];
+    entry->generation = atomic_load(&state_generation);
+    entry->parent = parent;
+    entry->child = child;
+    strncpy(entry->name, name, MAX_FILE_NAME - 1);
+    entry->name[MAX_FILE_NAME - 1] = '\0';
+    pthread_rwlock_unlock(dcache_lock(pos));
+}
+
+/*
+ * Drops the translation for a (parent, name) pair, if cached.
+ * Must be called with the parent's rwlock held for writing.
+ */
+static void dcache_remove(int parent, char const *name) {
+    size_t pos = dcache_position(parent, name);
+
+    pthread_rwlock_wrlock(dcache_lock(pos));
+    dcache_entry_t *entry = &dcache[pos];
+    if (entry->parent == parent &&
+        strncmp(entry->name, name, MAX_FILE_NAME) == 0) {
+        entry->generation = 0;
+    }
+    pthread_rwlock_unlock(dcache_lock(pos));
+}
+
+/*
+ * Inserts a (hash, slot) pair in the index, doubling it when it gets more
+ * than 3/4 full. Tombstones are dropped when the table is resized.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int dir_index_insert(dir_index_t *index, uint32_t hash, int slot) {
+    if ((index->used + 1) * 4 > index->capacity * 3) {
+        size_t capacity = index->capacity == 0 ? 32 : index->capacity * 2;
+        dir_index_entry_t *table = malloc(sizeof(dir_index_entry_t) * capacity);
+        if (table == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < capacity; i++) {
+            table[i].slot = DIR_INDEX_EMPTY;
+        }
+
+        size_t used = 0;
+        for (size_t i = 0; i < index->capacity; i++) {
+            if (index->table[i].slot < 0) {
+                continue;
+            }
+            size_t pos = index->table[i].hash & (capacity - 1);
+            while (table[pos].slot != DIR_INDEX_EMPTY) {
+                pos = (pos + 1) & (capacity - 1);
+            }
+            table[pos] = index->table[i];
+            used++;
+        }
+
+        free(index->table);
+        index->table = table;
+        index->capacity = capacity;
+        index->used = used;
+    }
+
+    size_t pos = hash & (index->capacity - 1);
+    while (index->table[pos].slot >= 0) {
+        pos = (pos + 1) & (index->capacity - 1);
+    }
+    if (index->table[pos].slot == DIR_INDEX_EMPTY) {
+        index->used++;
+    }
+    index->table[pos].hash = hash;
+    index->table[pos].slot = slot;
+    return 0;
+}
+
+/*
+ * Returns a pointer to the entry in a given slot of a directory (slots are
+ * numbered across all of the directory's blocks).
+ * Returns: pointer if successful, NULL otherwise
+ */
+static dir_entry_t *dir_entry_get(int inumber, int slot) {
+    int block_number = inode_get_block(&inode_table[inumber],
+                                       (size_t)slot / MAX_DIR_ENTRIES, NULL);
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(block_number);
+    if (dir_entry == NULL) {
+        return NULL;
+    }
+    return &dir_entry[(size_t)slot % MAX_DIR_ENTRIES];
+}
+
+/*
+ * Pushes a slot on the directory's free slot stack.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int dir_free_slot_push(dir_index_t *index, int slot) {
+    if (index->free_count == index->free_capacity) {
+        size_t capacity =
+            index->free_capacity == 0 ? MAX_DIR_ENTRIES : index->free_capacity * 2;
+        int *free_slots = realloc(index->free_slots, sizeof(int) * capacity);
+        if (free_slots == NULL) {
+            return -1;
+        }
+        index->free_slots = free_slots;
+        index->free_capacity = capacity;
+    }
+    index->free_slots[index->free_count++] = slot;
+    return 0;
+}
+
+/*
+ * Adds a new block, with all of its entries empty, to a directory and makes
+ * its slots available.
+ * Must be called with the directory's rwlock held for writing.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int dir_grow(int inumber) {
+    inode_t *inode = &inode_table[inumber];
+    size_t n = inode->i_size / BLOCK_SIZE;
+
+    inode_meta_begin(inode);
+    size_t added = inode_alloc_blocks(inode, 1);
+    inode_meta_end(inode);
+    if (added != 1) {
+        return -1;
+    }
+    dir_entry_t *dir_entry =
+        (dir_entry_t *)data_block_get(inode_get_block(inode, n, NULL));
+    if (dir_entry == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        dir_entry[i].d_inumber = -1;
+    }
+    journal_log(dir_entry, BLOCK_SIZE);
+    inode_meta_begin(inode);
+    inode->i_size += BLOCK_SIZE;
+    inode_journal(inode);
+    inode_meta_end(inode);
+
+    /* Pushed in reverse, so that the block is filled from its start */
+    dir_index_t *index = &dir_indexes[inumber];
+    for (size_t i = MAX_DIR_ENTRIES; i > 0; i--) {
+        if (dir_free_slot_push(index,
+                               (int)(n * MAX_DIR_ENTRIES + i - 1)) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Finds the index position of the entry with the given name.
+ * Input:
+ *  - inumber: the directory's i-node number
+ *  - sub_name: name to search
+ * Returns: position in the directory's index table, -1 if not found
+ */
+static ssize_t dir_index_find(int inumber, char const *sub_name) {
+    dir_index_t const *index = &dir_indexes[inumber];
+    if (index->capacity == 0) {
+        return -1;
+    }
+
+    uint32_t hash = name_hash(sub_name);
+    size_t pos = hash & (index->capacity - 1);
+    while (index->table[pos].slot != DIR_INDEX_EMPTY) {
+        int slot = index->table[pos].slot;
+        if (slot >= 0 && index->table[pos].hash == hash) {
+            dir_entry_t *dir_entry = dir_entry_get(inumber, slot);
+            if (dir_entry != NULL &&
+                strncmp(dir_entry->d_name, sub_name, MAX_FILE_NAME) == 0) {
+                return (ssize_t)pos;
+            }
+        }
+        pos = (pos + 1) & (index->capacity - 1);
+    }
+    return -1;
+}
+
+/*
+ * Rebuilds a directory's index and free slot stack from its entries.
+ * Must be called with the directory's rwlock held for writing.
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int dir_index_rebuild(int inumber) {
+    dir_index_t *index = &dir_indexes[inumber];
+    inode_t *inode = &inode_table[inumber];
+
+    for (size_t i = 0; i < index->capacity; i++) {
+        index->table[i].slot = DIR_INDEX_EMPTY;
+    }
+    index->used = 0;
+    index->free_count = 0;
+
+    size_t blocks = inode->i_size / BLOCK_SIZE;
+    for (size_t n = blocks; n > 0; n--) {
+        dir_entry_t *dir_entry =
+            (dir_entry_t *)data_block_get(inode_get_block(inode, n - 1, NULL));
+        if (dir_entry == NULL) {
+            return -1;
+        }
+        for (size_t i = MAX_DIR_ENTRIES; i > 0; i--) {
+            int slot = (int)((n - 1) * MAX_DIR_ENTRIES + i - 1);
+            int ret;
+            if (dir_entry[i - 1].d_inumber == -1) {
+                ret = dir_free_slot_push(index, slot);
+            } else {
+                ret = dir_index_insert(
+                    index, name_hash(dir_entry[i - 1].d_name), slot);
+            }
+            if (ret == -1) {
+                return -1;
+            }
+        }
+    }
+    index->generation = atomic_load(&state_generation);
+    return 0;
+}
+
+/*
+ * Locks a directory, making sure its index is up to date first.
+ * Input:
+ *  - inumber: identifier of the directory's i-node
+ *  - write: whether to take the directory's rwlock for writing
+ * Returns: 0 if successful (lock held), -1 otherwise (lock not held)
+ */
+static int dir_lock(int inumber, bool write) {
+    pthread_rwlock_t *rwlock = &inode_table[inumber].rwlock;
+    unsigned generation = atomic_load(&state_generation);
+
+    if (!write) {
+        pthread_rwlock_rdlock(rwlock);
+        if (dir_indexes[inumber].generation == generation) {
+            return 0;
+        }
+        /* The index has to be built, which needs the write lock */
+        pthread_rwlock_unlock(rwlock);
+    }
+
+    pthread_rwlock_wrlock(rwlock);
+    if (dir_indexes[inumber].generation != generation &&
+        dir_index_rebuild(inumber) == -1) {
+        pthread_rwlock_unlock(rwlock);
+        return -1;
+    }
+    if (!write) {
+        /* Index is fresh; readers do not need exclusive access */
+        pthread_rwlock_unlock(rwlock);
+        return dir_lock(inumber, false);
+    }
+    return 0;
+}
+
+/*
+ * Adds an entry to the i-node directory data.
+ * The directory grows by one block when all of its entries are in use.
+ * Input:
+ *  - inumber: identifier of the i-node
+ *  - sub_inumber: identifier of the sub i-node entry
+ *  - sub_name: name of the sub i-node entry
+ * Returns: SUCCESS or FAIL (also if the name already exists)
+ */
+int add_dir_entry(int inumber, int sub_inumber, char const *sub_name) {
+    if (!valid_inumber(inumber) || !valid_inumber(sub_inumber)) {
+        return -1;
+    }
+
+    storage_access(INODE_CACHE_KEY(inumber));
+    if (inode_table[inumber].i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    size_t name_len = strlen(sub_name);
+    if (name_len == 0 || name_len >= MAX_FILE_NAME) {
+        return -1;
+    }
+
+    if (dir_lock(inumber, true) == -1) {
+        return -1;
+    }
+    dir_index_t *index = &dir_indexes[inumber];
+    if (dir_index_find(inumber, sub_name) != -1 ||
+        (index->free_count == 0 && dir_grow(inumber) == -1)) {
+        pthread_rwlock_unlock(&inode_table[inumber].rwlock);
+        return -1;
+    }
+
+    /* Fills the most recently freed (or lowest new) empty entry */
+    int slot = index->free_slots[index->free_count - 1];
+    dir_entry_t *dir_entry = dir_entry_get(inumber, slot);
+    if (dir_entry == NULL ||
+        dir_index_insert(index, name_hash(sub_name), slot) == -1) {
+        pthread_rwlock_unlock(&inode_table[inumber].rwlock);
+        return -1;
+    }
+    index->free_count--;
+    dir_entry->d_inumber = sub_inumber;
+    strcpy(dir_entry->d_name, sub_name);
+    journal_log(dir_entry, sizeof(*dir_entry));
+    pthread_rwlock_unlock(&inode_table[inumber].rwlock);
+    return 0;
+}
+
+/*
+ * Removes the entry pointing to a given i-node from a directory.
+ * Input:
+ *  - inumber: identifier of the directory's i-node
+ *  - sub_inumber: identifier of the i-node to unlink
+ * Returns: 0 if successful, -1 otherwise
+ */
+int clear_dir_entry(int inumber, int sub_inumber) {
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+    storage_access(INODE_CACHE_KEY(inumber));
+    if (inode_table[inumber].i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    if (dir_lock(inumber, true) == -1) {
+        return -1;
+    }
+    dir_index_t *index = &dir_indexes[inumber];
+    for (size_t pos = 0; pos < index->capacity; pos++) {
+        int slot = index->table[pos].slot;
+        if (slot < 0) {
+            continue;
+        }
+        dir_entry_t *dir_entry = dir_entry_get(inumber, slot);
+        if (dir_entry != NULL && dir_entry->d_inumber == sub_inumber) {
+            if (dir_free_slot_push(index, slot) == -1) {
+                break;
+            }
+            index->table[pos].slot = DIR_INDEX_DELETED;
+            dcache_remove(inumber, dir_entry->d_name);
+            dir_entry->d_inumber = -1;
+            journal_log(dir_entry, sizeof(*dir_entry));
+            pthread_rwlock_unlock(&inode_table[inumber].rwlock);
+            return 0;
+        }
+    }
+    pthread_rwlock_unlock(&inode_table[inumber].rwlock);
+    return -1;
+}
+
+/* Looks for a given name inside a directory
+ * The dentry cache is checked first; the directory itself is only
+ * accessed on a miss.
+ * Input:
+ * 	- parent directory's i-node number
+ * 	- name to search
+ * 	Returns i-number linked to the target name, -1 if not found
+ */
+int find_in_dir(int inumber, char const *sub_name) {
+    int sub_inumber = dcache_lookup(inumber, sub_name);
+    if (sub_inumber != -1) {
+        return sub_inumber;
+    }
+
+    if (!valid_inumber(inumber)) {
+        return -1;
+    }
+    storage_access(INODE_CACHE_KEY(inumber));
+    if (inode_table[inumber].i_node_type != T_DIRECTORY) {
+        return -1;
+    }
+
+    /* Looks the name up in the directory's hash index */
+    if (dir_lock(inumber, false) == -1) {
+        return -1;
+    }
+    ssize_t pos = dir_index_find(inumber, sub_name);
+    if (pos != -1) {
+        dir_entry_t *dir_entry =
+            dir_entry_get(inumber, dir_indexes[inumber].table[pos].slot);
+        if (dir_entry != NULL) {
+            sub_inumber = dir_entry->d_inumber;
+            dcache_insert(inumber, sub_name, sub_inumber);
+        }
+    }
+    pthread_rwlock_unlock(&inode_table[inumber].rwlock);
+    return sub_inumber;
+}
+
+/*
+ * Returns the block group the calling thread allocates from first.
+ */
+static size_t group_home() { return thread_id() % BLOCK_GROUPS; }
+
+/*
+ * Returns the words of the bitmap that belong to a block group
+ * Input:
+ *  - g: the group
+ *  - first, end: set to the first word of the group and one past its last
+ */
+static void group_words(size_t g, size_t *first, size_t *end) {
+    *first = g * GROUP_WORDS;
+    *end = *first + GROUP_WORDS;
+    if (*end > BLOCK_BITMAP_WORDS) {
+        *end = BLOCK_BITMAP_WORDS;
+    }
+    if (*first > *end) {
+        *first = *end; /* more groups than words: this one is empty */
+    }
+}
+
+/*
+ * Marks a run of blocks as free in the bitmap.
+ */
+static void bitmap_clear_run(size_t start, size_t length) {
+    for (size_t b = start; b < start + length; b++) {
+        atomic_fetch_and(&free_blocks[b / BITMAP_WORD_BITS],
+                         ~(UINT64_C(1) << (b % BITMAP_WORD_BITS)));
+    }
+}
+
+/*
+ * Takes up to n free blocks from one block group, starting at the word
+ * where its previous allocation stopped and picking free bits a whole word
+ * at a time.
+ * Input:
+ *  - g: the group
+ *  - n: number of blocks wanted
+ *  - out: array with room for n block indexes
+ * Returns: the number of blocks taken
+ */
+static size_t group_alloc_n(size_t g, size_t n, int out[]) {
+    size_t first, end;
+    group_words(g, &first, &end);
+    if (first == end) {
+        return 0;
+    }
+
+    size_t found = 0;
+    block_group_t *group = &block_groups[g];
+    pthread_mutex_lock(&group->lock);
+    size_t w = group->hint;
+    for (size_t scanned = 0; scanned < end - first && found < n; scanned++) {
+        if ((w * sizeof(uint64_t)) % BLOCK_SIZE == 0 || scanned == 0) {
+            insert_delay(); // simulate storage access delay to free_blocks
+        }
+
+        uint64_t word = atomic_load(&free_blocks[w]);
+        while (word != ~UINT64_C(0) && found < n) {
+            int bit = __builtin_ctzll(~word);
+            uint64_t mask = UINT64_C(1) << bit;
+            /* Frees may clear other bits concurrently, so set ours
+             * atomically and keep whatever the word holds now */
+            word = atomic_fetch_or(&free_blocks[w], mask) | mask;
+            out[found++] = (int)(w * BITMAP_WORD_BITS) + bit;
+        }
+        if (found == n) {
+            break;
+        }
+        w = w + 1 == end ? first : w + 1;
+    }
+    group->hint = w;
+    pthread_mutex_unlock(&group->lock);
+    return found;
+}
+
+/*
+ * Takes n free blocks from the bitmap, from the thread's own block group
+ * first and then from the following ones. Either all n blocks are
+ * allocated or none is.
+ * Input:
+ *  - n: number of blocks to allocate
+ *  - out: array with room for n block indexes
+ * Returns: 0 if successful, -1 otherwise
+ */
+static int bitmap_alloc_n(size_t n, int out[]) {
+    size_t home = group_home();
+    size_t found = 0;
+    for (size_t i = 0; i < BLOCK_GROUPS && found < n; i++) {
+        found += group_alloc_n((home + i) % BLOCK_GROUPS, n - found, out + found);
+    }
+
+    if (found < n) {
+        /* Not enough free blocks: give back what was taken */
+        for (size_t i = 0; i < found; i++) {
+            bitmap_clear_run((size_t)out[i], 1);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Takes the longest run of contiguous free blocks in one block group, up
+ * to want blocks long, starting the search at the group's next-fit hint.
+ * Input:
+ *  - g: the group
+ *  - want: desired run length
+ *  - got: set to the length of the run taken (0 if none)
+ * Returns: first block of the run taken
+ */
+static size_t group_alloc_run(size_t g, size_t want, size_t *got) {
+    size_t first, end;
+    group_words(g, &first, &end);
+    size_t best_start = 0, best_len = 0, run_start = 0, run_len = 0;
+
+    block_group_t *group = &block_groups[g];
+    pthread_mutex_lock(&group->lock);
+    for (size_t scanned = 0; scanned < end - first && best_len < want;
+         scanned++) {
+        size_t w = first + (group->hint - first + scanned) % (end - first);
+        if ((w * sizeof(uint64_t)) % BLOCK_SIZE == 0 || scanned == 0) {
+            insert_delay(); // simulate storage access delay to free_blocks
+        }
+        if (w == first) {
+            run_len = 0; /* runs do not wrap around the end of the group */
+        }
+
+        uint64_t word = atomic_load(&free_blocks[w]);
+        int bit = 0;
+        while (bit < BITMAP_WORD_BITS && best_len < want) {
+            uint64_t rest = word >> bit;
+            if (rest & 1) {
+                /* Skip the taken blocks */
+                run_len = 0;
+                bit += ~rest == 0 ? BITMAP_WORD_BITS : __builtin_ctzll(~rest);
+            } else {
+                /* Count the free blocks (the bits shifted in are free) */
+                int free_bits =
+                    rest == 0 ? BITMAP_WORD_BITS - bit : __builtin_ctzll(rest);
+                if (run_len == 0) {
+                    run_start = w * BITMAP_WORD_BITS + (size_t)bit;
+                }
+                run_len += (size_t)free_bits;
+                bit += free_bits;
+                if (run_len > best_len) {
+                    best_start = run_start;
+                    best_len = run_len;
+                }
+            }
+        }
+    }
+
+    if (best_len > want) {
+        best_len = want;
+    }
+    for (size_t b = best_start; b < best_start + best_len; b++) {
+        atomic_fetch_or(&free_blocks[b / BITMAP_WORD_BITS],
+                        UINT64_C(1) << (b % BITMAP_WORD_BITS));
+    }
+    if (best_len > 0) {
+        group->hint = (best_start + best_len) / BITMAP_WORD_BITS;
+        if (group->hint == end) {
+            group->hint = first;
+        }
+    }
+    pthread_mutex_unlock(&group->lock);
+
+    *got = best_len;
+    return best_start;
+}
+
+/*
+ * Takes a run of contiguous free blocks from the bitmap, looking for one at
+ * least want blocks long in the thread's own block group first and then in
+ * the following ones, and settling for the longest one found otherwise.
+ * Runs never span two groups.
+ * Input:
+ *  - want: desired run length
+ *  - got: set to the length of the run taken (at most want)
+ * Returns: first block of the run if successful, -1 otherwise
+ */
+static int bitmap_alloc_run(size_t want, size_t *got) {
+    size_t home = group_home();
+    size_t best_start = 0, best_len = 0;
+
+    for (size_t i = 0; i < BLOCK_GROUPS && best_len < want; i++) {
+        size_t len;
+        size_t start = group_alloc_run((home + i) % BLOCK_GROUPS, want, &len);
+        /* Keep the longest run taken so far and give back the other */
+        if (len > best_len) {
+            bitmap_clear_run(best_start, best_len);
+            best_start = start;
+            best_len = len;
+        } else {
+            bitmap_clear_run(start, len);
+        }
+    }
+
+    if (best_len == 0) {
+        return -1;
+    }
+    *got = best_len;
+    return (int)best_start;
+}
+
+/*
+ * Returns n blocks to the global bitmap.
+ */
+static void bitmap_free_n(size_t n, int const blocks[]) {
+    if (n == 0) {
+        return;
+    }
+
+    insert_delay(); // simulate storage access delay to free_blocks
+    for (size_t i = 0; i < n; i++) {
+        atomic_fetch_and(&free_blocks[blocks[i] / BITMAP_WORD_BITS],
+                         ~(UINT64_C(1) << (blocks[i] % BITMAP_WORD_BITS)));
+    }
+}
+
+/*
+ * Called when a thread exits: hands its magazine back to the global pool.
+ */
+static void magazine_release(void *arg) {
+    block_magazine_t *mag = arg;
+
+    pthread_mutex_lock(&lock_magazines);
+    for (block_magazine_t **p = &magazines; *p != NULL; p = &(*p)->next) {
+        if (*p == mag) {
+            *p = mag->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock_magazines);
+
+    pthread_mutex_lock(&mag->lock);
+    bitmap_free_n(mag->count, mag->blocks);
+    pthread_mutex_unlock(&mag->lock);
+    pthread_mutex_destroy(&mag->lock);
+    free(mag);
+}
+
+static void magazine_key_create() {
+    pthread_key_create(&magazine_key, magazine_release);
+}
+
+/*
+ * Returns the calling thread's magazine, creating it on first use.
+ * Returns NULL if it could not be created, in which case callers go
+ * straight to the global bitmap.
+ */
+static block_magazine_t *magazine_get() {
+    if (thread_magazine != NULL) {
+        return thread_magazine;
+    }
+
+    pthread_once(&magazine_key_once, magazine_key_create);
+    block_magazine_t *mag = malloc(sizeof(block_magazine_t));
+    if (mag == NULL) {
+        return NULL;
+    }
+    if (pthread_mutex_init(&mag->lock, NULL) != 0) {
+        free(mag);
+        return NULL;
+    }
+    mag->count = 0;
+
+    pthread_mutex_lock(&lock_magazines);
+    mag->next = magazines;
+    magazines = mag;
+    pthread_mutex_unlock(&lock_magazines);
+
+    pthread_setspecific(magazine_key, mag);
+    thread_magazine = mag;
+    return mag;
+}
+
+/*
+ * Empties every thread's magazine into the global bitmap. Used when the
+ * global pool cannot satisfy an allocation on its own. Magazines that are
+ * busy are skipped, as their owner may be waiting on the bitmap itself.
+ */
+static void magazines_reclaim() {
+    pthread_mutex_lock(&lock_magazines);
+    for (block_magazine_t *mag = magazines; mag != NULL; mag = mag->next) {
+        if (pthread_mutex_trylock(&mag->lock) != 0) {
+            continue;
+        }
+        bitmap_free_n(mag->count, mag->blocks);
+        mag->count = 0;
+        pthread_mutex_unlock(&mag->lock);
+    }
+    pthread_mutex_unlock(&lock_magazines);
+}
+
+/*
+ * Allocated a new data block
+ * Returns: block index if successful, -1 otherwise
+ */
+int data_block_alloc() {
+    int block_number;
+    if (data_block_alloc_n(1, &block_number) == -1) {
+        return -1;
+    }
+    return block_number;
+}
+
+/*
+ * Allocates n data blocks. Blocks come from the calling thread's magazine
+ * first; whatever is missing is taken from the global bitmap in one batch,
+ * together with enough extra blocks to refill the magazine. Either all n
+ * blocks are allocated or none is.
+ * Input:
+ *  - n: number of blocks to allocate
+ *  - out: array with room for n block indexes
+ * Returns: 0 if successful, -1 otherwise
+ */
+int data_block_alloc_n(size_t n, int out[]) {
+    if (blocks_take(n, false) != n) {
+        return -1;
+    }
+
+    block_magazine_t *mag = magazine_get();
+    if (mag == NULL) {
+        if (bitmap_alloc_n(n, out) == -1) {
+            magazines_reclaim();
+            if (bitmap_alloc_n(n, out) == -1) {
+                blocks_give(n);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&mag->lock);
+    size_t found = 0;
+    while (found < n && mag->count > 0) {
+        out[found++] = mag->blocks[--mag->count];
+    }
+
+    if (found < n) {
+        size_t missing = n - found;
+        size_t refill = BLOCK_MAGAZINE_SIZE / 2;
+        int *batch = malloc(sizeof(int) * (missing + refill));
+
+        if (batch != NULL && bitmap_alloc_n(missing + refill, batch) == 0) {
+            memcpy(out + found, batch, sizeof(int) * missing);
+            /* Stored in reverse, so that the magazine hands out the blocks
+             * following the ones just returned, in order */
+            for (size_t i = 0; i < refill; i++) {
+                mag->blocks[i] = batch[missing + refill - 1 - i];
+            }
+            mag->count = refill;
+        } else if (bitmap_alloc_n(missing, out + found) == -1) {
+            /* The global pool is running low: pull back the blocks other
+             * threads are holding in their magazines and try again */
+            pthread_mutex_unlock(&mag->lock);
+            magazines_reclaim();
+            pthread_mutex_lock(&mag->lock);
+            if (bitmap_alloc_n(missing, out + found) == -1) {
+                bitmap_free_n(found, out);
+                pthread_mutex_unlock(&mag->lock);
+                free(batch);
+                blocks_give(n);
+                return -1;
+            }
+        }
+        free(batch);
+    }
+    pthread_mutex_unlock(&mag->lock);
+    return 0;
+}
+
+/*
+ * Allocates a run of contiguous data blocks, as long as possible up to want
+ * Input:
+ *  - want: desired number of blocks
+ *  - got: set to the number of blocks allocated
+ * Returns: first block of the run if successful, -1 otherwise
+ */
+int data_block_alloc_run(size_t want, size_t *got) {
+    size_t granted = blocks_take(want, true);
+    if (granted == 0) {
+        *got = 0;
+        return -1;
+    }
+
+    int start = bitmap_alloc_run(granted, got);
+    if (start == -1) {
+        magazines_reclaim();
+        start = bitmap_alloc_run(granted, got);
+    }
+    blocks_give(start == -1 ? granted : granted - *got);
+    return start;
+}
+
+// METEMOS OU NAO
+/* Frees a data block
+ * The block goes to the calling thread's magazine; when the magazine is
+ * full, half of it is returned to the global bitmap.
+ * Input
+ * 	- the block index
+ * Returns: 0 if success, -1 otherwise
+ */
+int data_block_free(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return -1;
+    }
+    blocks_give(1);
+
+    block_magazine_t *mag = magazine_get();
+    if (mag == NULL) {
+        bitmap_free_n(1, &block_number);
+        return 0;
+    }
+
+    pthread_mutex_lock(&mag->lock);
+    if (mag->count == BLOCK_MAGAZINE_SIZE) {
+        size_t keep = BLOCK_MAGAZINE_SIZE / 2;
+        bitmap_free_n(mag->count - keep, mag->blocks + keep);
+        mag->count = keep;
+    }
+    mag->blocks[mag->count++] = block_number;
+    pthread_mutex_unlock(&mag->lock);
+    return 0;
+}
+
+// METEMOS OU NAO
+/* Returns a pointer to the contents of a given block
+ * Input:
+ * 	- Block's index
+ * Returns: pointer to the first byte of the block, NULL otherwise
+ */
+void *data_block_get(int block_number) {
+    if (!valid_block_number(block_number)) {
+        return NULL;
+    }
+
+    storage_access(block_number);
+    return &fs_data[block_number * BLOCK_SIZE];
+}
+
+/* Returns a pointer to the contents of a run of contiguous blocks, which
+ * are laid out one after the other
+ * Input:
+ * 	- index of the run's first block
+ * 	- number of blocks in the run
+ * Returns: pointer to the first byte of the run, NULL otherwise
+ */
+void *data_blocks_get(int block_number, size_t count) {
+    if (count == 0 || !valid_block_number(block_number) ||
+        !valid_block_number(block_number + (int)count - 1)) {
+        return NULL;
+    }
+
+    /* Blocks missing from the cache are read in one go */
+    bool miss = false;
+    for (size_t i = 0; i < count; i++) {
+        miss = !cache_access(block_number + (int)i, true) || miss;
+    }
+    if (miss) {
+        insert_delay(); // simulate storage access delay to the run of blocks
+    }
+    return &fs_data[block_number * BLOCK_SIZE];
+}
+
+/*
+ * Background thread serving read-ahead requests: each run of blocks not
+ * already cached is read in one go and then brought into the cache.
+ */
+static void *prefetch_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&lock_prefetch);
+    while (!prefetch_stop) {
+        if (prefetch_count == 0) {
+            pthread_cond_wait(&prefetch_cond, &lock_prefetch);
+            continue;
+        }
+        prefetch_request_t request = prefetch_queue[prefetch_head];
+        prefetch_head = (prefetch_head + 1) % PREFETCH_QUEUE_SIZE;
+        prefetch_count--;
+        prefetch_busy = true;
+        pthread_mutex_unlock(&lock_prefetch);
+
+        bool miss = false;
+        for (size_t i = 0; i < request.count && !miss; i++) {
+            miss = !cache_contains(request.start + (int)i);
+        }
+        if (miss) {
+            insert_delay(); // simulate storage access delay to the run of blocks
+            for (size_t i = 0; i < request.count; i++) {
+                cache_access(request.start + (int)i, false);
+            }
+        }
+
+        pthread_mutex_lock(&lock_prefetch);
+        prefetch_busy = false;
+        if (prefetch_count == 0) {
+            pthread_cond_broadcast(&prefetch_idle_cond);
+        }
+    }
+    pthread_mutex_unlock(&lock_prefetch);
+    return NULL;
+}
+
+/* Asks for a run of contiguous blocks to be brought into the buffer cache
+ * in the background, ahead of being read
+ * Input:
+ * 	- index of the run's first block
+ * 	- number of blocks in the run
+ */
+void data_blocks_prefetch(int block_number, size_t count) {
+    if (count == 0 || !valid_block_number(block_number) ||
+        !valid_block_number(block_number + (int)count - 1)) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock_prefetch);
+    if (!prefetch_running) {
+        if (pthread_create(&prefetch_thread, NULL, prefetch_worker, NULL) !=
+            0) {
+            pthread_mutex_unlock(&lock_prefetch);
+            return;
+        }
+        prefetch_running = true;
+    }
+    if (prefetch_count < PREFETCH_QUEUE_SIZE) {
+        prefetch_queue[(prefetch_head + prefetch_count) % PREFETCH_QUEUE_SIZE] =
+            (prefetch_request_t){block_number, count};
+        prefetch_count++;
+        pthread_cond_signal(&prefetch_cond);
+    }
+    pthread_mutex_unlock(&lock_prefetch);
+}
+
+/* Waits until every read-ahead request asked for so far has been served */
+void data_blocks_prefetch_wait() {
+    pthread_mutex_lock(&lock_prefetch);
+    while (prefetch_running && !prefetch_stop &&
+           (prefetch_count > 0 || prefetch_busy)) {
+        pthread_cond_wait(&prefetch_idle_cond, &lock_prefetch);
+    }
+    pthread_mutex_unlock(&lock_prefetch);
+}
+
+/* Returns the buffer cache's hit and miss counts since the FS was
+ * initialized
+ * Input:
+ * 	- hits, misses: set to the number of accesses of each kind
+ */
+void buffer_cache_stats(size_t *hits, size_t *misses) {
+    *hits = 0;
+    *misses = 0;
+    for (size_t s = 0; s < BUFFER_CACHE_SHARDS; s++) {
+        pthread_mutex_lock(&cache_shards[s].lock);
+        *hits += cache_shards[s].hits;
+        *misses += cache_shards[s].misses;
+        pthread_mutex_unlock(&cache_shards[s].lock);
+    }
+}
+
+/*
+ * Adds a segment to the open file table, unless another thread has just
+ * done so, keeping one of the new entries for the caller and pushing the
+ * others onto the given shard.
+ * Returns: the number of a free entry, -1 if the table is full
+ */
+static int open_file_table_grow(size_t shard) {
+    pthread_mutex_lock(&lock_openfiletable);
+    for (size_t i = 0; i < OPEN_FILE_SHARDS; i++) {
+        int index = open_file_pop((shard + i) % OPEN_FILE_SHARDS);
+        if (index != -1) {
+            pthread_mutex_unlock(&lock_openfiletable);
+            return index;
+        }
+    }
+
+    size_t n = atomic_load(&open_file_segment_count);
+    open_file_entry_t *segment =
+        n == OPEN_FILE_SEGMENTS
+            ? NULL
+            : aligned_alloc(CACHE_LINE_SIZE,
+                            sizeof(open_file_entry_t) * OPEN_FILE_SEGMENT_SIZE);
+    if (segment == NULL) {
+        pthread_mutex_unlock(&lock_openfiletable);
+        return -1;
+    }
+    for (size_t i = 0; i < OPEN_FILE_SEGMENT_SIZE; i++) {
+        if (pthread_mutex_init(&segment[i].of_lock, NULL) != 0) {
+            while (i-- > 0) {
+                pthread_mutex_destroy(&segment[i].of_lock);
+            }
+            free(segment);
+            pthread_mutex_unlock(&lock_openfiletable);
+            return -1;
+        }
+        atomic_init(&segment[i].of_generation, 0);
+        atomic_init(&segment[i].of_next, 0);
+    }
+    atomic_store_explicit(&open_file_segments[n], segment,
+                          memory_order_release);
+    atomic_store(&open_file_segment_count, n + 1);
+    pthread_mutex_unlock(&lock_openfiletable);
+
+    /* Pushed in reverse, so that the entries are handed out in order */
+    size_t first = n * OPEN_FILE_SEGMENT_SIZE;
+    for (size_t i = OPEN_FILE_SEGMENT_SIZE - 1; i > 0; i--) {
+        open_file_push(shard, first + i);
+    }
+    return (int)first;
+}
+
+/* Add new entry to the open file table
+ * The entry comes from the calling thread's shard of the free list if
+ * possible, from the other shards otherwise, and the table only grows
+ * when they are all empty
+ * Inputs:
+ * 	- I-node number of the file to open
+ * 	- Initial offset
+ * Returns: file handle if successful, -1 otherwise
+ */
+int add_to_open_file_table(int inumber, size_t offset) {
+    size_t home = thread_id() % OPEN_FILE_SHARDS;
+    int index = -1;
+    for (size_t i = 0; i < OPEN_FILE_SHARDS && index == -1; i++) {
+        index = open_file_pop((home + i) % OPEN_FILE_SHARDS);
+    }
+    if (index == -1) {
+        index = open_file_table_grow(home);
+    }
+    open_file_entry_t *entry =
+        index == -1 ? NULL : open_file_entry_at((size_t)index);
+    if (entry == NULL) {
+        return -1;
+    }
+
+    entry->of_inumber = inumber;
+    entry->of_offset = offset;
+    entry->of_ra_next = offset;
+    entry->of_ra_window = 0;
+    entry->of_ra_end = 0;
+    atomic_fetch_add(&open_file_count, 1);
+    unsigned generation = atomic_load(&entry->of_generation) + 1;
+    atomic_store_explicit(&entry->of_generation, generation,
+                          memory_order_release);
+    return (int)((generation & OPEN_FILE_GENERATION_MASK)
+                 << OPEN_FILE_INDEX_BITS) |
+           index;
+}
+
+/*
+ * Splits a file handle into its entry's number and generation.
+ * Returns: the entry, NULL if the handle is not one of an open file
+ */
+static open_file_entry_t *open_file_handle_entry(int fhandle, size_t *index,
+                                                 unsigned *generation) {
+    if (fhandle < 0) {
+        return NULL;
+    }
+    *index = (size_t)fhandle & ((1U << OPEN_FILE_INDEX_BITS) - 1);
+    open_file_entry_t *entry = open_file_entry_at(*index);
+    if (entry == NULL) {
+        return NULL;
+    }
+    *generation =
+        atomic_load_explicit(&entry->of_generation, memory_order_acquire);
+    if (*generation % 2 == 0 ||
+        (*generation & OPEN_FILE_GENERATION_MASK) !=
+            (unsigned)fhandle >> OPEN_FILE_INDEX_BITS) {
+        return NULL;
+    }
+    return entry;
+}
+
+// METEMOS OU NAO
+/* Frees an entry from the open file table
+ * Inputs:
+ * 	- file handle to free/close
+ * Returns 0 is success, -1 otherwise
+ */
+int remove_from_open_file_table(int fhandle) {
+    size_t index;
+    unsigned generation;
+    if (open_file_handle_entry(fhandle, &index, &generation) == NULL) {
+        return -1;
+    }
+    return open_file_close(index, generation);
+}
+
+/* Waits until no file is open, that is, until every handle added to the
+ * open file table has been removed from it
+ */
+void wait_open_file_table_empty() {
+    pthread_mutex_lock(&lock_open_file_count);
+    while (atomic_load(&open_file_count) > 0) {
+        pthread_cond_wait(&open_file_count_cond, &lock_open_file_count);
+    }
+    pthread_mutex_unlock(&lock_open_file_count);
+}
+
+/* Returns pointer to a given entry in the open file table
+ * Inputs:
+ * 	 - file handle
+ * Returns: pointer to the entry if sucessful, NULL otherwise (including
+ * when the handle was closed, even if its entry has been reused since)
+ */
+open_file_entry_t *get_open_file_entry(int fhandle) {
+    size_t index;
+    unsigned generation;
+    return open_file_handle_entry(fhandle, &index, &generation);
+}
+
+void lock_write_inodetable() {
+    pthread_rwlock_wrlock(&lock_inodetable);
+}
+
+void lock_read_inodetable() {
+    pthread_rwlock_rdlock(&lock_inodetable);
+}
+
+void unlock_inodetable() {
+    pthread_rwlock_unlock(&lock_inodetable);
 }
\ No newline at end of file
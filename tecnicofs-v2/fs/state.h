@@ -3,6 +3,7 @@
 
 #include "config.h"
 
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -18,60 +19,121 @@ typedef struct {
 
 typedef enum { T_FILE, T_DIRECTORY } inode_type;
 
+/*
+ * Extent: run of consecutive file blocks stored in contiguous data blocks
+ */
+typedef struct {
+    int e_block;  /* first file block in the run */
+    int e_start;  /* data block holding it */
+    int e_length; /* number of blocks in the run */
+} extent_t;
+
+/*
+ * Index entry of an indirect extent tree: a child block (or -1) and the
+ * first file block mapped under it
+ */
+typedef struct {
+    int ei_block;
+    int ei_child;
+} extent_index_t;
+
 /*
  * I-node
+ * Aligned to a cache line, like the other entries of tables shared between
+ * threads, so that threads using neighboring i-nodes do not contend
  */
 typedef struct {
-    inode_type i_node_type;
-    size_t i_size;
-    int i_data_block[11];
-    pthread_rwlock_t rwlock;
+    _Alignas(CACHE_LINE_SIZE) inode_type i_node_type;
+    /* Sequence counter, odd while the size or the extents are being
+     * changed; lets inode_stat() read them without taking the rwlock */
+    _Atomic unsigned i_seq;
+    _Atomic size_t i_size;
+    _Atomic size_t i_blocks; /* number of file blocks mapped by the extents */
+    size_t i_extent_count;
+    extent_t i_extents[MAX_DIRECT_EXTENTS];
+    /* Roots of the single, double, ... indirect extent trees, holding the
+     * extents that do not fit in the i-node */
+    extent_index_t i_indirect[INDIRECT_LEVELS];
+    /* Written by every reader and writer, so kept apart from the fields
+     * above, which are mostly read (even without the lock) */
+    _Alignas(CACHE_LINE_SIZE) pthread_rwlock_t rwlock;
+    /* Delayed allocation (like the lock, not kept in an image): data written
+     * past the mapped blocks waits here, without blocks, until the i-node
+     * is flushed; its capacity (in bytes) and the number of data blocks it
+     * will need (which are reserved) */
+    char *i_dirty;
+    size_t i_dirty_capacity;
+    size_t i_dirty_blocks;
     /* in a real FS, more fields would exist here */
 } inode_t;
 
-typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
-
 /*
  * Open file entry (in open file table)
  */
 typedef struct {
-    int of_inumber;
+    _Alignas(CACHE_LINE_SIZE) int of_inumber;
     size_t of_offset;
+    /* Serializes the operations that use and advance of_offset (and the
+     * read-ahead state); taken before the i-node's rwlock */
+    pthread_mutex_t of_lock;
+    /* Read-ahead: offset where a sequential read would start next, current
+     * window (in blocks, 0 when the reads are not sequential) and file
+     * block up to which prefetches were already requested */
+    size_t of_ra_next;
+    size_t of_ra_window;
+    size_t of_ra_end;
+    /* Odd while the entry is open; bumped on every open and close, and
+     * part of the handle, so that stale handles are detected */
+    _Atomic unsigned of_generation;
+    _Atomic int of_next; /* next free entry plus one (0 for none) */
 } open_file_entry_t;
 
 #define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
 
-int state_init();
+int state_init(char const *image_path);
 void state_destroy();
 
 int inode_create(inode_type n_type);
 int inode_delete(int inumber);
 inode_t *inode_get(int inumber);
+size_t inode_alloc_blocks(inode_t *inode, size_t count);
+int inode_get_block(inode_t *inode, size_t file_block, size_t *run);
+int inode_free_blocks(inode_t *inode);
+int inode_truncate(inode_t *inode, size_t length);
+void inode_trim_blocks(inode_t *inode, size_t keep);
+void inode_meta_begin(inode_t *inode);
+void inode_meta_end(inode_t *inode);
+void inode_stat(inode_t *inode, size_t *size, size_t *blocks);
+void inode_journal(inode_t *inode);
+int inode_buffer(inode_t *inode, size_t length);
+int inode_flush(inode_t *inode);
+int inode_sync(inode_t *inode);
 
 int clear_dir_entry(int inumber, int sub_inumber);
 int add_dir_entry(int inumber, int sub_inumber, char const *sub_name);
 int find_in_dir(int inumber, char const *sub_name);
 
+void buffer_cache_stats(size_t *hits, size_t *misses);
+
+void journal_begin();
+int journal_commit();
+
 int data_block_alloc();
+int data_block_alloc_n(size_t n, int out[]);
+int data_block_alloc_run(size_t want, size_t *got);
 int data_block_free(int block_number);
 void *data_block_get(int block_number);
+void *data_blocks_get(int block_number, size_t count);
+int data_blocks_written(void const *data, size_t length);
+void data_blocks_prefetch(int block_number, size_t count);
+void data_blocks_prefetch_wait();
 
 int add_to_open_file_table(int inumber, size_t offset);
 int remove_from_open_file_table(int fhandle);
+void wait_open_file_table_empty();
 open_file_entry_t *get_open_file_entry(int fhandle);
 
-int* to_alloc(size_t to_write);
-int give_size(int *indexes);
-
 void lock_write_inodetable();
 void lock_read_inodetable();
 void unlock_inodetable();
-
-void lock_write_datablocks();
-void lock_read_datablocks();
-void unlock_datablocks();
-
-void lock_write_openfiletable();
-void lock_read_openfiletable();
-void unlock_openfiletable();
 #endif // STATE_H
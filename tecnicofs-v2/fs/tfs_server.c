@@ -0,0 +1,517 @@
+#include "common/protocol.h"
+#include "operations.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+   TecnicoFS server: owns a FS (kept in memory, or in an image file) and
+   serves the clients that mount it through its named pipe (see
+   common/protocol.h), each in a session of its own, so that several
+   processes share the same FS
+
+   Usage: tfs_server PIPE_PATH [IMAGE]
+ */
+
+typedef struct session session_t;
+
+/*
+ * Thread serving one shared memory slot of a session
+ */
+typedef struct {
+    pthread_t sw_tid;
+    session_t *sw_session;
+    tfs_slot_t *sw_slot;
+} slot_worker_t;
+
+struct session {
+    tfs_mount_t s_mount;
+    int s_reply_fd;
+    int s_request_fd;
+    tfs_shm_t *s_shm; /* NULL if the client uses its pipes */
+    slot_worker_t s_workers[TFS_SHM_SLOTS];
+    size_t s_worker_count;
+    /* Handles the client opened and has not closed, which are the only
+     * ones it may use, and which are closed when the session ends */
+    pthread_mutex_t s_lock;
+    int *s_handles;
+    size_t s_handle_count;
+    size_t s_handle_capacity;
+    session_t *s_next; /* in the list of sessions */
+    char s_buffer[TFS_TRANSFER_SIZE]; /* payload, when using pipes */
+};
+
+static char const *server_pipe_path;
+
+/* Sessions under way, whose slot workers a shutdown stops (with
+ * lock_sessions held until the server exits) */
+static session_t *sessions;
+static pthread_mutex_t lock_sessions = PTHREAD_MUTEX_INITIALIZER;
+
+/* Every request is carried out with lock_requests held for reading.
+ * shutting_down is set (with it held for writing) once the server is
+ * shutting down: requests that do not go through an open file are refused
+ * from then on; destroyed is set once the FS is gone, after the requests
+ * under way finished, and every request is refused from then on */
+static bool shutting_down;
+static bool destroyed;
+static pthread_rwlock_t lock_requests = PTHREAD_RWLOCK_INITIALIZER;
+
+static int session_track(session_t *session, int fhandle) {
+    pthread_mutex_lock(&session->s_lock);
+    if (session->s_handle_count == session->s_handle_capacity) {
+        size_t capacity = session->s_handle_capacity == 0
+                              ? 16
+                              : 2 * session->s_handle_capacity;
+        int *handles = realloc(session->s_handles, capacity * sizeof(int));
+        if (handles == NULL) {
+            pthread_mutex_unlock(&session->s_lock);
+            return -1;
+        }
+        session->s_handles = handles;
+        session->s_handle_capacity = capacity;
+    }
+    session->s_handles[session->s_handle_count++] = fhandle;
+    pthread_mutex_unlock(&session->s_lock);
+    return 0;
+}
+
+/*
+ * Looks for a handle among the ones the client opened, optionally
+ * forgetting it
+ * Returns true if the client opened it
+ */
+static bool session_owns(session_t *session, int fhandle, bool untrack) {
+    bool found = false;
+    pthread_mutex_lock(&session->s_lock);
+    for (size_t i = 0; i < session->s_handle_count; i++) {
+        if (session->s_handles[i] == fhandle) {
+            found = true;
+            if (untrack) {
+                session->s_handles[i] =
+                    session->s_handles[--session->s_handle_count];
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&session->s_lock);
+    return found;
+}
+
+/*
+ * Copies the path name a request carries
+ * Returns name, or NULL if the payload is not a path name
+ */
+static char const *request_name(tfs_request_t const *request,
+                                char const *data, char name[TFS_PATH_MAX]) {
+    if (request->r_len == 0 || request->r_len > TFS_PATH_MAX) {
+        return NULL;
+    }
+    memcpy(name, data, request->r_len);
+    return name[request->r_len - 1] == '\0' ? name : NULL;
+}
+
+/*
+ * Carries out a request of a client (see request_run())
+ */
+static ssize_t request_serve(session_t *session, tfs_request_t const *request,
+                             char *data) {
+    char name_buffer[TFS_PATH_MAX];
+    int fhandle = request->r_fhandle;
+    size_t len = (size_t)request->r_len;
+    size_t offset = (size_t)request->r_offset;
+
+    tfs_request_op_t op = (tfs_request_op_t)request->r_op;
+    switch (op) {
+    case TFS_REQ_LOOKUP:
+    case TFS_REQ_MKDIR:
+    case TFS_REQ_OPEN: {
+        char const *name = request_name(request, data, name_buffer);
+        if (name == NULL) {
+            return -1;
+        }
+        if (shutting_down) {
+            return -1;
+        }
+        if (op == TFS_REQ_LOOKUP) {
+            return tfs_lookup(name);
+        }
+        if (op == TFS_REQ_MKDIR) {
+            return tfs_mkdir(name);
+        }
+        ssize_t ret = tfs_open(name, request->r_flags);
+        if (ret != -1 && session_track(session, (int)ret) == -1) {
+            tfs_close((int)ret);
+            ret = -1;
+        }
+        return ret;
+    }
+    case TFS_REQ_CLOSE:
+        if (!session_owns(session, fhandle, true)) return -1;
+        return tfs_close(fhandle);
+    case TFS_REQ_WRITE:
+    case TFS_REQ_READ:
+    case TFS_REQ_PWRITE:
+    case TFS_REQ_PREAD:
+    case TFS_REQ_FSYNC:
+    case TFS_REQ_FTRUNCATE:
+    case TFS_REQ_FALLOCATE:
+        /* Only preallocations may be longer than a payload */
+        if (!session_owns(session, fhandle, false) ||
+            (op != TFS_REQ_FALLOCATE && len > TFS_TRANSFER_SIZE)) {
+            return -1;
+        }
+        break;
+    case TFS_REQ_MOUNT:
+    case TFS_REQ_UNMOUNT:
+    case TFS_REQ_SHUTDOWN:
+    default:
+        return -1;
+    }
+
+    switch (op) {
+    case TFS_REQ_WRITE:
+        return tfs_write(fhandle, data, len);
+    case TFS_REQ_READ:
+        return tfs_read(fhandle, data, len);
+    case TFS_REQ_PWRITE:
+        return tfs_pwrite(fhandle, data, len, offset);
+    case TFS_REQ_PREAD:
+        return tfs_pread(fhandle, data, len, offset);
+    case TFS_REQ_FSYNC:
+        return tfs_fsync(fhandle);
+    case TFS_REQ_FTRUNCATE:
+        return tfs_ftruncate(fhandle, offset);
+    case TFS_REQ_FALLOCATE:
+        return tfs_fallocate(fhandle, offset, len);
+    case TFS_REQ_MOUNT:
+    case TFS_REQ_UNMOUNT:
+    case TFS_REQ_SHUTDOWN:
+    case TFS_REQ_LOOKUP:
+    case TFS_REQ_MKDIR:
+    case TFS_REQ_OPEN:
+    case TFS_REQ_CLOSE:
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Carries out a request of a client, with its payload (and the payload of
+ * its response) in data, unless the FS is gone
+ * Returns the result of its call
+ */
+static ssize_t request_run(session_t *session, tfs_request_t const *request,
+                           char *data) {
+    ssize_t ret = -1;
+    pthread_rwlock_rdlock(&lock_requests);
+    if (!destroyed) {
+        ret = request_serve(session, request, data);
+    }
+    pthread_rwlock_unlock(&lock_requests);
+    return ret;
+}
+
+static bool request_has_payload(int32_t op) {
+    return op == TFS_REQ_LOOKUP || op == TFS_REQ_MKDIR || op == TFS_REQ_OPEN ||
+           op == TFS_REQ_WRITE || op == TFS_REQ_PWRITE;
+}
+
+static int response_send(session_t *session, ssize_t result,
+                         char const *data, size_t len) {
+    tfs_response_t response = {.r_result = result};
+    if (pipe_write_all(session->s_reply_fd, &response, sizeof(response)) ==
+        -1) {
+        return -1;
+    }
+    return len == 0 ? 0 : pipe_write_all(session->s_reply_fd, data, len);
+}
+
+/*
+ * Slot worker: waits for the client to post a request in its slot, carries
+ * it out in place and posts the response, until the session is over
+ */
+static void *slot_worker(void *arg) {
+    slot_worker_t *worker = arg;
+    tfs_slot_t *slot = worker->sw_slot;
+
+    for (;;) {
+        uint32_t state = atomic_load(&slot->s_state);
+        while (state != TFS_SLOT_REQUEST && state != TFS_SLOT_CLOSED) {
+            state = futex_wait_change(&slot->s_state, state);
+        }
+        if (state == TFS_SLOT_CLOSED) {
+            break;
+        }
+
+        /* The client cannot be trusted to leave the request alone */
+        tfs_request_t request = slot->s_request;
+        slot->s_response.r_result =
+            request_run(worker->sw_session, &request, slot->s_data);
+        uint32_t expected = TFS_SLOT_REQUEST;
+        atomic_compare_exchange_strong(&slot->s_state, &expected,
+                                       TFS_SLOT_RESPONSE);
+        futex_wake(&slot->s_state);
+    }
+    return NULL;
+}
+
+/*
+ * Maps the client's shared memory object and starts serving its slots
+ * Returns 0 if successful, -1 otherwise
+ */
+static int session_shm_start(session_t *session) {
+    session->s_mount.m_shm_name[TFS_SHM_NAME_MAX - 1] = '\0';
+    int fd = shm_open(session->s_mount.m_shm_name, O_RDWR, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(tfs_shm_t)) {
+        close(fd);
+        return -1;
+    }
+    void *shm = mmap(NULL, sizeof(tfs_shm_t), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        return -1;
+    }
+    session->s_shm = shm;
+
+    for (size_t i = 0; i < TFS_SHM_SLOTS; i++) {
+        slot_worker_t *worker = &session->s_workers[i];
+        worker->sw_session = session;
+        worker->sw_slot = &session->s_shm->shm_slots[i];
+        if (pthread_create(&worker->sw_tid, NULL, slot_worker, worker) != 0) {
+            return -1;
+        }
+        session->s_worker_count++;
+    }
+    return 0;
+}
+
+/*
+ * Stops the slot workers of a session, once the requests they are
+ * carrying out are done
+ * Must be called with lock_sessions held
+ */
+static void session_stop_workers(session_t *session) {
+    if (session->s_shm == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < TFS_SHM_SLOTS; i++) {
+        tfs_slot_t *slot = &session->s_shm->shm_slots[i];
+        atomic_store(&slot->s_state, TFS_SLOT_CLOSED);
+        futex_wake(&slot->s_state);
+    }
+    for (size_t i = 0; i < session->s_worker_count; i++) {
+        pthread_join(session->s_workers[i].sw_tid, NULL);
+    }
+    session->s_worker_count = 0;
+}
+
+/*
+ * Ends a session: stops its slot workers, closes the files the client left
+ * open and lets go of everything else
+ */
+static void session_end(session_t *session) {
+    pthread_mutex_lock(&lock_sessions);
+    session_t **link = &sessions;
+    while (*link != NULL && *link != session) {
+        link = &(*link)->s_next;
+    }
+    if (*link != NULL) {
+        *link = session->s_next;
+    }
+    session_stop_workers(session);
+    pthread_mutex_unlock(&lock_sessions);
+    if (session->s_shm != NULL) {
+        munmap(session->s_shm, sizeof(tfs_shm_t));
+    }
+
+    for (size_t i = 0; i < session->s_handle_count; i++) {
+        tfs_close(session->s_handles[i]);
+    }
+    free(session->s_handles);
+    pthread_mutex_destroy(&session->s_lock);
+    if (session->s_request_fd != -1) close(session->s_request_fd);
+    if (session->s_reply_fd != -1) close(session->s_reply_fd);
+    free(session);
+}
+
+/*
+ * Destroys the FS once every file is closed, answers the client that asked
+ * for it and exits; refused (and answered with -1) if the client itself
+ * has files open, which it could not close while waiting for the answer,
+ * or if another client already asked for it
+ */
+static void server_shutdown(session_t *session) {
+    pthread_rwlock_wrlock(&lock_requests);
+    pthread_mutex_lock(&session->s_lock);
+    bool refused = shutting_down || session->s_handle_count > 0;
+    pthread_mutex_unlock(&session->s_lock);
+    if (!refused) {
+        shutting_down = true;
+    }
+    pthread_rwlock_unlock(&lock_requests);
+    if (refused) {
+        response_send(session, -1, NULL, 0);
+        return;
+    }
+
+    wait_open_file_table_empty();
+    /* Nothing but this thread may touch the FS from here on: the sessions
+     * that end meanwhile wait on lock_sessions */
+    pthread_mutex_lock(&lock_sessions);
+    for (session_t *other = sessions; other != NULL; other = other->s_next) {
+        session_stop_workers(other);
+    }
+    pthread_rwlock_wrlock(&lock_requests);
+    int ret = tfs_destroy();
+    destroyed = true;
+    response_send(session, ret, NULL, 0);
+    unlink(server_pipe_path);
+    exit(ret == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/*
+ * Session thread: opens the client's pipes (and shared memory object), and
+ * then serves the requests it sends through its request pipe until it
+ * unmounts or goes away
+ */
+static void *session_run(void *arg) {
+    session_t *session = arg;
+    tfs_mount_t *mount = &session->s_mount;
+
+    char request_path[TFS_PATH_MAX + sizeof(TFS_REQUEST_PIPE_SUFFIX)];
+    mount->m_client_path[TFS_PATH_MAX - 1] = '\0';
+    snprintf(request_path, sizeof(request_path), "%s%s", mount->m_client_path,
+             TFS_REQUEST_PIPE_SUFFIX);
+    session->s_reply_fd = open(mount->m_client_path, O_WRONLY);
+    if (session->s_reply_fd == -1) {
+        session_end(session);
+        return NULL;
+    }
+    session->s_request_fd = open(request_path, O_RDONLY);
+
+    int ret = session->s_request_fd == -1 ? -1 : 0;
+    if (ret == 0 && mount->m_transport == TFS_TRANSPORT_SHM) {
+        ret = session_shm_start(session);
+    } else if (mount->m_transport != TFS_TRANSPORT_PIPE) {
+        ret = -1;
+    }
+    if (response_send(session, ret, NULL, 0) == -1 || ret == -1) {
+        session_end(session);
+        return NULL;
+    }
+
+    for (;;) {
+        tfs_request_t request;
+        if (pipe_read_all(session->s_request_fd, &request, sizeof(request)) ==
+                -1 ||
+            request.r_op == TFS_REQ_UNMOUNT) {
+            break;
+        }
+        if (request.r_op == TFS_REQ_SHUTDOWN) {
+            server_shutdown(session); /* only returns if refused */
+            continue;
+        }
+        /* Through shared memory, the pipes only carry the session itself */
+        if (session->s_shm != NULL) {
+            break;
+        }
+
+        if (request_has_payload(request.r_op)) {
+            if (request.r_len > TFS_TRANSFER_SIZE ||
+                pipe_read_all(session->s_request_fd, session->s_buffer,
+                              (size_t)request.r_len) == -1) {
+                break;
+            }
+        }
+        ssize_t result = request_run(session, &request, session->s_buffer);
+        size_t len = 0;
+        if ((request.r_op == TFS_REQ_READ || request.r_op == TFS_REQ_PREAD) &&
+            result > 0) {
+            len = (size_t)result;
+        }
+        if (response_send(session, result, session->s_buffer, len) == -1) {
+            break;
+        }
+    }
+
+    session_end(session);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s PIPE_PATH [IMAGE]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    server_pipe_path = argv[1];
+
+    /* Clients that go away are noticed by the failing writes */
+    signal(SIGPIPE, SIG_IGN);
+
+    if (tfs_init_image(argc > 2 ? argv[2] : NULL) == -1) {
+        fprintf(stderr, "%s: cannot initialize the FS\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if ((unlink(server_pipe_path) == -1 && errno != ENOENT) ||
+        mkfifo(server_pipe_path, 0640) == -1) {
+        fprintf(stderr, "%s: cannot create %s: %s\n", argv[0],
+                server_pipe_path, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    /* Holding the pipe open for writing as well keeps reads from seeing an
+     * end of file whenever no client is writing to it */
+    int fd = open(server_pipe_path, O_RDONLY | O_NONBLOCK);
+    if (fd == -1 || open(server_pipe_path, O_WRONLY) == -1 ||
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) == -1) {
+        fprintf(stderr, "%s: cannot open %s: %s\n", argv[0], server_pipe_path,
+                strerror(errno));
+        unlink(server_pipe_path);
+        return EXIT_FAILURE;
+    }
+
+    for (;;) {
+        tfs_mount_t mount;
+        if (pipe_read_all(fd, &mount, sizeof(mount)) == -1) {
+            break;
+        }
+        if (mount.m_op != TFS_REQ_MOUNT) {
+            continue;
+        }
+
+        session_t *session = calloc(1, sizeof(session_t));
+        if (session == NULL) {
+            continue;
+        }
+        session->s_mount = mount;
+        session->s_reply_fd = -1;
+        session->s_request_fd = -1;
+        pthread_mutex_init(&session->s_lock, NULL);
+        pthread_mutex_lock(&lock_sessions);
+        session->s_next = sessions;
+        sessions = session;
+        pthread_mutex_unlock(&lock_sessions);
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, session_run, session) != 0) {
+            session_end(session);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+
+    unlink(server_pipe_path);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,183 @@
+#include "../fs/async.h"
+#include <assert.h>
+#include <string.h>
+
+#define FILES 8
+#define BLOCKS 6
+#define APPENDS 40
+#define CHUNK 100
+#define ENTRIES 16
+#define WORKERS 4
+
+/**
+   This test drives the FS through an asynchronous I/O ring from a single
+   thread: it opens several files, writes their blocks at given offsets
+   with more requests than fit in the ring at once, appends to a file at
+   the handle's offset (which must end up in submission order), reads
+   everything back and closes the files, checking every completion
+ */
+
+char data[FILES][BLOCKS * BLOCK_SIZE];
+char read_back[FILES][BLOCKS * BLOCK_SIZE];
+char appended[APPENDS * CHUNK];
+char appended_back[APPENDS * CHUNK];
+
+static ssize_t results[FILES * BLOCKS + APPENDS + 1];
+static size_t completed;
+
+static void reap(tfs_ring_t *ring) {
+    tfs_cqe_t cqe;
+    assert(tfs_ring_wait_cqe(ring, &cqe) == 0);
+    assert(cqe.user_data < sizeof(results) / sizeof(results[0]));
+    results[cqe.user_data] = cqe.result;
+    completed++;
+}
+
+/* Gets an entry, reaping completions while the ring is full */
+static tfs_sqe_t *next_sqe(tfs_ring_t *ring) {
+    tfs_sqe_t *sqe;
+    while ((sqe = tfs_ring_get_sqe(ring)) == NULL) {
+        tfs_ring_submit(ring);
+        reap(ring);
+    }
+    return sqe;
+}
+
+static void drain(tfs_ring_t *ring) {
+    tfs_ring_submit(ring);
+    tfs_cqe_t cqe;
+    while (tfs_ring_wait_cqe(ring, &cqe) == 0) {
+        results[cqe.user_data] = cqe.result;
+        completed++;
+    }
+}
+
+int main() {
+    char names[FILES][MAX_FILE_NAME];
+    int fds[FILES];
+
+    assert(tfs_init() != -1);
+    tfs_ring_t *ring = tfs_ring_create(ENTRIES, WORKERS);
+    assert(ring != NULL);
+
+    tfs_cqe_t cqe;
+    assert(tfs_ring_peek_cqe(ring, &cqe) == -1);
+    assert(tfs_ring_wait_cqe(ring, &cqe) == -1);
+
+    for (int f = 0; f < FILES; f++) {
+        snprintf(names[f], MAX_FILE_NAME, "/f%d", f);
+        tfs_sqe_t *sqe = next_sqe(ring);
+        sqe->op = TFS_OP_OPEN;
+        sqe->name = names[f];
+        sqe->flags = TFS_O_CREAT;
+        sqe->user_data = (uint64_t)f;
+    }
+    drain(ring);
+    for (int f = 0; f < FILES; f++) {
+        fds[f] = (int)results[f];
+        assert(fds[f] != -1);
+    }
+
+    /* Blocks written last to first, all files at once */
+    completed = 0;
+    for (int b = BLOCKS - 1; b >= 0; b--) {
+        for (int f = 0; f < FILES; f++) {
+            memset(data[f] + b * BLOCK_SIZE, 'a' + (f * BLOCKS + b) % 26,
+                   BLOCK_SIZE);
+            tfs_sqe_t *sqe = next_sqe(ring);
+            sqe->op = TFS_OP_WRITE;
+            sqe->fhandle = fds[f];
+            sqe->buffer = data[f] + b * BLOCK_SIZE;
+            sqe->len = BLOCK_SIZE;
+            sqe->offset = (size_t)b * BLOCK_SIZE;
+            sqe->user_data = (uint64_t)(f * BLOCKS + b);
+        }
+    }
+    drain(ring);
+    assert(completed == FILES * BLOCKS);
+    for (int i = 0; i < FILES * BLOCKS; i++) {
+        assert(results[i] == BLOCK_SIZE);
+    }
+
+    /* Appends through one handle complete in order */
+    int appender = fds[0];
+    tfs_sqe_t *sqe = next_sqe(ring);
+    sqe->op = TFS_OP_CLOSE;
+    sqe->fhandle = appender;
+    drain(ring);
+    assert(results[0] == 0);
+    sqe = next_sqe(ring);
+    sqe->op = TFS_OP_OPEN;
+    sqe->name = names[0];
+    sqe->flags = TFS_O_APPEND;
+    drain(ring);
+    appender = (int)results[0];
+    assert(appender != -1);
+    for (int i = 0; i < APPENDS; i++) {
+        memset(appended + i * CHUNK, '0' + i % 10, CHUNK);
+        sqe = next_sqe(ring);
+        sqe->op = TFS_OP_WRITE;
+        sqe->fhandle = appender;
+        sqe->buffer = appended + i * CHUNK;
+        sqe->len = CHUNK;
+        sqe->offset = TFS_OFFSET_CURRENT;
+        sqe->user_data = (uint64_t)(FILES * BLOCKS + i);
+    }
+    sqe = next_sqe(ring);
+    sqe->op = TFS_OP_FSYNC;
+    sqe->fhandle = appender;
+    sqe->user_data = FILES * BLOCKS + APPENDS;
+    drain(ring);
+    for (int i = 0; i <= APPENDS; i++) {
+        assert(results[FILES * BLOCKS + i] == (i < APPENDS ? CHUNK : 0));
+    }
+
+    /* Read back, then closed */
+    for (int f = 0; f < FILES; f++) {
+        sqe = next_sqe(ring);
+        sqe->op = TFS_OP_READ;
+        sqe->fhandle = f == 0 ? appender : fds[f];
+        sqe->buffer = read_back[f];
+        sqe->len = BLOCKS * BLOCK_SIZE;
+        sqe->offset = 0;
+        sqe->user_data = (uint64_t)f;
+    }
+    sqe = next_sqe(ring);
+    sqe->op = TFS_OP_READ;
+    sqe->fhandle = appender;
+    sqe->buffer = appended_back;
+    sqe->len = sizeof(appended_back);
+    sqe->offset = BLOCKS * BLOCK_SIZE;
+    sqe->user_data = FILES;
+    drain(ring);
+    for (int f = 0; f < FILES; f++) {
+        assert(results[f] == BLOCKS * BLOCK_SIZE);
+        assert(memcmp(data[f], read_back[f], BLOCKS * BLOCK_SIZE) == 0);
+    }
+    assert(results[FILES] == sizeof(appended));
+    assert(memcmp(appended, appended_back, sizeof(appended)) == 0);
+
+    for (int f = 0; f < FILES; f++) {
+        sqe = next_sqe(ring);
+        sqe->op = TFS_OP_CLOSE;
+        sqe->fhandle = f == 0 ? appender : fds[f];
+        sqe->user_data = (uint64_t)f;
+    }
+    /* A stale handle fails */
+    sqe = next_sqe(ring);
+    sqe->op = TFS_OP_FSYNC;
+    sqe->fhandle = fds[0];
+    sqe->user_data = FILES;
+    drain(ring);
+    for (int f = 0; f < FILES; f++) {
+        assert(results[f] == 0);
+    }
+    assert(results[FILES] == -1);
+
+    tfs_ring_destroy(ring);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
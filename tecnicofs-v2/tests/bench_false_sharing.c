@@ -0,0 +1,115 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define OPS 20000
+#define RECORD 8
+
+/**
+   This benchmark has a thread hammer one file with small positional
+   writes and reads, first alone and then alongside a second thread doing
+   the same to the file whose i-node comes right after it in the table,
+   and reports how much each one slows down when running together; with
+   the i-nodes on separate cache lines the slowdown should be negligible.
+   Each thread's CPU time is measured, rather than the elapsed time, so
+   that the figures stay meaningful when the threads share a core. The
+   figures are only printed: what is checked is the layout that keeps the
+   i-nodes, their locks and the open file entries on separate lines
+ */
+
+int fds[2];
+double elapsed[2];
+
+#define LINE(p) ((uintptr_t)(p) / CACHE_LINE_SIZE)
+
+static void check_layout(int inum[2]) {
+    assert(_Alignof(inode_t) == CACHE_LINE_SIZE);
+    assert(sizeof(inode_t) % CACHE_LINE_SIZE == 0);
+    assert(offsetof(inode_t, rwlock) % CACHE_LINE_SIZE == 0);
+    assert(offsetof(inode_t, rwlock) / CACHE_LINE_SIZE !=
+           offsetof(inode_t, i_size) / CACHE_LINE_SIZE);
+    assert(_Alignof(open_file_entry_t) == CACHE_LINE_SIZE);
+    assert(sizeof(open_file_entry_t) % CACHE_LINE_SIZE == 0);
+
+    inode_t *a = inode_get(inum[0]);
+    inode_t *b = inode_get(inum[1]);
+    assert(a != NULL && b != NULL);
+    assert((uintptr_t)a % CACHE_LINE_SIZE == 0);
+    assert((uintptr_t)b - (uintptr_t)a == sizeof(inode_t));
+    assert(LINE(&a->rwlock + 1) <= LINE(b));
+}
+
+static double cpu_time() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void *hammer(void *arg) {
+    size_t id = (size_t)arg;
+    char input[RECORD], output[RECORD];
+
+    double start = cpu_time();
+    for (size_t i = 0; i < OPS; i++) {
+        size_t offset = (i % 64) * RECORD;
+        memset(input, (int)('a' + i % 26), RECORD);
+        assert(tfs_pwrite(fds[id], input, RECORD, offset) == RECORD);
+        assert(tfs_pread(fds[id], output, RECORD, offset) == RECORD);
+        assert(memcmp(input, output, RECORD) == 0);
+    }
+    elapsed[id] = cpu_time() - start;
+    return NULL;
+}
+
+int main() {
+    char *paths[] = {"/a", "/b", "/c", "/d"};
+    pthread_t tid[2];
+
+    assert(tfs_init() != -1);
+
+    /* The last two files get consecutive i-nodes (3 and 4) */
+    for (size_t i = 0; i < 4; i++) {
+        int fd = tfs_open(paths[i], TFS_O_CREAT);
+        assert(fd != -1);
+        if (i >= 2) {
+            fds[i - 2] = fd;
+        } else {
+            assert(tfs_close(fd) != -1);
+        }
+    }
+    int inum[2] = {tfs_lookup("/c"), tfs_lookup("/d")};
+    assert(inum[1] == inum[0] + 1);
+    check_layout(inum);
+
+    double solo[2];
+    for (size_t i = 0; i < 2; i++) {
+        assert(pthread_create(&tid[i], NULL, hammer, (void *)i) == 0);
+        assert(pthread_join(tid[i], NULL) == 0);
+        solo[i] = elapsed[i];
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        assert(pthread_create(&tid[i], NULL, hammer, (void *)i) == 0);
+    }
+    for (size_t i = 0; i < 2; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    for (size_t i = 0; i < 2; i++) {
+        printf("i-node %d: %.0f ops per CPU second alone, %.0f together "
+               "(%.2fx)\n",
+               inum[i], 2 * OPS / solo[i], 2 * OPS / elapsed[i],
+               elapsed[i] / solo[i]);
+    }
+
+    assert(tfs_close(fds[0]) != -1);
+    assert(tfs_close(fds[1]) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
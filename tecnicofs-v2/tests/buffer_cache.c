@@ -0,0 +1,59 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define SMALL (4 * BLOCK_SIZE)
+#define LARGE (2 * BUFFER_CACHE_SIZE * BLOCK_SIZE)
+#define PASSES 5
+
+/**
+   This test reads a small file over and over, checking that once its
+   blocks are cached no more misses happen, then scans a file twice the
+   size of the cache block by block, checking that most blocks have to be
+   brought in again on the second pass
+ */
+
+char buffer[LARGE];
+
+int main() {
+    size_t hits, misses, prev_hits, prev_misses;
+
+    assert(tfs_init() != -1);
+
+    memset(buffer, 'A', LARGE);
+    int small = tfs_open("/small", TFS_O_CREAT);
+    assert(small != -1);
+    assert(tfs_write(small, buffer, SMALL) == SMALL);
+    /* Flushed, so that its data is in blocks (not in its dirty buffer) */
+    assert(tfs_fsync(small) != -1);
+    int large = tfs_open("/large", TFS_O_CREAT);
+    assert(large != -1);
+    assert(tfs_write(large, buffer, LARGE) == LARGE);
+
+    /* Hot blocks: after the first pass, every access is a hit */
+    assert(tfs_pread(small, buffer, SMALL, 0) == SMALL);
+    buffer_cache_stats(&prev_hits, &prev_misses);
+    for (int i = 0; i < PASSES; i++) {
+        assert(tfs_pread(small, buffer, SMALL, 0) == SMALL);
+    }
+    buffer_cache_stats(&hits, &misses);
+    assert(misses == prev_misses);
+    assert(hits >= prev_hits + PASSES * SMALL / BLOCK_SIZE);
+
+    /* A scan larger than the cache evicts its own blocks */
+    for (int pass = 0; pass < 2; pass++) {
+        buffer_cache_stats(&prev_hits, &prev_misses);
+        for (size_t off = 0; off < LARGE; off += BLOCK_SIZE) {
+            assert(tfs_pread(large, buffer, BLOCK_SIZE, off) == BLOCK_SIZE);
+        }
+        buffer_cache_stats(&hits, &misses);
+        assert(misses - prev_misses >= LARGE / BLOCK_SIZE / 2);
+    }
+
+    assert(tfs_close(small) != -1);
+    assert(tfs_close(large) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
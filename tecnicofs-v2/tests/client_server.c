@@ -0,0 +1,246 @@
+#include "../client/tecnicofs_client_api.h"
+#include <assert.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_CLIENTS 2
+#define THREADS 4
+#define SIZE (2 * TFS_TRANSFER_SIZE + 1000)
+#define PIPE_SIZE (TFS_TRANSFER_SIZE + 10)
+#define PIPE_RESERVED (60 * BLOCK_SIZE)
+#define WAIT_TRIES 500
+
+/**
+   This test starts a TecnicoFS server (fs/tfs_server, next to the test's
+   directory) and has several client processes use its FS at once: some
+   through shared memory, with several threads each, and one through named
+   pipes, all writing and reading back files larger than a single request
+   can carry; one of them exits leaving a file open. Then it checks, from
+   yet another client, that every file holds what was written, and shuts
+   the server down while a last client, through named pipes, still has a
+   file open (and has its own request to shut down refused): the server
+   must go on serving it until it closes the file, and only then exit
+ */
+
+static char server_pipe[64];
+
+static char file_byte(size_t file, size_t i) {
+    return (char)('a' + (file * 7 + i % 23) % 26);
+}
+
+static void file_name(char *name, size_t file) {
+    sprintf(name, "/f%zu", file);
+}
+
+static void client_path(char *path, size_t client) {
+    snprintf(path, TFS_PATH_MAX, "%s.c%zu", server_pipe, client);
+}
+
+static void *shm_thread(void *arg) {
+    size_t file = (size_t)arg;
+    char name[16];
+    static _Thread_local char data[SIZE], read_back[SIZE];
+
+    file_name(name, file);
+    for (size_t i = 0; i < SIZE; i++) {
+        data[i] = file_byte(file, i);
+    }
+    int f = tfs_open(name, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, data, SIZE) == SIZE);
+    assert(tfs_pread(f, read_back, sizeof(read_back), 0) == SIZE);
+    assert(memcmp(data, read_back, SIZE) == 0);
+    assert(tfs_read(f, read_back, 1) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_write(f, data, 1) == -1);
+    return NULL;
+}
+
+static void shm_client(size_t client) {
+    char path[TFS_PATH_MAX];
+    client_path(path, client);
+    assert(tfs_mount_transport(path, server_pipe, TFS_TRANSPORT_SHM) == 0);
+
+    pthread_t tid[THREADS];
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tid[t], NULL, shm_thread,
+                              (void *)(client * THREADS + t)) == 0);
+    }
+    for (size_t t = 0; t < THREADS; t++) {
+        assert(pthread_join(tid[t], NULL) == 0);
+    }
+
+    if (client == 0) {
+        assert(tfs_unmount() == 0);
+    } else {
+        /* Left open: the server closes it once the client is gone */
+        char name[16];
+        file_name(name, client * THREADS);
+        assert(tfs_open(name, 0) != -1);
+    }
+}
+
+static void pipe_client(size_t client) {
+    static char data[PIPE_SIZE], read_back[PIPE_SIZE];
+    char path[TFS_PATH_MAX];
+    client_path(path, client);
+    assert(tfs_mount_transport(path, server_pipe, TFS_TRANSPORT_PIPE) == 0);
+
+    for (size_t i = 0; i < PIPE_SIZE; i++) {
+        data[i] = file_byte(client, i);
+    }
+    assert(tfs_mkdir("/pipe") != -1);
+    int f = tfs_open("/pipe/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_fallocate(f, 0, PIPE_RESERVED) != -1);
+    assert(tfs_write(f, data, PIPE_SIZE) == PIPE_SIZE);
+    assert(tfs_ftruncate(f, PIPE_SIZE + 5) != -1);
+    assert(tfs_fsync(f) != -1);
+    assert(tfs_close(f) != -1);
+
+    f = tfs_open("/pipe/f", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_read(f, read_back, 1) == 0);
+    assert(tfs_pread(f, read_back, PIPE_SIZE, 0) == PIPE_SIZE);
+    assert(memcmp(data, read_back, PIPE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unmount() == 0);
+}
+
+static void holding_client(size_t client, int ready_fd, int go_fd) {
+    char path[TFS_PATH_MAX];
+    char byte;
+    client_path(path, client);
+    assert(tfs_mount_transport(path, server_pipe, TFS_TRANSPORT_PIPE) == 0);
+
+    int f = tfs_open("/pipe/f", 0);
+    assert(f != -1);
+    assert(tfs_shutdown_after_all_closed() == -1);
+    assert(write(ready_fd, "r", 1) == 1);
+
+    /* Still served while the shutdown waits for the file to be closed */
+    assert(read(go_fd, &byte, 1) == 1);
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 200 * 1000 * 1000};
+    nanosleep(&pause, NULL);
+    assert(tfs_pread(f, &byte, 1, 0) == 1 && byte == file_byte(SHM_CLIENTS, 0));
+    assert(tfs_lookup("/pipe/f") == -1);
+    assert(tfs_close(f) != -1);
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    char server_path[PATH_MAX];
+    char *dir = strdup(argv[0]);
+    assert(dir != NULL);
+    snprintf(server_path, sizeof(server_path), "%s/../fs/tfs_server",
+             dirname(dir));
+    free(dir);
+    snprintf(server_pipe, sizeof(server_pipe), "/tmp/tfs_client_server.%ld",
+             (long)getpid());
+
+    pid_t server = fork();
+    assert(server != -1);
+    if (server == 0) {
+        execl(server_path, server_path, server_pipe, (char *)NULL);
+        perror(server_path);
+        _exit(EXIT_FAILURE);
+    }
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+    for (int i = 0; access(server_pipe, F_OK) == -1; i++) {
+        assert(i < WAIT_TRIES && waitpid(server, NULL, WNOHANG) == 0);
+        nanosleep(&pause, NULL);
+    }
+
+    pid_t clients[SHM_CLIENTS + 1];
+    for (size_t c = 0; c <= SHM_CLIENTS; c++) {
+        clients[c] = fork();
+        assert(clients[c] != -1);
+        if (clients[c] == 0) {
+            if (c < SHM_CLIENTS) {
+                shm_client(c);
+            } else {
+                pipe_client(c);
+            }
+            exit(EXIT_SUCCESS);
+        }
+    }
+    for (size_t c = 0; c <= SHM_CLIENTS; c++) {
+        int status;
+        assert(waitpid(clients[c], &status, 0) == clients[c]);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    /* The pipes of the client that did not unmount are left behind */
+    char path[TFS_PATH_MAX];
+    client_path(path, SHM_CLIENTS - 1);
+    unlink(path);
+    strcat(path, TFS_REQUEST_PIPE_SUFFIX);
+    unlink(path);
+
+    /* A client holding a file open across the shutdown */
+    int ready[2], go[2];
+    assert(pipe(ready) == 0 && pipe(go) == 0);
+    pid_t holder = fork();
+    assert(holder != -1);
+    if (holder == 0) {
+        holding_client(SHM_CLIENTS + 2, ready[1], go[0]);
+        /* Exits without unmounting, as the server may be gone already */
+        exit(EXIT_SUCCESS);
+    }
+    char byte;
+    assert(read(ready[0], &byte, 1) == 1);
+
+    /* What every client wrote is seen by another */
+    static char read_back[SIZE + 1];
+    client_path(path, SHM_CLIENTS + 1);
+    assert(tfs_mount(path, server_pipe) == 0);
+    for (size_t file = 0; file < SHM_CLIENTS * THREADS; file++) {
+        char name[16];
+        file_name(name, file);
+        int f = tfs_open(name, 0);
+        assert(f != -1);
+        assert(tfs_read(f, read_back, sizeof(read_back)) == SIZE);
+        for (size_t i = 0; i < SIZE; i++) {
+            assert(read_back[i] == file_byte(file, i));
+        }
+        assert(tfs_close(f) != -1);
+    }
+    int f = tfs_open("/pipe/f", 0);
+    assert(f != -1);
+    assert(tfs_read(f, read_back, sizeof(read_back)) == PIPE_SIZE + 5);
+    for (size_t i = 0; i < PIPE_SIZE; i++) {
+        assert(read_back[i] == file_byte(SHM_CLIENTS, i));
+    }
+    assert(read_back[PIPE_SIZE] == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_lookup("/missing") == -1);
+
+    f = tfs_open("/f0", 0);
+    assert(f != -1);
+    assert(tfs_shutdown_after_all_closed() == -1);
+    assert(tfs_close(f) != -1);
+
+    assert(write(go[1], "g", 1) == 1);
+    assert(tfs_shutdown_after_all_closed() == 0);
+    int status;
+    assert(waitpid(holder, &status, 0) == holder);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    client_path(path, SHM_CLIENTS + 2);
+    assert(unlink(path) == 0);
+    strcat(path, TFS_REQUEST_PIPE_SUFFIX);
+    assert(unlink(path) == 0);
+
+    assert(waitpid(server, &status, 0) == server);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    assert(access(server_pipe, F_OK) == -1);
+    assert(tfs_lookup("/f0") == -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
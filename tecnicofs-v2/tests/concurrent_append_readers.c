@@ -0,0 +1,82 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#define READERS 8
+#define RECORD 300
+#define RECORDS 400
+
+/**
+   This test has one thread append fixed-size records to a file while
+   several others poll it, both with positional reads and through handles
+   opened in append mode, checking that they only ever see whole records
+   with the right contents and that end of file is reported as soon as they
+   catch up with the writer
+ */
+
+int fd;
+
+static void fill(char *record, size_t n) {
+    for (size_t j = 0; j < RECORD; j++) {
+        record[j] = (char)('a' + (n + j) % 26);
+    }
+}
+
+void *writer(void *arg) {
+    (void)arg;
+    char record[RECORD];
+    for (size_t n = 0; n < RECORDS; n++) {
+        fill(record, n);
+        assert(tfs_write(fd, record, RECORD) == RECORD);
+    }
+    return NULL;
+}
+
+void *reader(void *arg) {
+    (void)arg;
+    char record[RECORD], output[RECORD];
+    size_t n = 0;
+    while (n < RECORDS) {
+        ssize_t r = tfs_pread(fd, output, RECORD, n * RECORD);
+        assert(r == 0 || r == RECORD);
+        if (r == 0) {
+            /* Caught up with the writer: an appending handle must start
+             * at a record boundary, so it may only see whole records */
+            int afd = tfs_open("/f1", TFS_O_APPEND);
+            assert(afd != -1);
+            r = tfs_read(afd, output, RECORD);
+            assert(r == 0 || r == RECORD);
+            assert(tfs_close(afd) != -1);
+            continue;
+        }
+        fill(record, n);
+        assert(memcmp(record, output, RECORD) == 0);
+        n++;
+    }
+    assert(tfs_pread(fd, output, RECORD, n * RECORD) == 0);
+    return NULL;
+}
+
+int main() {
+    pthread_t tid[READERS + 1];
+
+    assert(tfs_init() != -1);
+
+    fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+
+    for (size_t i = 0; i < READERS; i++) {
+        assert(pthread_create(&tid[i], NULL, reader, NULL) == 0);
+    }
+    assert(pthread_create(&tid[READERS], NULL, writer, NULL) == 0);
+    for (int i = 0; i <= READERS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    assert(tfs_close(fd) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
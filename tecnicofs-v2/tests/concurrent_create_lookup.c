@@ -0,0 +1,70 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define THREADS 4
+#define FILES_PER_THREAD 4
+
+/**
+   This test has several threads creating the same file and a few distinct
+   files of their own at the same time, then checks that every name maps to
+   exactly one i-node
+ */
+
+int shared_inumbers[THREADS];
+
+void *create_files(void *arg) {
+    int id = *(int *)arg;
+    char path[MAX_FILE_NAME];
+
+    int fd = tfs_open("/shared", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    shared_inumbers[id] = tfs_lookup("/shared");
+    assert(shared_inumbers[id] != -1);
+
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        snprintf(path, sizeof(path), "/t%d_f%d", id, i);
+        fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_close(fd) != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t tid[THREADS];
+    int ids[THREADS];
+    char path[MAX_FILE_NAME];
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tid[i], NULL, create_files, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        pthread_join(tid[i], NULL);
+    }
+
+    /* Everyone must have ended up with the same file */
+    for (int i = 1; i < THREADS; i++) {
+        assert(shared_inumbers[i] == shared_inumbers[0]);
+    }
+
+    for (int t = 0; t < THREADS; t++) {
+        for (int i = 0; i < FILES_PER_THREAD; i++) {
+            snprintf(path, sizeof(path), "/t%d_f%d", t, i);
+            int inum = tfs_lookup(path);
+            assert(inum != -1);
+            assert(inum != shared_inumbers[0]);
+        }
+    }
+    assert(tfs_lookup("/missing") == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#define THREADS 8
+#define BLOCKS_PER_FILE 100
+#define CHUNK 700
+#define FILE_SIZE (BLOCKS_PER_FILE * BLOCK_SIZE)
+#define BIG_SIZE ((DATA_BLOCKS - 100) * BLOCK_SIZE)
+
+/**
+   This test has several threads each write a file of its own, in parallel,
+   while other threads read those files back through their own handles,
+   then reuses the space freed by truncating them all for a single file
+   larger than any block group
+ */
+
+char big[BIG_SIZE];
+
+static char pattern(size_t file, size_t pos) {
+    return (char)('a' + (file * 7 + pos) % 26);
+}
+
+void *writer(void *arg) {
+    size_t id = (size_t)arg;
+    char path[] = "/f0";
+    path[2] = (char)('0' + id);
+    char input[CHUNK];
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    for (size_t off = 0; off < FILE_SIZE; off += CHUNK) {
+        size_t len = off + CHUNK > FILE_SIZE ? FILE_SIZE - off : CHUNK;
+        for (size_t j = 0; j < len; j++) {
+            input[j] = pattern(id, off + j);
+        }
+        assert(tfs_write(fd, input, len) == len);
+    }
+    assert(tfs_close(fd) != -1);
+    return NULL;
+}
+
+void *reader(void *arg) {
+    size_t id = (size_t)arg;
+    char path[] = "/f0";
+    path[2] = (char)('0' + id);
+    char output[CHUNK];
+
+    /* Wait for the writer to create the file, then read whatever it has
+     * written so far, which must always be a prefix of the pattern */
+    int fd;
+    while ((fd = tfs_open(path, 0)) == -1) {
+    }
+    size_t total = 0;
+    while (total < FILE_SIZE) {
+        ssize_t r = tfs_read(fd, output, CHUNK);
+        assert(r != -1);
+        for (size_t j = 0; j < (size_t)r; j++) {
+            assert(output[j] == pattern(id, total + j));
+        }
+        total += (size_t)r;
+    }
+    assert(tfs_read(fd, output, CHUNK) == 0);
+    assert(tfs_close(fd) != -1);
+    return NULL;
+}
+
+int main() {
+    pthread_t writers[THREADS], readers[THREADS];
+
+    assert(tfs_init() != -1);
+
+    for (size_t i = 0; i < THREADS; i++) {
+        assert(pthread_create(&writers[i], NULL, writer, (void *)i) == 0);
+        assert(pthread_create(&readers[i], NULL, reader, (void *)i) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(writers[i], NULL) == 0);
+        assert(pthread_join(readers[i], NULL) == 0);
+    }
+
+    /* Free every file's blocks and fill most of the FS with one file */
+    for (size_t i = 1; i < THREADS; i++) {
+        char path[] = "/f0";
+        path[2] = (char)('0' + i);
+        int fd = tfs_open(path, TFS_O_TRUNC);
+        assert(fd != -1);
+        assert(tfs_close(fd) != -1);
+    }
+    for (size_t j = 0; j < BIG_SIZE; j++) {
+        big[j] = pattern(THREADS, j);
+    }
+    int fd = tfs_open("/f0", TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_write(fd, big, BIG_SIZE) == BIG_SIZE);
+    memset(big, 0, BIG_SIZE);
+    assert(tfs_pread(fd, big, BIG_SIZE, 0) == BIG_SIZE);
+    for (size_t j = 0; j < BIG_SIZE; j++) {
+        assert(big[j] == pattern(THREADS, j));
+    }
+    assert(tfs_close(fd) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIZE ((3 * COPY_CHUNK_BLOCKS + 5) * BLOCK_SIZE + 123)
+#define TAIL (2 * BLOCK_SIZE + 7)
+#define DEST "copy_to_external_large.out"
+#define FIFO "copy_to_external_large.fifo"
+
+/**
+   This test copies out a file spanning several chunks, made of many runs
+   of blocks and with its last bytes still waiting to get blocks, checking
+   the result; then copies a smaller file over it, checking that the
+   destination is replaced with exactly the new contents. Last, copies it
+   into a FIFO that is not read from until the file was written to, which
+   must not wait for the copy
+ */
+
+char buffer[SIZE];
+char read_back[SIZE + 1];
+
+static void *export_to_fifo(void *arg) {
+    *(int *)arg = tfs_copy_to_external_fs("/big", FIFO);
+    return NULL;
+}
+
+static size_t read_external(char const *path) {
+    FILE *fp = fopen(path, "r");
+    assert(fp != NULL);
+    size_t n = fread(read_back, 1, sizeof(read_back), fp);
+    assert(fclose(fp) == 0);
+    return n;
+}
+
+int main() {
+    for (size_t i = 0; i < SIZE; i++) {
+        buffer[i] = (char)('0' + i % 61);
+    }
+
+    assert(tfs_init() != -1);
+
+    /* Blocks taken in turns with another file, so that they are not
+     * contiguous */
+    int f = tfs_open("/big", TFS_O_CREAT);
+    assert(f != -1);
+    int g = tfs_open("/other", TFS_O_CREAT);
+    assert(g != -1);
+    for (size_t off = 0; off < SIZE - TAIL; off += 5 * BLOCK_SIZE) {
+        size_t n = SIZE - TAIL - off < 5 * BLOCK_SIZE ? SIZE - TAIL - off
+                                                       : 5 * BLOCK_SIZE;
+        assert(tfs_write(f, buffer + off, n) == (ssize_t)n);
+        assert(tfs_fsync(f) != -1);
+        assert(tfs_write(g, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+        assert(tfs_fsync(g) != -1);
+    }
+    assert(tfs_write(f, buffer + SIZE - TAIL, TAIL) == TAIL);
+
+    assert(tfs_copy_to_external_fs("/big", DEST) != -1);
+    assert(read_external(DEST) == SIZE);
+    assert(memcmp(buffer, read_back, SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* A smaller file replaces it */
+    assert(tfs_close(g) != -1);
+    g = tfs_open("/other", TFS_O_TRUNC);
+    assert(g != -1);
+    assert(tfs_write(g, "small", 5) == 5);
+    assert(tfs_close(g) != -1);
+    assert(tfs_copy_to_external_fs("/other", DEST) != -1);
+    assert(read_external(DEST) == 5);
+    assert(memcmp(read_back, "small", 5) == 0);
+
+    unlink(FIFO);
+    assert(mkfifo(FIFO, 0600) == 0);
+    int reader = open(FIFO, O_RDONLY | O_NONBLOCK);
+    assert(reader != -1);
+    pthread_t tid;
+    int exported = -1;
+    assert(pthread_create(&tid, NULL, export_to_fifo, &exported) == 0);
+    /* Until the FIFO is full and the copy stuck writing to it */
+    struct timespec pause = {0, 10 * 1000 * 1000};
+    int queued = 0, last = -1;
+    while (queued == 0 || queued != last) {
+        last = queued;
+        nanosleep(&pause, NULL);
+        assert(ioctl(reader, FIONREAD, &queued) == 0);
+    }
+    f = tfs_open("/big", 0);
+    assert(f != -1);
+    assert(tfs_pwrite(f, "!", 1, 0) == 1);
+    assert(tfs_close(f) != -1);
+
+    size_t got = 0;
+    for (;;) {
+        ssize_t n = read(reader, read_back + got, sizeof(read_back) - got);
+        if (n == 0) break;
+        if (n == -1) {
+            assert(errno == EAGAIN);
+            nanosleep(&pause, NULL);
+            continue;
+        }
+        got += (size_t)n;
+    }
+    assert(pthread_join(tid, NULL) == 0);
+    assert(exported == 0 && got == SIZE);
+    assert(memcmp(buffer + 1, read_back + 1, SIZE - 1) == 0);
+    assert(close(reader) == 0);
+    assert(unlink(FIFO) == 0);
+
+    /* Directories are not copied */
+    assert(tfs_mkdir("/d") != -1);
+    assert(tfs_copy_to_external_fs("/d", DEST) == -1);
+
+    assert(unlink(DEST) == 0);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
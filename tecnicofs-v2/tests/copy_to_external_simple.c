@@ -1,6 +1,7 @@
 #include "fs/operations.h"
 #include <assert.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 int main() {
@@ -31,6 +32,20 @@ int main() {
 
     assert(fclose(fp) != -1);
 
+    /* Copying over an existing, longer file rewrites it in place, keeping
+     * its mode and its other links */
+    char *link_path = "external_link.txt";
+    unlink(link_path);
+    assert(link(path2, link_path) == 0);
+    assert(chmod(path2, 0600) == 0);
+    assert(truncate(path2, 100) == 0);
+    assert(tfs_copy_to_external_fs(path, path2) != -1);
+    struct stat st;
+    assert(stat(link_path, &st) == 0);
+    assert(st.st_nlink == 2 && (st.st_mode & 0777) == 0600);
+    assert(st.st_size == (off_t)strlen(str));
+
+    unlink(link_path);
     unlink(path2);
 
     printf("Successful test.\n");
@@ -0,0 +1,94 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define CHUNK 100
+#define CHUNKS 300
+#define SIZE (CHUNK * CHUNKS)
+
+/**
+   This test appends to two files in small interleaved writes, which would
+   otherwise take turns getting blocks, checking that their data can be
+   read back before they are flushed, and that once closed each file is
+   stored in a single contiguous run; then checks that tfs_fsync() flushes
+   a file that stays open, and that truncating a file with data still
+   waiting drops it
+ */
+
+char expected[2][SIZE];
+char buffer[SIZE + 1];
+
+static size_t extent_count(char const *name) {
+    int inumber = tfs_lookup(name);
+    assert(inumber != -1);
+    inode_t *inode = inode_get(inumber);
+    assert(inode != NULL);
+    return inode->i_extent_count;
+}
+
+static void check(char const *name, char const *contents, size_t size) {
+    int f = tfs_open(name, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == size);
+    assert(memcmp(buffer, contents, size) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    char const *names[2] = {"/f1", "/f2"};
+    int f[2];
+
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < 2; i++) {
+        for (size_t j = 0; j < SIZE; j++) {
+            expected[i][j] = (char)('a' + (size_t)i * 13 + j % 13);
+        }
+        f[i] = tfs_open(names[i], TFS_O_CREAT);
+        assert(f[i] != -1);
+    }
+    for (size_t off = 0; off < SIZE; off += CHUNK) {
+        for (int i = 0; i < 2; i++) {
+            assert(tfs_write(f[i], expected[i] + off, CHUNK) == CHUNK);
+        }
+    }
+
+    /* Not flushed yet, but readable */
+    for (int i = 0; i < 2; i++) {
+        assert(tfs_pread(f[i], buffer, SIZE, 0) == SIZE);
+        assert(memcmp(buffer, expected[i], SIZE) == 0);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        assert(tfs_close(f[i]) != -1);
+        assert(extent_count(names[i]) == 1);
+        check(names[i], expected[i], SIZE);
+    }
+
+    /* Written past the end, leaving a hole, and flushed while open */
+    int g = tfs_open("/f3", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_pwrite(g, expected[0], CHUNK, 2 * BLOCK_SIZE) == CHUNK);
+    assert(tfs_fsync(g) != -1);
+    assert(extent_count("/f3") == 1);
+    assert(tfs_pread(g, buffer, sizeof(buffer), 0) == 2 * BLOCK_SIZE + CHUNK);
+    for (size_t j = 0; j < 2 * BLOCK_SIZE; j++) {
+        assert(buffer[j] == 0);
+    }
+    assert(memcmp(buffer + 2 * BLOCK_SIZE, expected[0], CHUNK) == 0);
+
+    /* Data still waiting is dropped with the rest of the file */
+    assert(tfs_write(g, expected[1], SIZE) == SIZE);
+    int h = tfs_open("/f3", TFS_O_TRUNC);
+    assert(h != -1);
+    assert(tfs_write(h, expected[1], CHUNK) == CHUNK);
+    assert(tfs_close(h) != -1);
+    assert(tfs_close(g) != -1);
+    check("/f3", expected[1], CHUNK);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
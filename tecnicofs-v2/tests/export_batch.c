@@ -0,0 +1,96 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FILES 12
+#define WORKERS 4
+#define MAX_SIZE (20 * BLOCK_SIZE)
+
+/**
+   This test exports a batch of files of different sizes (one of which
+   does not exist) with several workers, checking the contents of every
+   copy, the status and size reported for each file, and that progress
+   was reported once per file
+ */
+
+char buffer[MAX_SIZE];
+char read_back[MAX_SIZE + 1];
+char sources[FILES][MAX_FILE_NAME];
+char dests[FILES][MAX_FILE_NAME];
+
+static _Atomic size_t reported;
+static _Atomic size_t reported_bytes;
+
+static size_t file_size(size_t f) { return f * MAX_SIZE / (FILES - 1); }
+
+static void fill(size_t f) {
+    for (size_t i = 0; i < file_size(f); i++) {
+        buffer[i] = (char)('a' + (f + i) % 26);
+    }
+}
+
+static void progress(tfs_export_t const *file, void *arg) {
+    assert(arg == &reported);
+    assert(file->seconds >= 0);
+    atomic_fetch_add(&reported, 1);
+    atomic_fetch_add(&reported_bytes, file->bytes);
+}
+
+int main() {
+    tfs_export_t files[FILES];
+
+    assert(tfs_init() != -1);
+
+    for (size_t f = 0; f < FILES; f++) {
+        snprintf(sources[f], MAX_FILE_NAME, "/f%zu", f);
+        snprintf(dests[f], MAX_FILE_NAME, "export_batch_%zu.out", f);
+        files[f].source_path = sources[f];
+        files[f].dest_path = dests[f];
+        if (f == FILES / 2) {
+            continue; /* not created */
+        }
+        fill(f);
+        int fd = tfs_open(sources[f], TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_write(fd, buffer, file_size(f)) == (ssize_t)file_size(f));
+        assert(tfs_close(fd) != -1);
+    }
+
+    assert(tfs_export_batch(files, FILES, WORKERS, progress, &reported) ==
+           -1);
+    assert(reported == FILES);
+
+    size_t total = 0;
+    for (size_t f = 0; f < FILES; f++) {
+        if (f == FILES / 2) {
+            assert(files[f].status == -1 && files[f].bytes == 0);
+            assert(access(dests[f], F_OK) == -1);
+            continue;
+        }
+        assert(files[f].status == 0 && files[f].bytes == file_size(f));
+        total += files[f].bytes;
+
+        fill(f);
+        FILE *fp = fopen(dests[f], "r");
+        assert(fp != NULL);
+        assert(fread(read_back, 1, sizeof(read_back), fp) == file_size(f));
+        assert(memcmp(buffer, read_back, file_size(f)) == 0);
+        assert(fclose(fp) == 0);
+        assert(unlink(dests[f]) == 0);
+    }
+    assert(reported_bytes == total);
+
+    /* Every file there this time */
+    files[FILES / 2] = files[0];
+    assert(tfs_export_batch(files, FILES, WORKERS, NULL, NULL) == 0);
+    for (size_t f = 0; f < FILES; f++) {
+        assert(f == FILES / 2 || unlink(dests[f]) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
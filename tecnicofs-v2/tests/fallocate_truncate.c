@@ -0,0 +1,134 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define RESERVED 40
+#define CHUNK 100
+#define FRAGMENTS 120
+#define KEEP 30
+
+/**
+   This test preallocates a file and checks that it is stored in a single
+   run that later writes (interleaved with another file's) do not add to;
+   then grows and shrinks files with tfs_ftruncate(), checking that what
+   grows reads as zeros and that what shrinks gives its blocks back, also
+   for a file whose extents spill into the indirect trees; with the FS
+   nearly full, growing a file past what is left must fail without
+   keeping any of the blocks it got
+ */
+
+char buffer[FRAGMENTS * BLOCK_SIZE];
+char read_back[FRAGMENTS * BLOCK_SIZE];
+
+static inode_t *inode_of(char const *name) {
+    int inumber = tfs_lookup(name);
+    assert(inumber != -1);
+    inode_t *inode = inode_get(inumber);
+    assert(inode != NULL);
+    return inode;
+}
+
+static void fill_block(char *block, size_t i) {
+    memset(block, (int)('a' + i % 26), BLOCK_SIZE);
+}
+
+int main() {
+    assert(tfs_init() != -1);
+
+    /* Preallocated: one run, size unchanged */
+    int f = tfs_open("/pre", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_fallocate(f, 0, RESERVED * BLOCK_SIZE) != -1);
+    inode_t *pre = inode_of("/pre");
+    assert(pre->i_blocks == RESERVED && pre->i_extent_count == 1);
+    assert(tfs_read(f, read_back, 1) == 0);
+
+    int g = tfs_open("/other", TFS_O_CREAT);
+    assert(g != -1);
+    memset(buffer, 'P', RESERVED * BLOCK_SIZE);
+    for (size_t off = 0; off < RESERVED * BLOCK_SIZE; off += CHUNK) {
+        size_t n = RESERVED * BLOCK_SIZE - off < CHUNK
+                       ? RESERVED * BLOCK_SIZE - off
+                       : CHUNK;
+        assert(tfs_write(f, buffer + off, n) == (ssize_t)n);
+        assert(tfs_write(g, "x", 1) == 1);
+        assert(tfs_fsync(g) != -1);
+    }
+    assert(tfs_close(g) != -1);
+    assert(pre->i_blocks == RESERVED && pre->i_extent_count == 1);
+    assert(tfs_pread(f, read_back, sizeof(read_back), 0) ==
+           RESERVED * BLOCK_SIZE);
+    assert(memcmp(buffer, read_back, RESERVED * BLOCK_SIZE) == 0);
+
+    /* Shrunk into a block and grown back: the tail reads as zeros */
+    assert(tfs_ftruncate(f, 10) != -1);
+    assert(pre->i_blocks == 1);
+    assert(tfs_ftruncate(f, 3 * BLOCK_SIZE) != -1);
+    assert(tfs_pread(f, read_back, sizeof(read_back), 0) == 3 * BLOCK_SIZE);
+    assert(memcmp(buffer, read_back, 10) == 0);
+    for (size_t i = 10; i < 3 * BLOCK_SIZE; i++) {
+        assert(read_back[i] == 0);
+    }
+    assert(tfs_ftruncate(f, 0) != -1);
+    assert(pre->i_blocks == 0 && pre->i_extent_count == 0);
+    assert(tfs_close(f) != -1);
+
+    /* One block at a time, flushed in turns with another file, so that
+     * every block is an extent of its own */
+    f = tfs_open("/frag", TFS_O_CREAT);
+    assert(f != -1);
+    g = tfs_open("/other", 0);
+    assert(g != -1);
+    for (size_t i = 0; i < FRAGMENTS; i++) {
+        fill_block(buffer + i * BLOCK_SIZE, i);
+        assert(tfs_write(f, buffer + i * BLOCK_SIZE, BLOCK_SIZE) ==
+               BLOCK_SIZE);
+        assert(tfs_fsync(f) != -1);
+        assert(tfs_write(g, read_back, BLOCK_SIZE) == BLOCK_SIZE);
+        assert(tfs_fsync(g) != -1);
+    }
+    inode_t *frag = inode_of("/frag");
+    assert(frag->i_extent_count == FRAGMENTS);
+
+    /* Cut back into the first indirect tree, then grown again past it */
+    assert(tfs_ftruncate(f, KEEP * BLOCK_SIZE + 5) != -1);
+    assert(frag->i_blocks == KEEP + 1 && frag->i_extent_count == KEEP + 1);
+    assert(tfs_pwrite(f, buffer + (KEEP + 1) * BLOCK_SIZE,
+                      (FRAGMENTS - KEEP - 1) * BLOCK_SIZE,
+                      (KEEP + 1) * BLOCK_SIZE) ==
+           (FRAGMENTS - KEEP - 1) * BLOCK_SIZE);
+    assert(tfs_fsync(f) != -1);
+    memset(buffer + KEEP * BLOCK_SIZE + 5, 0, BLOCK_SIZE - 5);
+    assert(tfs_pread(f, read_back, sizeof(read_back), 0) ==
+           FRAGMENTS * BLOCK_SIZE);
+    assert(memcmp(buffer, read_back, FRAGMENTS * BLOCK_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_close(g) != -1);
+
+    /* Every block given back can be reserved again */
+    f = tfs_open("/frag", TFS_O_TRUNC);
+    assert(f != -1);
+    g = tfs_open("/other", TFS_O_TRUNC);
+    assert(g != -1);
+    assert(tfs_close(g) != -1);
+    assert(tfs_fallocate(f, 0, (DATA_BLOCKS - 8) * BLOCK_SIZE) != -1);
+
+    g = tfs_open("/full", TFS_O_CREAT);
+    assert(g != -1);
+    assert(tfs_fallocate(g, 0, BLOCK_SIZE) != -1);
+    inode_t *full = inode_of("/full");
+    assert(tfs_fallocate(g, 0, 16 * BLOCK_SIZE) == -1);
+    assert(full->i_blocks == 1);
+    assert(tfs_ftruncate(g, 16 * BLOCK_SIZE) == -1);
+    assert(full->i_blocks == 1 && full->i_size == 0);
+    assert(tfs_fallocate(g, 0, 4 * BLOCK_SIZE) != -1);
+    assert(tfs_close(g) != -1);
+    assert(tfs_ftruncate(f, 0) != -1);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
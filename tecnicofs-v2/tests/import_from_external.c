@@ -0,0 +1,107 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SRC "import_src"
+#define HUGE "import_huge"
+#define LARGE (80 * BLOCK_SIZE + 3)
+#define WORKERS 3
+
+/**
+   This test imports a host directory tree, with empty, small and large
+   files and nested directories, using several workers, and checks every
+   file (the large one stored in a single run); then copies single files
+   in, over an existing file, from a source that does not exist and from
+   one too large for the FS, which must leave no blocks behind
+ */
+
+static struct {
+    char const *host;
+    char const *tfs;
+    size_t size;
+} const files[] = {
+    {SRC "/empty", "/imp/empty", 0},
+    {SRC "/small", "/imp/small", 100},
+    {SRC "/large", "/imp/large", LARGE},
+    {SRC "/sub/d", "/imp/sub/d", 3 * BLOCK_SIZE},
+    {SRC "/sub/deeper/e", "/imp/sub/deeper/e", 10},
+};
+#define FILES (sizeof(files) / sizeof(files[0]))
+
+char buffer[LARGE];
+char read_back[LARGE + 1];
+
+static void fill(size_t f) {
+    for (size_t i = 0; i < files[f].size; i++) {
+        buffer[i] = (char)('A' + (f * 7 + i) % 53);
+    }
+}
+
+static void check(char const *path, size_t size) {
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, read_back, sizeof(read_back)) == (ssize_t)size);
+    assert(memcmp(buffer, read_back, size) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+int main() {
+    assert(mkdir(SRC, 0755) == 0);
+    assert(mkdir(SRC "/sub", 0755) == 0);
+    assert(mkdir(SRC "/sub/deeper", 0755) == 0);
+    for (size_t f = 0; f < FILES; f++) {
+        fill(f);
+        FILE *fp = fopen(files[f].host, "w");
+        assert(fp != NULL);
+        assert(fwrite(buffer, 1, files[f].size, fp) == files[f].size);
+        assert(fclose(fp) == 0);
+    }
+
+    assert(tfs_init() != -1);
+
+    assert(tfs_import_dir(SRC, "/imp", WORKERS) != -1);
+    for (size_t f = 0; f < FILES; f++) {
+        fill(f);
+        check(files[f].tfs, files[f].size);
+    }
+    inode_t *large = inode_get(tfs_lookup("/imp/large"));
+    assert(large != NULL && large->i_extent_count == 1);
+
+    /* Over a larger file, which is left with the new contents only */
+    fill(1);
+    assert(tfs_copy_from_external_fs(files[1].host, "/imp/large") != -1);
+    check("/imp/large", files[1].size);
+
+    assert(tfs_copy_from_external_fs(SRC "/missing", "/imp/missing") == -1);
+    assert(tfs_lookup("/imp/missing") == -1);
+
+    int fd = open(HUGE, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    assert(fd != -1);
+    assert(ftruncate(fd, (off_t)(DATA_BLOCKS + 1) * BLOCK_SIZE) == 0);
+    assert(close(fd) == 0);
+    assert(tfs_copy_from_external_fs(HUGE, "/imp/huge") == -1);
+    fd = tfs_open("/imp/huge", 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, read_back, 1) == 0);
+    assert(tfs_close(fd) != -1);
+    fill(2);
+    assert(tfs_copy_from_external_fs(files[2].host, "/imp/again") != -1);
+    check("/imp/again", files[2].size);
+    assert(unlink(HUGE) == 0);
+
+    assert(tfs_destroy() != -1);
+
+    for (size_t f = 0; f < FILES; f++) {
+        assert(unlink(files[f].host) == 0);
+    }
+    assert(rmdir(SRC "/sub/deeper") == 0);
+    assert(rmdir(SRC "/sub") == 0);
+    assert(rmdir(SRC) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,278 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define IMAGE "journal_recovery.img"
+#define JOURNAL IMAGE ".journal"
+#define THREADS 4
+#define FILES 5
+#define SIZE (3 * BLOCK_SIZE + 10)
+#define BIG (20 * BLOCK_SIZE)
+
+/**
+   This test has a child process create files in an image from several
+   threads at once (so that their commits are grouped) and exit without
+   destroying the FS, as if it crashed, leaving a partly written record at
+   the end of the journal. The FS is then initialized again from the image,
+   which must be recovered from the journal with every file and its
+   contents in place, and still usable; once destroyed, the journal must be
+   left empty. Two more crashes follow: one in the middle of a transaction,
+   none of whose changes may be found after recovery, and one after which
+   every page of the image but the superblock's is reverted to what the
+   last checkpoint wrote, as if none had reached the disk since, for the
+   journal alone to bring the committed changes back. Then, with the FS
+   full, a file is truncated in a
+   transaction that is kept open while another thread tries to get blocks
+   for a new file, which it must not be given: until the truncation
+   commits, the journal may still bring them back to the truncated file
+ */
+
+char big[BIG];
+
+static void fill(char *buffer, int t, int f) {
+    for (size_t i = 0; i < SIZE; i++) {
+        buffer[i] = (char)('a' + (size_t)(t * FILES + f) % 26 + i % 7);
+    }
+}
+
+static void file_name(char *name, int t, int f) {
+    snprintf(name, MAX_FILE_NAME, "/d/t%d_f%d", t, f);
+}
+
+static void *create_files(void *arg) {
+    int t = *(int *)arg;
+    char name[MAX_FILE_NAME];
+    char buffer[SIZE];
+
+    for (int f = 0; f < FILES; f++) {
+        file_name(name, t, f);
+        fill(buffer, t, f);
+        int fd = tfs_open(name, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_write(fd, buffer, SIZE) == SIZE);
+        assert(tfs_close(fd) != -1);
+    }
+    return NULL;
+}
+
+static void check_files() {
+    char name[MAX_FILE_NAME];
+    char expected[SIZE];
+    char buffer[SIZE + 1];
+
+    for (int t = 0; t < THREADS; t++) {
+        for (int f = 0; f < FILES; f++) {
+            file_name(name, t, f);
+            fill(expected, t, f);
+            int fd = tfs_open(name, 0);
+            assert(fd != -1);
+            assert(tfs_read(fd, buffer, sizeof(buffer)) == SIZE);
+            assert(memcmp(buffer, expected, SIZE) == 0);
+            assert(tfs_close(fd) != -1);
+        }
+    }
+}
+
+static void *reserve_other(void *arg) {
+    int fd = tfs_open("/d/other", TFS_O_CREAT);
+    assert(fd != -1);
+    *(int *)arg = tfs_fallocate(fd, 0, BIG);
+    assert(tfs_close(fd) != -1);
+    return NULL;
+}
+
+/*
+ * Creates a file holding SIZE copies of a byte
+ */
+static void create_filled(char const *name, char c) {
+    char buffer[SIZE];
+    memset(buffer, c, SIZE);
+    int fd = tfs_open(name, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, buffer, SIZE) == SIZE);
+    assert(tfs_close(fd) != -1);
+}
+
+/*
+ * Checks that a file holds len copies of a byte, or just its length if c
+ * is 0
+ */
+static void check_filled(char const *name, char c, size_t len) {
+    char *buffer = malloc(len + 1);
+    assert(buffer != NULL);
+    int fd = tfs_open(name, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, len + 1) == (ssize_t)len);
+    for (size_t i = 0; c != 0 && i < len; i++) {
+        assert(buffer[i] == c);
+    }
+    assert(tfs_close(fd) != -1);
+    free(buffer);
+}
+
+static void wait_child(pid_t pid) {
+    int status;
+    assert(pid != -1);
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static off_t journal_size() {
+    struct stat st;
+    assert(stat(JOURNAL, &st) == 0);
+    return st.st_size;
+}
+
+int main() {
+    unlink(IMAGE);
+    unlink(JOURNAL);
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        pthread_t tid[THREADS];
+        int ids[THREADS];
+
+        assert(tfs_init_image(IMAGE) != -1);
+        assert(tfs_mkdir("/d") != -1);
+        for (int t = 0; t < THREADS; t++) {
+            ids[t] = t;
+            assert(pthread_create(&tid[t], NULL, create_files, &ids[t]) == 0);
+        }
+        for (int t = 0; t < THREADS; t++) {
+            assert(pthread_join(tid[t], NULL) == 0);
+        }
+        _exit(0);
+    }
+    wait_child(pid);
+
+    /* A record cut short by the crash */
+    assert(journal_size() > 0);
+    int fd = open(JOURNAL, O_WRONLY | O_APPEND);
+    assert(fd != -1);
+    char torn[20];
+    memset(torn, 0x5a, sizeof(torn));
+    assert(write(fd, torn, sizeof(torn)) == sizeof(torn));
+    assert(close(fd) == 0);
+
+    assert(tfs_init_image(IMAGE) != -1);
+    check_files();
+
+    /* The recovered bitmaps keep new files away from the old ones */
+    char buffer[SIZE];
+    memset(buffer, 'Z', SIZE);
+    int f = tfs_open("/d/new", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, buffer, SIZE) == SIZE);
+    assert(tfs_close(f) != -1);
+    check_files();
+    assert(tfs_destroy() != -1);
+    assert(journal_size() == 0);
+
+    assert(tfs_init_image(IMAGE) != -1);
+    check_files();
+    assert(tfs_lookup("/d/new") != -1);
+
+    memset(big, 'B', BIG);
+    f = tfs_open("/d/big", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, big, BIG) == BIG);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    /* A crash in the middle of a transaction */
+    pid = fork();
+    if (pid == 0) {
+        assert(tfs_init_image(IMAGE) != -1);
+        create_filled("/d/late", 'L');
+        journal_begin();
+        f = tfs_open("/d/big", TFS_O_TRUNC);
+        assert(f != -1);
+        create_filled("/d/ghost", 'G');
+        assert(tfs_mkdir("/d/ghosts") != -1);
+        _exit(0);
+    }
+    wait_child(pid);
+
+    assert(tfs_init_image(IMAGE) != -1);
+    check_filled("/d/big", 'B', BIG);
+    check_filled("/d/late", 'L', SIZE);
+    assert(tfs_lookup("/d/ghost") == -1);
+    assert(tfs_lookup("/d/ghosts") == -1);
+    check_files();
+    assert(tfs_destroy() != -1);
+
+    /* A crash after which the image is as the last checkpoint left it */
+    fd = open(IMAGE, O_RDWR);
+    assert(fd != -1);
+    off_t image_size = lseek(fd, 0, SEEK_END);
+    assert(image_size > 0);
+    char *checkpointed = malloc((size_t)image_size);
+    assert(checkpointed != NULL);
+    assert(pread(fd, checkpointed, (size_t)image_size, 0) == image_size);
+
+    pid = fork();
+    if (pid == 0) {
+        assert(tfs_init_image(IMAGE) != -1);
+        create_filled("/d/later", 'M');
+        assert(tfs_mkdir("/d/e") != -1);
+        create_filled("/d/e/f", 'F');
+        _exit(0);
+    }
+    wait_child(pid);
+
+    /* The superblock, in the first page, was marked in use (and written)
+     * when the image was opened */
+    off_t page = sysconf(_SC_PAGESIZE);
+    assert(pwrite(fd, checkpointed + page, (size_t)(image_size - page),
+                  page) == image_size - page);
+    assert(close(fd) == 0);
+    free(checkpointed);
+
+    /* Their data was not synced, so only their length is known */
+    assert(tfs_init_image(IMAGE) != -1);
+    check_filled("/d/later", 0, SIZE);
+    check_filled("/d/e/f", 0, SIZE);
+    check_filled("/d/big", 'B', BIG);
+    check_files();
+    /* Its entry is made before the FS is full, so that only its blocks
+     * are left to get */
+    f = tfs_open("/d/other", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/d/fill", TFS_O_CREAT);
+    assert(f != -1);
+    for (size_t n = 1; tfs_fallocate(f, 0, n * BLOCK_SIZE) != -1; n++) {
+    }
+    assert(tfs_close(f) != -1);
+
+    journal_begin();
+    f = tfs_open("/d/big", TFS_O_TRUNC);
+    assert(f != -1);
+    pthread_t tid;
+    int reserved;
+    assert(pthread_create(&tid, NULL, reserve_other, &reserved) == 0);
+    assert(pthread_join(tid, NULL) == 0);
+    assert(reserved == -1);
+    assert(journal_commit() != -1);
+    assert(tfs_close(f) != -1);
+
+    assert(pthread_create(&tid, NULL, reserve_other, &reserved) == 0);
+    assert(pthread_join(tid, NULL) == 0);
+    assert(reserved == 0);
+    check_files();
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(IMAGE) == 0);
+    assert(unlink(JOURNAL) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define FILES (INODE_TABLE_SIZE - 1)
+
+/**
+   This test creates more files than fit in a single directory block,
+   so that the root directory has to grow, then checks that all of them
+   can be found and hold the expected contents
+ */
+
+int main() {
+    char path[MAX_FILE_NAME];
+    char buffer[MAX_FILE_NAME];
+
+    assert(FILES > MAX_DIR_ENTRIES);
+    assert(tfs_init() != -1);
+
+    for (int i = 0; i < FILES; i++) {
+        snprintf(path, sizeof(path), "/file%d", i);
+        int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_write(fd, path, strlen(path)) == strlen(path));
+        assert(tfs_close(fd) != -1);
+    }
+
+    /* The i-node table is now full */
+    assert(tfs_open("/one_too_many", TFS_O_CREAT) == -1);
+
+    for (int i = FILES - 1; i >= 0; i--) {
+        snprintf(path, sizeof(path), "/file%d", i);
+        assert(tfs_lookup(path) != -1);
+
+        int fd = tfs_open(path, 0);
+        assert(fd != -1);
+        ssize_t r = tfs_read(fd, buffer, sizeof(buffer) - 1);
+        assert(r == strlen(path));
+        buffer[r] = '\0';
+        assert(strcmp(buffer, path) == 0);
+        assert(tfs_close(fd) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#define THREADS 8
+#define HANDLES 600
+#define ROUNDS 3
+
+/**
+   This test has several threads keep thousands of handles open at once,
+   each reading through all of its handles, closing and reopening them in
+   a few rounds, and checks that handles which were closed are rejected
+   even after their entries have been reused
+ */
+
+char const contents[] = "AAA!";
+
+void *opener(void *arg) {
+    (void)arg;
+    int fds[HANDLES];
+    char output[sizeof(contents)];
+
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < HANDLES; i++) {
+            fds[i] = tfs_open("/f1", 0);
+            assert(fds[i] != -1);
+        }
+        for (int i = 0; i < HANDLES; i++) {
+            assert(tfs_read(fds[i], output, sizeof(output)) ==
+                   sizeof(contents));
+            assert(memcmp(output, contents, sizeof(contents)) == 0);
+        }
+        for (int i = 0; i < HANDLES; i++) {
+            assert(tfs_close(fds[i]) != -1);
+            assert(tfs_close(fds[i]) == -1);
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    pthread_t tid[THREADS];
+    char output[sizeof(contents)];
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(fd) != -1);
+
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, opener, NULL) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    /* A closed handle stays invalid when its entry is handed out again */
+    int stale = tfs_open("/f1", 0);
+    assert(stale != -1);
+    assert(tfs_close(stale) != -1);
+    fd = tfs_open("/f1", 0);
+    assert(fd != -1);
+    assert(fd != stale);
+    assert(tfs_read(stale, output, sizeof(output)) == -1);
+    assert(tfs_write(stale, contents, sizeof(contents)) == -1);
+    assert(tfs_close(stale) == -1);
+    assert(tfs_read(fd, output, sizeof(output)) == sizeof(contents));
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_read(-1, output, sizeof(output)) == -1);
+    assert(tfs_close(1 << 30) == -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+/**
+   This test builds a small directory tree, creates files at different
+   depths and checks that paths are resolved to the right files
+ */
+
+int main() {
+    char *str = "deep contents";
+    char buffer[40];
+
+    assert(tfs_init() != -1);
+
+    assert(tfs_mkdir("/job") != -1);
+    assert(tfs_mkdir("/job/partition") != -1);
+    assert(tfs_mkdir("/job/partition/shard") != -1);
+    assert(tfs_mkdir("/job") == -1);
+    assert(tfs_mkdir("/missing/dir") == -1);
+
+    int f = tfs_open("/job/partition/shard/data", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, str, strlen(str)) == strlen(str));
+    assert(tfs_close(f) != -1);
+
+    /* Same name in another directory is another file */
+    f = tfs_open("/job/data", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_lookup("/job/data") != tfs_lookup("/job/partition/shard/data"));
+
+    /* Repeated lookups (served from the dentry cache) and redundant
+       separators resolve to the same file */
+    int inum = tfs_lookup("/job/partition/shard/data");
+    assert(inum != -1);
+    assert(tfs_lookup("/job/partition/shard/data") == inum);
+    assert(tfs_lookup("//job//partition/shard/data") == inum);
+
+    f = tfs_open("/job/partition/shard/data", 0);
+    assert(f != -1);
+    ssize_t r = tfs_read(f, buffer, sizeof(buffer) - 1);
+    assert(r == strlen(str));
+    buffer[r] = '\0';
+    assert(strcmp(buffer, str) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* Bad paths */
+    assert(tfs_lookup("/job/nothing/data") == -1);
+    assert(tfs_lookup("/job/partition/shard/data/x") == -1);
+    assert(tfs_open("/job/nothing/data", TFS_O_CREAT) == -1);
+    assert(tfs_open("/job/partition/shard/data/x", TFS_O_CREAT) == -1);
+
+    /* Directories cannot be opened as files */
+    assert(tfs_open("/job/partition", 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
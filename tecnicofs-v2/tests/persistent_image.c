@@ -0,0 +1,93 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IMAGE "persistent_image.img"
+#define JOURNAL IMAGE ".journal"
+#define SIZE (12 * BLOCK_SIZE + 100)
+
+/**
+   This test writes a few files to a FS kept in an image file, destroys it,
+   and initializes it again from the image, checking that the files are
+   there (and that new files do not overwrite them), that an in-memory FS
+   started in between does not see them, and that a file that is not an
+   image is refused
+ */
+
+char buffer[SIZE];
+char read_back[SIZE];
+
+static double elapsed_ms(struct timespec const *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) * 1e3 +
+           (double)(now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+int main() {
+    unlink(IMAGE);
+    unlink(JOURNAL);
+    for (size_t i = 0; i < SIZE; i++) {
+        buffer[i] = (char)('A' + i % 26);
+    }
+
+    assert(tfs_init_image(IMAGE) != -1);
+    assert(tfs_mkdir("/d") != -1);
+    int f = tfs_open("/d/f1", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, buffer, SIZE) == SIZE);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    /* The in-memory FS starts empty, and leaves the image alone */
+    assert(tfs_init() != -1);
+    assert(tfs_lookup("/d/f1") == -1);
+    f = tfs_open("/other", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, "x", 1) == 1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    assert(tfs_init_image(IMAGE) != -1);
+    printf("image mapped in %.3f ms\n", elapsed_ms(&start));
+
+    assert(tfs_lookup("/other") == -1);
+    f = tfs_open("/d/f1", 0);
+    assert(f != -1);
+    assert(tfs_read(f, read_back, SIZE) == SIZE);
+    assert(memcmp(buffer, read_back, SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    /* Blocks and i-nodes in use are still taken */
+    f = tfs_open("/d/f2", TFS_O_CREAT);
+    assert(f != -1);
+    memset(read_back, 'z', SIZE);
+    assert(tfs_write(f, read_back, SIZE) == SIZE);
+    assert(tfs_close(f) != -1);
+    assert(tfs_lookup("/d/f2") != tfs_lookup("/d/f1"));
+    f = tfs_open("/d/f1", 0);
+    assert(f != -1);
+    assert(tfs_read(f, read_back, SIZE) == SIZE);
+    assert(memcmp(buffer, read_back, SIZE) == 0);
+    assert(tfs_close(f) != -1);
+    assert(tfs_destroy() != -1);
+
+    /* A file that is not an image is refused */
+    FILE *fp = fopen(IMAGE, "w");
+    assert(fp != NULL);
+    assert(fputs("not an image", fp) >= 0);
+    assert(fclose(fp) == 0);
+    assert(tfs_init_image(IMAGE) == -1);
+
+    assert(unlink(IMAGE) == 0);
+    assert(unlink(JOURNAL) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SIZE (40 * BLOCK_SIZE)
+#define THREADS 8
+#define READS 500
+#define CHUNK 3000
+
+/**
+   This test fills a file with positional writes out of order, checks that
+   a write past the end leaves a zeroed gap and that the handle's offset is
+   untouched, then has several threads issue random positional reads
+   through the same handle at once; finally, checks that a write past what
+   the FS can hold keeps none of the blocks it tried to map, and that one
+   whose end does not fit in a size_t is refused
+ */
+
+char expected[SIZE];
+int fd;
+
+void *reader(void *arg) {
+    unsigned int seed = (unsigned int)(size_t)arg;
+    char output[CHUNK];
+    for (int i = 0; i < READS; i++) {
+        size_t offset = (size_t)rand_r(&seed) % SIZE;
+        size_t len = (size_t)rand_r(&seed) % CHUNK + 1;
+        size_t want = offset + len > SIZE ? SIZE - offset : len;
+        assert(tfs_pread(fd, output, len, offset) == want);
+        assert(memcmp(output, expected + offset, want) == 0);
+    }
+    return NULL;
+}
+
+int main() {
+    char *path = "/f1";
+    char input[CHUNK];
+    char output[CHUNK];
+
+    assert(tfs_init() != -1);
+
+    fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+
+    /* Write the second half first, past the end of the empty file */
+    for (size_t off = SIZE / 2; off < SIZE; off += CHUNK) {
+        size_t len = off + CHUNK > SIZE ? SIZE - off : CHUNK;
+        for (size_t j = 0; j < len; j++) {
+            input[j] = (char)('a' + (off + j) % 26);
+        }
+        assert(tfs_pwrite(fd, input, len, off) == len);
+        memcpy(expected + off, input, len);
+    }
+
+    /* The gap reads as zeros and the handle's offset did not move */
+    assert(tfs_read(fd, output, CHUNK) == CHUNK);
+    for (size_t j = 0; j < CHUNK; j++) {
+        assert(output[j] == 0);
+    }
+    assert(tfs_pread(fd, output, CHUNK, SIZE) == 0);
+
+    /* Fill the first half backwards */
+    for (size_t off = SIZE / 2; off > 0;) {
+        size_t len = off > CHUNK ? CHUNK : off;
+        off -= len;
+        for (size_t j = 0; j < len; j++) {
+            input[j] = (char)('A' + (off + j) % 26);
+        }
+        assert(tfs_pwrite(fd, input, len, off) == len);
+        memcpy(expected + off, input, len);
+    }
+
+    pthread_t tid[THREADS];
+    for (size_t i = 0; i < THREADS; i++) {
+        assert(pthread_create(&tid[i], NULL, reader, (void *)(i + 1)) == 0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(tid[i], NULL) == 0);
+    }
+
+    /* Sequential reads resume where the single tfs_read above stopped */
+    assert(tfs_read(fd, output, CHUNK) == CHUNK);
+    assert(memcmp(output, expected + CHUNK, CHUNK) == 0);
+
+    assert(tfs_pwrite(fd, input, CHUNK, 4 * DATA_BLOCKS * BLOCK_SIZE) == 0);
+    assert(tfs_pwrite(fd, input, CHUNK, SIZE_MAX - 10) == -1);
+    assert(tfs_pread(fd, output, CHUNK, SIZE) == 0);
+    int other = tfs_open("/f2", TFS_O_CREAT);
+    assert(other != -1);
+    assert(tfs_write(other, input, CHUNK) == CHUNK);
+    assert(tfs_close(other) != -1);
+
+    assert(tfs_close(fd) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define BLOCKS 128
+#define SIZE (BLOCKS * BLOCK_SIZE)
+#define EVICT (2 * BUFFER_CACHE_SIZE * BLOCK_SIZE)
+#define CHUNK 256
+
+/**
+   This test scans a file front to back in small chunks, pausing after each
+   one until the read-ahead it asked for is done (as if processing it for
+   long enough), once its blocks have been pushed out of the cache, and
+   checks that read-ahead brought most of them in before they were read;
+   the contents read must be unaffected
+ */
+
+char buffer[EVICT];
+
+int main() {
+    char output[CHUNK];
+    size_t hits, misses, prev_hits, prev_misses;
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+    for (size_t i = 0; i < SIZE; i++) {
+        buffer[i] = (char)('a' + i % 26);
+    }
+    assert(tfs_write(fd, buffer, SIZE) == SIZE);
+    assert(tfs_close(fd) != -1);
+
+    /* Push the file's blocks out of the cache */
+    int other = tfs_open("/f2", TFS_O_CREAT);
+    assert(other != -1);
+    assert(tfs_write(other, buffer, EVICT) == EVICT);
+    assert(tfs_pread(other, buffer, EVICT, 0) == EVICT);
+    assert(tfs_close(other) != -1);
+
+    fd = tfs_open("/f1", 0);
+    assert(fd != -1);
+    buffer_cache_stats(&prev_hits, &prev_misses);
+    for (size_t off = 0; off < SIZE; off += CHUNK) {
+        assert(tfs_read(fd, output, CHUNK) == CHUNK);
+        for (size_t j = 0; j < CHUNK; j++) {
+            assert(output[j] == (char)('a' + (off + j) % 26));
+        }
+        data_blocks_prefetch_wait();
+    }
+    assert(tfs_read(fd, output, CHUNK) == 0);
+    buffer_cache_stats(&hits, &misses);
+    printf("%zu misses reading %d blocks\n", misses - prev_misses, BLOCKS);
+    assert(misses - prev_misses < BLOCKS / 4);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
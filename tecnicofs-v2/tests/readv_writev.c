@@ -0,0 +1,67 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define RECORDS 600
+#define BATCHES 3
+#define MAX_RECORD 37
+#define SLICE 101
+
+/**
+   This test appends batches of many small records of varying sizes (some
+   of them empty) with one vectored write each, then reads the whole file
+   back scattered over buffers of another size and checks every byte
+ */
+
+char records[BATCHES][RECORDS][MAX_RECORD];
+char expected[BATCHES * RECORDS * MAX_RECORD];
+char output[BATCHES * RECORDS * MAX_RECORD];
+
+int main() {
+    char *path = "/f1";
+    struct iovec iov[RECORDS];
+
+    assert(tfs_init() != -1);
+
+    size_t total = 0;
+    for (int b = 0; b < BATCHES; b++) {
+        size_t batch = 0;
+        for (int i = 0; i < RECORDS; i++) {
+            size_t len = (size_t)((b * RECORDS + i) * 7 % MAX_RECORD);
+            for (size_t j = 0; j < len; j++) {
+                records[b][i][j] = (char)('a' + (i + (int)j) % 26);
+            }
+            iov[i].iov_base = records[b][i];
+            iov[i].iov_len = len;
+            memcpy(expected + total + batch, records[b][i], len);
+            batch += len;
+        }
+
+        int fd = tfs_open(path, b == 0 ? TFS_O_CREAT : TFS_O_APPEND);
+        assert(fd != -1);
+        assert(tfs_writev(fd, iov, RECORDS) == batch);
+        assert(tfs_close(fd) != -1);
+        total += batch;
+    }
+
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_writev(fd, iov, -1) == -1);
+
+    /* Scatter the file over slices, asking for more than it holds */
+    size_t slices = (total + SLICE - 1) / SLICE + 1;
+    assert(slices <= RECORDS);
+    for (size_t i = 0; i < slices; i++) {
+        iov[i].iov_base = output + i * SLICE;
+        iov[i].iov_len = i * SLICE < total ? SLICE : 0;
+    }
+    assert(tfs_readv(fd, iov, (int)slices) == total);
+    assert(memcmp(output, expected, total) == 0);
+    assert(tfs_readv(fd, iov, (int)slices) == 0);
+
+    assert(tfs_close(fd) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
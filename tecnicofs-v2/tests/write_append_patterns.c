@@ -0,0 +1,69 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define SIZE 777
+#define COUNT 40
+#define APPENDS 5
+
+/**
+   This test writes a file spanning many blocks with writes that do not
+   align with block boundaries, each with different contents, appends to
+   it after reopening, then reads it back in chunks of another size and
+   checks every byte
+ */
+
+char expected[SIZE * (COUNT + APPENDS)];
+
+int main() {
+    char *path = "/f1";
+    char input[SIZE];
+    char output[500];
+
+    assert(tfs_init() != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    size_t total = 0;
+    for (int i = 0; i < COUNT; i++) {
+        for (int j = 0; j < SIZE; j++) {
+            input[j] = (char)('a' + (i + j) % 26);
+        }
+        assert(tfs_write(fd, input, SIZE) == SIZE);
+        memcpy(expected + total, input, SIZE);
+        total += SIZE;
+    }
+    assert(tfs_close(fd) != -1);
+
+    fd = tfs_open(path, TFS_O_APPEND);
+    assert(fd != -1);
+    for (int i = 0; i < APPENDS; i++) {
+        memset(input, '0' + i, SIZE);
+        assert(tfs_write(fd, input, SIZE) == SIZE);
+        memcpy(expected + total, input, SIZE);
+        total += SIZE;
+    }
+    assert(tfs_close(fd) != -1);
+
+    fd = tfs_open(path, 0);
+    assert(fd != -1);
+    size_t read = 0;
+    ssize_t r;
+    while ((r = tfs_read(fd, output, sizeof(output))) > 0) {
+        assert(memcmp(output, expected + read, (size_t)r) == 0);
+        read += (size_t)r;
+    }
+    assert(r == 0);
+    assert(read == total);
+    assert(tfs_close(fd) != -1);
+
+    /* Truncating empties the file */
+    fd = tfs_open(path, TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_read(fd, output, sizeof(output)) == 0);
+    assert(tfs_close(fd) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <string.h>
+
+#define BLOCKS 400
+
+/**
+   This test writes two files a block at a time, alternating between them,
+   so that their blocks end up interleaved and each file needs hundreds of
+   extents (spilling into the double indirect extent tree), then checks
+   both files' contents. It then writes a file larger than the old limit of
+   10 direct plus 256 indirect blocks.
+ */
+
+int main() {
+    char buffer[BLOCK_SIZE];
+
+    assert(tfs_init() != -1);
+
+    int a = tfs_open("/a", TFS_O_CREAT);
+    int b = tfs_open("/b", TFS_O_CREAT);
+    assert(a != -1 && b != -1);
+    for (int i = 0; i < BLOCKS; i++) {
+        memset(buffer, 'a' + i % 26, BLOCK_SIZE);
+        assert(tfs_write(a, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+        memset(buffer, 'A' + i % 26, BLOCK_SIZE);
+        assert(tfs_write(b, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(tfs_close(a) != -1);
+    assert(tfs_close(b) != -1);
+
+    a = tfs_open("/a", 0);
+    b = tfs_open("/b", 0);
+    assert(a != -1 && b != -1);
+    for (int i = 0; i < BLOCKS; i++) {
+        assert(tfs_read(a, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+        for (int j = 0; j < BLOCK_SIZE; j++) {
+            assert(buffer[j] == 'a' + i % 26);
+        }
+        assert(tfs_read(b, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+        for (int j = 0; j < BLOCK_SIZE; j++) {
+            assert(buffer[j] == 'A' + i % 26);
+        }
+    }
+    assert(tfs_read(a, buffer, BLOCK_SIZE) == 0);
+    assert(tfs_close(a) != -1);
+    assert(tfs_close(b) != -1);
+
+    /* Free all the space and use most of it for a single file */
+    assert(tfs_close(tfs_open("/a", TFS_O_TRUNC)) != -1);
+    assert(tfs_close(tfs_open("/b", TFS_O_TRUNC)) != -1);
+
+    int c = tfs_open("/c", TFS_O_CREAT);
+    assert(c != -1);
+    for (int i = 0; i < 2 * BLOCKS; i++) {
+        memset(buffer, '0' + i % 10, BLOCK_SIZE);
+        assert(tfs_write(c, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+    }
+    assert(tfs_close(c) != -1);
+
+    c = tfs_open("/c", 0);
+    assert(c != -1);
+    for (int i = 0; i < 2 * BLOCKS; i++) {
+        assert(tfs_read(c, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+        assert(buffer[0] == '0' + i % 10 && buffer[BLOCK_SIZE - 1] == buffer[0]);
+    }
+    assert(tfs_close(c) != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
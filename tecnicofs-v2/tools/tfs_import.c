@@ -0,0 +1,55 @@
+#include "../fs/operations.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+   Imports a directory tree of the host file system into a TecnicoFS kept
+   in an image file (which is created if it does not exist), using a pool
+   of worker threads
+
+   Usage: tfs_import IMAGE SOURCE_DIR [DEST_DIR [WORKERS]]
+ */
+
+#define DEFAULT_WORKERS 4
+
+int main(int argc, char **argv) {
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "usage: %s IMAGE SOURCE_DIR [DEST_DIR [WORKERS]]\n",
+                argv[0]);
+        return EXIT_FAILURE;
+    }
+    char const *dest_dir = argc > 3 ? argv[3] : "/";
+    size_t workers = DEFAULT_WORKERS;
+    if (argc > 4) {
+        char *end;
+        unsigned long n = strtoul(argv[4], &end, 10);
+        if (*end != '\0' || n == 0) {
+            fprintf(stderr, "%s: invalid number of workers: %s\n", argv[0],
+                    argv[4]);
+            return EXIT_FAILURE;
+        }
+        workers = n;
+    }
+
+    if (tfs_init_image(argv[1]) == -1) {
+        fprintf(stderr, "%s: cannot open image %s\n", argv[0], argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = tfs_import_dir(argv[2], dest_dir, workers);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (double)(end.tv_sec - start.tv_sec) * 1e3 +
+                (double)(end.tv_nsec - start.tv_nsec) / 1e6;
+
+    if (tfs_destroy() == -1 || ret == -1) {
+        fprintf(stderr, "%s: import of %s failed (after %.1f ms)\n", argv[0],
+                argv[2], ms);
+        return EXIT_FAILURE;
+    }
+    printf("%s imported into %s:%s in %.1f ms\n", argv[2], argv[1], dest_dir,
+           ms);
+    return EXIT_SUCCESS;
+}